@@ -0,0 +1,900 @@
+// Times the reader's hot paths on the host, over a library of generated books.
+//
+//   make -C bench
+//   bench/build/ereader-bench [--books N] [--chapters N] [--chapter-kb N]
+//                             [--entities N] [--depth N] [--seed N]
+//                             [--iterations N] [--corpus DIR] [--generate-only]
+//                             [--json FILE] [--label TEXT]
+//
+// Each stage runs over every book, --iterations times; the table shows the
+// median and fastest run, throughput over the bytes the stage takes in, the
+// C++ allocations and heap peak counted by the profiling build, and the peak
+// resident set size. Stages that go through the library's own PROFILE_SCOPE
+// timers also list how their time splits up. --json writes the same numbers
+// as one JSON object, tagged with --label (a commit hash, say), so runs can
+// be compared between commits.
+//
+// entities-2mb and entities-old decode one 2 MB chapter with the current
+// decoder and with the replace_all one it took over from.
+// zip-dir-500 and book-open-500 open one more book, of 500 short chapters.
+// reopen-cold and reopen-warm open each book at its first chapter, with an
+// empty disk cache and with one holding every chapter. library-index builds
+// the library-wide search index from nothing, and library-search runs one
+// query against it.
+//
+// book-oversized loads one more book, bigger than the reader's whole memory
+// budget; the run fails if any of its text goes missing or the heap peak
+// passes the budget.
+//
+// After the stages, each byte_scan finder is raced against the plain
+// byte-at-a-time loop it replaced, over the same XHTML or text, in bytes per
+// cycle: time-stamp counter cycles on x86, nanoseconds where there is none.
+//
+// Without --corpus the books are generated into a temporary directory and
+// removed afterwards; with it they are kept, and reused if they are there.
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "byte_scan.h"
+#include "entity_decoder.h"
+#include "epub_book.h"
+#include "epub_generator.h"
+#include "html_text.h"
+#include "legacy_entities.h"
+#include "library_index.h"
+#include "library_search.h"
+#include "profile.h"
+#include "search_index.h"
+#include "text_layout.h"
+#include "text_store.h"
+#include "zip_index.h"
+
+using namespace std;
+
+namespace {
+
+// The reader's own layout: 50-column lines, 28-line pages of 400 characters.
+const size_t lineWidth = 50;
+const size_t pageChars = 400;
+const size_t pageLines = 28;
+const size_t chapterCacheBytes = 4 * 1048576;
+const size_t bookMemoryBytes = 24 * 1048576; // the Old 3DS's budget, the tighter one
+const uint64_t diskCacheBytes = 256 * 1048576;
+const size_t shelves = 3; // books are spread over this many directories, two levels deep
+// A book over the memory budget, in chapters well past the eighth of it
+// that one chapter's text may take.
+const size_t oversizedChapters = 4;
+const size_t oversizedChapterBytes = 8 * 1048576;
+// A book with a long central directory, for the open-time stages.
+const size_t wideChapters = 500;
+const size_t wideChapterBytes = 4 * 1024;
+// The chapter the old and new entity decoders are raced on.
+const size_t largeChapterBytes = 2 * 1048576;
+
+struct Options {
+    SyntheticBook book;
+    size_t books;
+    size_t iterations;
+    string corpus;
+    bool keepCorpus;
+    bool generateOnly;
+    const char* jsonPath;
+    string label;
+};
+
+struct StageResult {
+    string name;
+    vector<double> milliseconds; // one per iteration
+    uint64_t bytes;              // taken in per iteration
+    uint64_t allocations;
+    size_t heapPeak;
+    size_t peakRss;              // KB
+    ProfileTotals profile;       // of the last iteration
+};
+
+// Chapters of one book, kept between stages so each stage times only itself.
+struct BookData {
+    string path;
+    vector<string> xhtml;
+    vector<string> text;
+    vector<vector<uint32_t>> lineStarts;
+};
+
+typedef const char* (*Finder)(const char* p, const char* end);
+
+// One byte_scan finder and the loop it replaced, over the same input.
+struct ScanComparison {
+    const char* name;
+    uint64_t bytes;
+    double kernelBytesPerCycle;
+    double scalarBytesPerCycle;
+};
+
+bool peakRssResets = false;
+
+// Linux resets the peak RSS when "5" is written to clear_refs.
+void resetPeakRss() {
+    FILE* file = fopen("/proc/self/clear_refs", "w");
+    if (!file) return;
+    peakRssResets = fputs("5", file) >= 0;
+    if (fclose(file) != 0) peakRssResets = false;
+}
+
+size_t peakRssKilobytes() {
+    FILE* file = fopen("/proc/self/status", "r");
+    if (!file) return 0;
+    char line[256];
+    size_t kilobytes = 0;
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "VmHWM: %zu kB", &kilobytes) == 1) break;
+    }
+    fclose(file);
+    return kilobytes;
+}
+
+StageResult runStage(const char* name, const Options& options, uint64_t bytes, const function<void()>& body) {
+    StageResult result;
+    result.name = name;
+    result.bytes = bytes;
+    result.allocations = 0;
+    result.heapPeak = 0;
+    result.peakRss = 0;
+    for (size_t i = 0; i < options.iterations; i++) {
+        resetPeakRss();
+        profileReset();
+        size_t heapBefore = profileTotals().heapPeak;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        body();
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+
+        result.milliseconds.push_back(elapsed.count());
+        result.profile = profileTotals();
+        result.allocations = max<uint64_t>(result.allocations, result.profile.counters[COUNTER_ALLOCATIONS]);
+        result.heapPeak = max(result.heapPeak, result.profile.heapPeak - min(result.profile.heapPeak, heapBefore));
+        result.peakRss = max(result.peakRss, peakRssKilobytes());
+    }
+    return result;
+}
+
+double median(vector<double> values) {
+    sort(values.begin(), values.end());
+    size_t middle = values.size() / 2;
+    return values.size() % 2 ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+}
+
+double fastest(const vector<double>& values) {
+    return *min_element(values.begin(), values.end());
+}
+
+double megabytesPerSecond(const StageResult& stage) {
+    double seconds = median(stage.milliseconds) / 1000;
+    return stage.bytes > 0 && seconds > 0 ? stage.bytes / 1048576.0 / seconds : 0;
+}
+
+bool makeDirectory(const string& path) {
+    return mkdir(path.c_str(), 0777) == 0 || errno == EEXIST;
+}
+
+string shelfOf(const Options& options, size_t book) {
+    char name[48];
+    snprintf(name, sizeof(name), "/shelf%zu", book % shelves);
+    return options.corpus + name + (book % 2 ? "/older" : "");
+}
+
+// Book i of the corpus, generated unless a kept corpus has it already.
+bool prepareBook(const Options& options, size_t i, string& path) {
+    string shelf = shelfOf(options, i);
+    if (!makeDirectory(shelf.substr(0, shelf.rfind("/older"))) || !makeDirectory(shelf)) {
+        fprintf(stderr, "Can't create %s\n", shelf.c_str());
+        return false;
+    }
+    char name[48];
+    snprintf(name, sizeof(name), "/book%03zu.epub", i + 1);
+    path = shelf + name;
+
+    struct stat info;
+    if (options.keepCorpus && stat(path.c_str(), &info) == 0) return true;
+
+    SyntheticBook book = options.book;
+    book.seed += (uint32_t)i;
+    string error;
+    if (!writeSyntheticEpub(path, book, error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return false;
+    }
+    return true;
+}
+
+void removeTree(const string& path) {
+    DIR* dir = opendir(path.c_str());
+    if (dir) {
+        while (dirent* entry = readdir(dir)) {
+            string name = entry->d_name;
+            if (name != "." && name != "..") removeTree(path + "/" + name);
+        }
+        closedir(dir);
+        rmdir(path.c_str());
+    }
+    else {
+        unlink(path.c_str());
+    }
+}
+
+// Reads every chapter of a book the way the reader does, without timing it.
+bool loadBook(const string& path, BookData& data) {
+    data.path = path;
+    ZipIndex zip;
+    if (!zip.open(path.c_str())) {
+        fprintf(stderr, "%s: %s\n", path.c_str(), zip.error().c_str());
+        return false;
+    }
+    for (const ZipEntry& entry : zip.entries()) {
+        if (entry.name.find("/chapter") == string::npos) continue;
+        string xhtml;
+        if (!zip.readEntry(entry, xhtml)) {
+            fprintf(stderr, "%s: %s\n", path.c_str(), zip.error().c_str());
+            return false;
+        }
+        data.xhtml.push_back(xhtml);
+    }
+
+    HtmlTextExtractor extractor;
+    for (const string& xhtml : data.xhtml) {
+        extractor.reset();
+        extractor.feed(xhtml.data(), xhtml.size());
+        extractor.finish();
+        data.text.push_back(extractor.text());
+        data.lineStarts.push_back(vector<uint32_t>());
+        breakLines(data.text.back(), lineWidth, data.lineStarts.back());
+    }
+    return true;
+}
+
+// Opening a book of many short chapters, where reading the central
+// directory and the spine is most of the work.
+bool runWideBook(const Options& options, vector<StageResult>& stages) {
+    char directory[] = "/tmp/ereader-wide-XXXXXX";
+    if (!mkdtemp(directory)) {
+        fprintf(stderr, "Can't create a temporary directory\n");
+        return false;
+    }
+    string path = string(directory) + "/wide.epub";
+    SyntheticBook shape = options.book;
+    shape.chapters = wideChapters;
+    shape.chapterBytes = wideChapterBytes;
+    string error;
+    if (!writeSyntheticEpub(path, shape, error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        removeTree(directory);
+        return false;
+    }
+
+    size_t entries = 0;
+    size_t chapters = 0;
+    stages.push_back(runStage("zip-dir-500", options, 0, [&]() {
+        ZipIndex zip;
+        zip.open(path.c_str());
+        entries = zip.entries().size();
+    }));
+    stages.push_back(runStage("book-open-500", options, 0, [&]() {
+        EpubBook epub(chapterCacheBytes, lineWidth);
+        epub.open(path.c_str());
+        chapters = epub.chapterCount();
+    }));
+    removeTree(directory);
+
+    if (entries < wideChapters || chapters < wideChapters) {
+        fprintf(stderr, "The %zu-chapter book opened with %zu entries and %zu chapters\n", wideChapters, entries,
+                chapters);
+        return false;
+    }
+    return true;
+}
+
+// Reopening each book at its first chapter, the way the reader returns to
+// one: cold with an empty disk cache directory every run, then warm from a
+// cache that an earlier full load filled with every chapter.
+bool runReopen(const Options& options, const vector<BookData>& books, vector<StageResult>& stages) {
+    char directory[] = "/tmp/ereader-cache-XXXXXX";
+    if (!mkdtemp(directory)) {
+        fprintf(stderr, "Can't create a temporary directory\n");
+        return false;
+    }
+    string cacheRoot = directory;
+    size_t coldRuns = 0;
+    stages.push_back(runStage("reopen-cold", options, 0, [&]() {
+        string cache = cacheRoot + "/cold" + to_string(coldRuns++);
+        for (const BookData& book : books) {
+            EpubBook epub(chapterCacheBytes, lineWidth);
+            epub.setMemoryBudget(bookMemoryBytes);
+            epub.setDiskCache(cache, diskCacheBytes);
+            if (epub.open(book.path.c_str())) epub.chapter(0);
+        }
+    }));
+
+    string warm = cacheRoot + "/warm";
+    for (const BookData& book : books) {
+        EpubBook epub(chapterCacheBytes, lineWidth);
+        epub.setMemoryBudget(bookMemoryBytes);
+        epub.setDiskCache(warm, diskCacheBytes);
+        if (!epub.open(book.path.c_str())) continue;
+        for (size_t i = 0; i < epub.chapterCount(); i++) epub.chapter(i);
+    }
+    stages.push_back(runStage("reopen-warm", options, 0, [&]() {
+        for (const BookData& book : books) {
+            EpubBook epub(chapterCacheBytes, lineWidth);
+            epub.setMemoryBudget(bookMemoryBytes);
+            epub.setDiskCache(warm, diskCacheBytes);
+            if (epub.open(book.path.c_str())) epub.chapter(0);
+        }
+    }));
+    removeTree(cacheRoot);
+    return true;
+}
+
+// Indexing the whole library for search from scratch, as on the first
+// search after the books are copied over, then one query against the
+// finished index. False if the update fails or the query finds nothing.
+bool runLibrarySearch(const Options& options, const vector<BookData>& books, uint64_t xhtmlBytes,
+                      vector<StageResult>& stages) {
+    char directory[] = "/tmp/ereader-search-XXXXXX";
+    if (!mkdtemp(directory)) {
+        fprintf(stderr, "Can't create a temporary directory\n");
+        return false;
+    }
+    string searchRoot = directory;
+    vector<string> paths;
+    for (const BookData& book : books) paths.push_back(book.path);
+    IndexProgress progress = [](size_t, size_t, const string&) { return true; };
+
+    bool ok = true;
+    size_t runs = 0;
+    string index;
+    stages.push_back(runStage("library-index", options, xhtmlBytes, [&]() {
+        index = searchRoot + "/index" + to_string(runs++);
+        LibrarySearch search(index);
+        search.load();
+        if (!search.update(paths, progress)) {
+            fprintf(stderr, "Indexing the library failed: %s\n", search.error().c_str());
+            ok = false;
+        }
+    }));
+
+    vector<LibrarySearchResult> results;
+    if (ok) {
+        stages.push_back(runStage("library-search", options, 0, [&]() {
+            LibrarySearch search(index);
+            search.load();
+            search.search("remembered window", results, 100);
+        }));
+        if (results.empty()) {
+            fprintf(stderr, "Searching the library index found nothing\n");
+            ok = false;
+        }
+    }
+    removeTree(searchRoot);
+    return ok;
+}
+
+// Parts of a split chapter meet at line breaks, so compare text by what shows.
+uint64_t visibleBytes(const string& text) {
+    uint64_t count = 0;
+    for (char c : text) count += (c != ' ' && c != '\n');
+    return count;
+}
+
+// Loads the oversized book chapter by chapter as the reader would. It has to
+// come through whole, in parts, without the heap going past the budget.
+bool runOversizedBook(const Options& options, vector<StageResult>& stages) {
+    char directory[] = "/tmp/ereader-oversized-XXXXXX";
+    if (!mkdtemp(directory)) {
+        fprintf(stderr, "Can't create a temporary directory\n");
+        return false;
+    }
+    string path = string(directory) + "/oversized.epub";
+    SyntheticBook shape = options.book;
+    shape.chapters = oversizedChapters;
+    shape.chapterBytes = oversizedChapterBytes;
+    string error;
+    if (!writeSyntheticEpub(path, shape, error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        removeTree(directory);
+        return false;
+    }
+
+    // The text of each chapter extracted whole, without a limit.
+    uint64_t xhtmlBytes = 0;
+    uint64_t wholeText = 0;
+    {
+        ZipIndex zip;
+        HtmlTextExtractor extractor;
+        zip.open(path.c_str());
+        for (const ZipEntry& entry : zip.entries()) {
+            if (entry.name.find("/chapter") == string::npos) continue;
+            extractor.reset();
+            zip.streamEntry(entry, [&](const char* data, size_t length) {
+                extractor.feed(data, length);
+                return true;
+            });
+            extractor.finish();
+            xhtmlBytes += entry.uncompressedSize;
+            wholeText += visibleBytes(extractor.text());
+        }
+    }
+
+    size_t parts = 0;
+    uint64_t loadedText = 0;
+    stages.push_back(runStage("book-oversized", options, xhtmlBytes, [&]() {
+        EpubBook epub(chapterCacheBytes, lineWidth);
+        epub.setMemoryBudget(bookMemoryBytes);
+        parts = 0;
+        loadedText = 0;
+        if (!epub.open(path.c_str())) return;
+        parts = epub.chapterCount();
+        for (size_t i = 0; i < parts; i++) loadedText += visibleBytes(epub.chapter(i)->text);
+    }));
+    removeTree(directory);
+
+    const StageResult& stage = stages.back();
+    if (parts <= oversizedChapters || loadedText != wholeText) {
+        fprintf(stderr, "The oversized book came through as %zu parts with %llu of its %llu bytes of text\n", parts,
+                (unsigned long long)loadedText, (unsigned long long)wholeText);
+        return false;
+    }
+    if (stage.heapPeak > bookMemoryBytes) {
+        fprintf(stderr, "Loading the oversized book took %zu KB of heap, over the %zu KB budget\n",
+                stage.heapPeak / 1024, bookMemoryBytes / 1024);
+        return false;
+    }
+    return true;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+const char* cycleUnit = "TSC cycle";
+
+uint64_t cycles() {
+    return __rdtsc();
+}
+#else
+const char* cycleUnit = "ns";
+
+uint64_t cycles() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+bool isAmpersandOrNonAscii(unsigned char c) { return c == '&' || c >= 0x80; }
+bool isTagOpen(unsigned char c) { return c == '<'; }
+bool isSpace(unsigned char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f'; }
+bool isNewline(unsigned char c) { return c == '\n'; }
+bool isNonAscii(unsigned char c) { return c >= 0x80; }
+
+// The loops the pipeline ran before byte_scan.
+template <bool (*accept)(unsigned char)>
+const char* scalarFind(const char* p, const char* end) {
+    while (p < end && !accept((unsigned char)*p)) p++;
+    return p;
+}
+
+// Steps through every match, the way the pipeline walks a chapter.
+size_t findAll(Finder find, const vector<const string*>& inputs) {
+    size_t matches = 0;
+    for (const string* input : inputs) {
+        const char* end = input->data() + input->size();
+        for (const char* p = find(input->data(), end); p < end; p = find(p + 1, end)) matches++;
+    }
+    return matches;
+}
+
+// Best of the given number of runs each, in bytes per cycle. False if the
+// two disagree on the matches.
+bool compareScan(const char* name, Finder kernel, Finder scalar, const vector<const string*>& inputs,
+                 size_t iterations, ScanComparison& result) {
+    result.name = name;
+    result.bytes = 0;
+    for (const string* input : inputs) result.bytes += input->size();
+
+    uint64_t best[2] = { UINT64_MAX, UINT64_MAX };
+    size_t matches[2] = { 0, 0 };
+    Finder finders[2] = { kernel, scalar };
+    for (size_t i = 0; i < iterations; i++) {
+        for (size_t f = 0; f < 2; f++) {
+            uint64_t start = cycles();
+            matches[f] = findAll(finders[f], inputs);
+            best[f] = min(best[f], max<uint64_t>(cycles() - start, 1));
+        }
+    }
+    result.kernelBytesPerCycle = (double)result.bytes / best[0];
+    result.scalarBytesPerCycle = (double)result.bytes / best[1];
+    if (matches[0] != matches[1]) {
+        fprintf(stderr, "%s found %zu matches, the plain loop %zu\n", name, matches[0], matches[1]);
+        return false;
+    }
+    return true;
+}
+
+void printTable(const vector<StageResult>& stages) {
+    printf("%-14s %9s %9s %8s %9s %10s %10s\n", "stage", "median ms", "min ms", "MB/s", "allocs", "heap KB",
+           "peak RSS KB");
+    for (const StageResult& stage : stages) {
+        printf("%-14s %9.2f %9.2f %8.1f %9llu %10zu %10zu\n", stage.name.c_str(), median(stage.milliseconds),
+               fastest(stage.milliseconds), megabytesPerSecond(stage), (unsigned long long)stage.allocations,
+               stage.heapPeak / 1024, stage.peakRss);
+        for (size_t i = 0; i < STAGE_COUNT; i++) {
+            if (stage.profile.stageCalls[i] == 0) continue;
+            printf("  %-12s %9.2f\n", profileStageName((ProfileStage)i), stage.profile.stageMilliseconds[i]);
+        }
+    }
+    if (!peakRssResets) printf("(peak RSS is for the whole process: it can't be reset here)\n");
+}
+
+void printScanTable(const vector<ScanComparison>& scans) {
+    printf("\nbyte_scan (%s) against the plain loop, bytes per %s\n", byteScanKernel(), cycleUnit);
+    printf("%-22s %9s %9s %9s %8s\n", "finder", "input KB", "plain", byteScanKernel(), "speedup");
+    for (const ScanComparison& scan : scans) {
+        printf("%-22s %9llu %9.3f %9.3f %7.2fx\n", scan.name, (unsigned long long)(scan.bytes / 1024),
+               scan.scalarBytesPerCycle, scan.kernelBytesPerCycle, scan.kernelBytesPerCycle / scan.scalarBytesPerCycle);
+    }
+}
+
+void writeJsonString(FILE* file, const string& text) {
+    fputc('"', file);
+    for (char c : text) {
+        if (c == '"' || c == '\\') fprintf(file, "\\%c", c);
+        else if ((unsigned char)c < 0x20) fprintf(file, "\\u%04x", c);
+        else fputc(c, file);
+    }
+    fputc('"', file);
+}
+
+bool writeJson(const char* path, const Options& options, const vector<StageResult>& stages,
+               const vector<ScanComparison>& scans) {
+    FILE* file = fopen(path, "w");
+    if (!file) return false;
+
+    fprintf(file, "{\n  \"label\": ");
+    writeJsonString(file, options.label);
+    fprintf(file, ",\n  \"corpus\": {\"books\": %zu, \"chapters\": %zu, \"chapter_bytes\": %zu, "
+                  "\"entity_density\": %g, \"nesting_depth\": %zu, \"seed\": %u},\n",
+            options.books, options.book.chapters, options.book.chapterBytes, options.book.entityDensity,
+            options.book.nestingDepth, options.book.seed);
+    fprintf(file, "  \"iterations\": %zu,\n  \"peak_rss_per_stage\": %s,\n  \"stages\": [\n", options.iterations,
+            peakRssResets ? "true" : "false");
+    for (size_t s = 0; s < stages.size(); s++) {
+        const StageResult& stage = stages[s];
+        fprintf(file, "    {\"name\": ");
+        writeJsonString(file, stage.name);
+        fprintf(file, ", \"median_ms\": %.4f, \"min_ms\": %.4f, \"bytes\": %llu, \"mb_per_s\": %.2f, "
+                      "\"allocations\": %llu, \"heap_peak_bytes\": %zu, \"peak_rss_kb\": %zu, \"runs_ms\": [",
+                median(stage.milliseconds), fastest(stage.milliseconds), (unsigned long long)stage.bytes,
+                megabytesPerSecond(stage), (unsigned long long)stage.allocations, stage.heapPeak, stage.peakRss);
+        for (size_t i = 0; i < stage.milliseconds.size(); i++) {
+            fprintf(file, "%s%.4f", i ? ", " : "", stage.milliseconds[i]);
+        }
+        fprintf(file, "], \"profile_ms\": {");
+        bool first = true;
+        for (size_t i = 0; i < STAGE_COUNT; i++) {
+            if (stage.profile.stageCalls[i] == 0) continue;
+            fprintf(file, "%s", first ? "" : ", ");
+            writeJsonString(file, profileStageName((ProfileStage)i));
+            fprintf(file, ": %.4f", stage.profile.stageMilliseconds[i]);
+            first = false;
+        }
+        fprintf(file, "}}%s\n", s + 1 < stages.size() ? "," : "");
+    }
+    fprintf(file, "  ],\n  \"byte_scan\": {\"kernel\": ");
+    writeJsonString(file, byteScanKernel());
+    fprintf(file, ", \"unit\": \"bytes per %s\", \"finders\": [\n", cycleUnit);
+    for (size_t s = 0; s < scans.size(); s++) {
+        fprintf(file, "    {\"name\": \"%s\", \"bytes\": %llu, \"plain\": %.4f, \"kernel\": %.4f}%s\n", scans[s].name,
+                (unsigned long long)scans[s].bytes, scans[s].scalarBytesPerCycle, scans[s].kernelBytesPerCycle,
+                s + 1 < scans.size() ? "," : "");
+    }
+    fprintf(file, "  ]}\n}\n");
+    bool ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+}
+
+bool parseSize(const char* text, size_t& value) {
+    char* end = nullptr;
+    unsigned long parsed = strtoul(text, &end, 10);
+    if (end == text || *end != '\0') return false;
+    value = parsed;
+    return true;
+}
+
+void usage(const char* program) {
+    fprintf(stderr,
+            "usage: %s [--books N] [--chapters N] [--chapter-kb N] [--entities N] [--depth N] [--seed N]\n"
+            "       [--iterations N] [--corpus DIR] [--generate-only] [--json FILE] [--label TEXT]\n",
+            program);
+}
+
+bool parseOptions(int argc, char** argv, Options& options) {
+    options.book.chapters = 30;
+    options.book.chapterBytes = 64 * 1024;
+    options.book.entityDensity = 5;
+    options.book.nestingDepth = 3;
+    options.book.seed = 1;
+    options.books = 6;
+    options.iterations = 5;
+    options.keepCorpus = false;
+    options.generateOnly = false;
+    options.jsonPath = nullptr;
+
+    for (int i = 1; i < argc; i++) {
+        string option = argv[i];
+        if (option == "--generate-only") {
+            options.generateOnly = true;
+            continue;
+        }
+        if (i + 1 >= argc) return false;
+        const char* value = argv[++i];
+        size_t number = 0;
+        bool ok = true;
+        if (option == "--corpus") {
+            options.corpus = value;
+            options.keepCorpus = true;
+        }
+        else if (option == "--json") options.jsonPath = value;
+        else if (option == "--label") options.label = value;
+        else if (option == "--entities") {
+            char* end = nullptr;
+            options.book.entityDensity = strtod(value, &end);
+            ok = end != value && *end == '\0' && options.book.entityDensity >= 0;
+        }
+        else if (!parseSize(value, number)) ok = false;
+        else if (option == "--books") options.books = number;
+        else if (option == "--chapters") options.book.chapters = number;
+        else if (option == "--chapter-kb") options.book.chapterBytes = number * 1024;
+        else if (option == "--depth") options.book.nestingDepth = number;
+        else if (option == "--seed") options.book.seed = (uint32_t)number;
+        else if (option == "--iterations") options.iterations = number;
+        else ok = false;
+        if (!ok) return false;
+    }
+    return options.books > 0 && options.book.chapters > 0 && options.book.chapters < 60000 &&
+           options.iterations > 0;
+}
+
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (!options.keepCorpus) {
+        char directory[] = "/tmp/ereader-bench-XXXXXX";
+        if (!mkdtemp(directory)) {
+            fprintf(stderr, "Can't create a temporary directory\n");
+            return 1;
+        }
+        options.corpus = directory;
+    }
+    else if (!makeDirectory(options.corpus)) {
+        fprintf(stderr, "Can't create %s\n", options.corpus.c_str());
+        return 1;
+    }
+
+    vector<BookData> books(options.books);
+    uint64_t archiveBytes = 0;
+    uint64_t xhtmlBytes = 0;
+    uint64_t textBytes = 0;
+    bool ok = true;
+    for (size_t i = 0; i < options.books && ok; i++) {
+        string path;
+        ok = prepareBook(options, i, path) && (options.generateOnly || loadBook(path, books[i]));
+        struct stat info;
+        if (ok && stat(path.c_str(), &info) == 0) archiveBytes += info.st_size;
+        for (const string& xhtml : books[i].xhtml) xhtmlBytes += xhtml.size();
+        for (const string& text : books[i].text) textBytes += text.size();
+    }
+    if (!ok || options.generateOnly) {
+        if (ok) printf("%zu books, %llu KB, in %s\n", options.books, (unsigned long long)(archiveBytes / 1024),
+                       options.corpus.c_str());
+        else if (!options.keepCorpus) removeTree(options.corpus);
+        return ok ? 0 : 1;
+    }
+
+    printf("%zu books of %zu chapters, %llu KB of EPUB, %llu KB of XHTML, %llu KB of text\n\n", options.books,
+           options.book.chapters, (unsigned long long)(archiveBytes / 1024), (unsigned long long)(xhtmlBytes / 1024),
+           (unsigned long long)(textBytes / 1024));
+
+    LibraryIndex library;
+    library.scan(options.corpus, true);
+    size_t found = 0;
+    for (const auto& directory : library.booksByDirectory()) found += directory.second.size();
+    if (found != options.books) {
+        fprintf(stderr, "The library scan found %zu books in %s, not %zu\n", found, options.corpus.c_str(),
+                options.books);
+        if (!options.keepCorpus) removeTree(options.corpus);
+        return 1;
+    }
+
+    vector<StageResult> stages;
+
+    // Finding the books: a full rescan, as on the first start.
+    stages.push_back(runStage("library-scan", options, 0, [&]() {
+        LibraryIndex library;
+        library.scan(options.corpus, true);
+    }));
+
+    // The central directory, then container.xml, the OPF and the navigation document.
+    stages.push_back(runStage("zip-directory", options, 0, [&]() {
+        for (const BookData& book : books) {
+            ZipIndex zip;
+            zip.open(book.path.c_str());
+        }
+    }));
+    stages.push_back(runStage("book-open", options, 0, [&]() {
+        for (const BookData& book : books) {
+            EpubBook epub(chapterCacheBytes, lineWidth);
+            epub.open(book.path.c_str());
+        }
+    }));
+
+    ok = runWideBook(options, stages);
+
+    stages.push_back(runStage("inflate", options, xhtmlBytes, [&]() {
+        for (const BookData& book : books) {
+            ZipIndex zip;
+            zip.open(book.path.c_str());
+            string xhtml;
+            for (const ZipEntry& entry : zip.entries()) {
+                if (entry.name.find("/chapter") != string::npos) zip.readEntry(entry, xhtml);
+            }
+        }
+    }));
+
+    stages.push_back(runStage("entities", options, xhtmlBytes, [&]() {
+        EntityDecoder decoder;
+        string decoded;
+        for (const BookData& book : books) {
+            for (const string& xhtml : book.xhtml) {
+                decoded.clear();
+                decoder.reset();
+                decoder.decode(xhtml.data(), xhtml.size(), decoded);
+                decoder.finish(decoded);
+            }
+        }
+    }));
+
+    // The old decoder moves the rest of the text along on every
+    // replacement, so it is raced against the new one on a single large
+    // chapter, made of the corpus's chapters end to end.
+    string largeChapter;
+    while (largeChapter.size() < largeChapterBytes) {
+        for (const BookData& book : books) {
+            for (const string& xhtml : book.xhtml) largeChapter += xhtml;
+        }
+    }
+    largeChapter.resize(largeChapterBytes);
+    stages.push_back(runStage("entities-2mb", options, largeChapter.size(), [&]() {
+        decodeHtmlEntities(largeChapter, true);
+    }));
+    stages.push_back(runStage("entities-old", options, largeChapter.size(), [&]() {
+        legacyDecodeHtmlEntities(largeChapter);
+    }));
+
+    stages.push_back(runStage("html-extract", options, xhtmlBytes, [&]() {
+        HtmlTextExtractor extractor;
+        for (const BookData& book : books) {
+            for (const string& xhtml : book.xhtml) {
+                extractor.reset();
+                extractor.feed(xhtml.data(), xhtml.size());
+                extractor.finish();
+            }
+        }
+    }));
+
+    stages.push_back(runStage("line-break", options, textBytes, [&]() {
+        vector<uint32_t> lineStarts;
+        for (const BookData& book : books) {
+            for (const string& text : book.text) breakLines(text, lineWidth, lineStarts);
+        }
+    }));
+
+    stages.push_back(runStage("paginate", options, textBytes, [&]() {
+        for (const BookData& book : books) {
+            for (size_t i = 0; i < book.text.size(); i++) {
+                PageIndex pages;
+                pages.reset(book.text[i], book.lineStarts[i], pageChars, pageLines, 0);
+                while (!pages.extend(64)) {}
+            }
+        }
+    }));
+
+    stages.push_back(runStage("lz4", options, textBytes, [&]() {
+        string unpacked;
+        for (const BookData& book : books) {
+            for (const string& text : book.text) {
+                CompressedText packed;
+                CompressedText::compress(text, packed);
+                packed.decompress(unpacked);
+            }
+        }
+    }));
+
+    stages.push_back(runStage("search-index", options, textBytes, [&]() {
+        for (const BookData& book : books) {
+            vector<vector<uint8_t>> chapters(book.text.size());
+            for (size_t i = 0; i < book.text.size(); i++) SearchIndex::encodeChapter(book.text[i], chapters[i]);
+            SearchIndex index;
+            index.build(chapters);
+        }
+    }));
+
+    // Everything together, single-threaded: open each book and decode every chapter.
+    stages.push_back(runStage("book-load", options, xhtmlBytes, [&]() {
+        for (const BookData& book : books) {
+            EpubBook epub(chapterCacheBytes, lineWidth);
+            epub.setMemoryBudget(bookMemoryBytes);
+            if (!epub.open(book.path.c_str())) continue;
+            for (size_t i = 0; i < epub.chapterCount(); i++) epub.chapter(i);
+        }
+    }));
+
+    // The same through the loader pool, the way the reader opens a book: the
+    // chapters decode on that many threads while this one takes them in.
+    vector<size_t> threadCounts = { 1, 2, 4, WorkerThread::coreCount() };
+    sort(threadCounts.begin(), threadCounts.end());
+    threadCounts.erase(unique(threadCounts.begin(), threadCounts.end()), threadCounts.end());
+    for (size_t threads : threadCounts) {
+        string name = "book-load/" + to_string(threads);
+        stages.push_back(runStage(name.c_str(), options, xhtmlBytes, [&]() {
+            for (const BookData& book : books) {
+                EpubBook epub(chapterCacheBytes, lineWidth);
+                epub.setMemoryBudget(bookMemoryBytes);
+                if (!epub.open(book.path.c_str()) || !epub.startLoading(0, threads)) continue;
+                while (epub.loadedCount() < epub.chapterCount()) {
+                    if (epub.poll() == 0) sleepMilliseconds(1);
+                }
+            }
+        }));
+    }
+
+    ok = ok && runReopen(options, books, stages) && runLibrarySearch(options, books, xhtmlBytes, stages) &&
+         runOversizedBook(options, stages);
+
+    // The finders on the input each one sees in the pipeline.
+    vector<const string*> xhtml;
+    vector<const string*> text;
+    for (const BookData& book : books) {
+        for (const string& chapter : book.xhtml) xhtml.push_back(&chapter);
+        for (const string& chapter : book.text) text.push_back(&chapter);
+    }
+    vector<ScanComparison> scans(5);
+    ok = ok &&
+         compareScan("ampersand/non-ASCII", findAmpersandOrNonAscii, scalarFind<isAmpersandOrNonAscii>, xhtml,
+                     options.iterations, scans[0]) &&
+         compareScan("tag open", findTagOpen, scalarFind<isTagOpen>, xhtml, options.iterations, scans[1]) &&
+         compareScan("space", findSpace, scalarFind<isSpace>, text, options.iterations, scans[2]) &&
+         compareScan("newline", findNewline, scalarFind<isNewline>, text, options.iterations, scans[3]) &&
+         compareScan("non-ASCII", findNonAscii, scalarFind<isNonAscii>, text, options.iterations, scans[4]);
+
+    printTable(stages);
+    if (ok) printScanTable(scans);
+    if (ok && options.jsonPath && !writeJson(options.jsonPath, options, stages, scans)) {
+        fprintf(stderr, "Can't write %s\n", options.jsonPath);
+        ok = false;
+    }
+    if (!options.keepCorpus) removeTree(options.corpus);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,339 @@
+#include "epub_generator.h"
+
+#include <stdio.h>
+#include <cstring>
+#include <vector>
+#include <zlib.h>
+
+using namespace std;
+
+namespace {
+
+const char* const words[] = {
+    "the", "of", "and", "a", "to", "in", "was", "he", "it", "that", "her", "his", "with", "had", "for", "she",
+    "as", "at", "not", "on", "but", "be", "from", "by", "which", "they", "this", "were", "would", "all", "one",
+    "said", "there", "been", "could", "when", "into", "little", "before", "window", "morning", "remembered",
+    "afterwards", "extraordinary", "handkerchief", "carriage", "staircase", "lantern", "quietly", "towards",
+    "nevertheless", "understanding", "weather", "letters", "garden", "evening", "silence", "through"
+};
+const size_t wordCount = sizeof(words) / sizeof(words[0]);
+
+// Character references a book typically has, plus raw UTF-8 for the same
+// punctuation.
+const char* const references[] = {
+    "&amp;", "&mdash;", "&ndash;", "&eacute;", "&ldquo;", "&rdquo;", "&rsquo;", "&hellip;", "&nbsp;", "&#8217;",
+    "&#8220;", "&#x2014;", "&#xE9;", "\xE2\x80\x94", "\xE2\x80\x99", "\xC3\xA9"
+};
+const size_t referenceCount = sizeof(references) / sizeof(references[0]);
+
+const char* const blockTags[] = { "div", "section", "blockquote" };
+const char* const inlineTags[] = { "em", "strong", "span", "i", "b" };
+
+const size_t sectionsPerChapter = 4;
+
+// xorshift32, so a seed gives the same book on every machine.
+class Random {
+public:
+    explicit Random(uint32_t seed) : state(seed ? seed : 0x9E3779B9u) {}
+
+    uint32_t next() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+    size_t below(size_t limit) { return next() % limit; }
+    double unit() { return next() / 4294967296.0; }
+
+private:
+    uint32_t state;
+};
+
+void putLe16(string& out, uint16_t value) {
+    out += (char)(value & 0xFF);
+    out += (char)(value >> 8);
+}
+
+void putLe32(string& out, uint32_t value) {
+    putLe16(out, (uint16_t)(value & 0xFFFF));
+    putLe16(out, (uint16_t)(value >> 16));
+}
+
+// Just enough of a ZIP writer for an EPUB: stored or raw-deflated entries,
+// then the central directory.
+class ZipWriter {
+public:
+    ZipWriter() : file(nullptr), offset(0), failed(false) {}
+    ~ZipWriter() {
+        if (file) fclose(file);
+    }
+
+    bool open(const string& path) {
+        file = fopen(path.c_str(), "wb");
+        return file != nullptr;
+    }
+
+    void add(const string& name, const string& data, bool deflate) {
+        string packed;
+        uint16_t method = 0;
+        if (deflate && compress(data, packed)) method = 8;
+        else packed = data;
+
+        Entry entry = { name, offset, (uint32_t)crc32(0, (const Bytef*)data.data(), (uInt)data.size()),
+                        (uint32_t)packed.size(), (uint32_t)data.size(), method };
+        string header;
+        putLe32(header, 0x04034b50);
+        putHeaderFields(header, entry);
+        putLe16(header, 0); // extra field
+        header += name;
+        write(header);
+        write(packed);
+        entries.push_back(entry);
+    }
+
+    bool finish() {
+        uint32_t directoryStart = offset;
+        for (const Entry& entry : entries) {
+            string header;
+            putLe32(header, 0x02014b50);
+            putLe16(header, 20); // made by
+            putHeaderFields(header, entry);
+            putLe16(header, 0);  // extra field
+            putLe16(header, 0);  // comment
+            putLe16(header, 0);  // disk
+            putLe16(header, 0);  // internal attributes
+            putLe32(header, 0);  // external attributes
+            putLe32(header, entry.offset);
+            header += entry.name;
+            write(header);
+        }
+
+        string end;
+        putLe32(end, 0x06054b50);
+        putLe16(end, 0);
+        putLe16(end, 0);
+        putLe16(end, (uint16_t)entries.size());
+        putLe16(end, (uint16_t)entries.size());
+        putLe32(end, offset - directoryStart);
+        putLe32(end, directoryStart);
+        putLe16(end, 0);
+        write(end);
+
+        bool ok = !failed && fclose(file) == 0;
+        file = nullptr;
+        return ok;
+    }
+
+private:
+    struct Entry {
+        string name;
+        uint32_t offset;
+        uint32_t crc;
+        uint32_t compressedSize;
+        uint32_t size;
+        uint16_t method;
+    };
+
+    ZipWriter(const ZipWriter&);
+    ZipWriter& operator=(const ZipWriter&);
+
+    // From "version needed" up to the name length; shared by both headers.
+    static void putHeaderFields(string& out, const Entry& entry) {
+        putLe16(out, 20);
+        putLe16(out, 0); // flags
+        putLe16(out, entry.method);
+        putLe16(out, 0); // time
+        putLe16(out, 0x21); // 1980-01-01
+        putLe32(out, entry.crc);
+        putLe32(out, entry.compressedSize);
+        putLe32(out, entry.size);
+        putLe16(out, (uint16_t)entry.name.size());
+    }
+
+    static bool compress(const string& data, string& out) {
+        z_stream stream = z_stream();
+        if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        out.resize(deflateBound(&stream, data.size()));
+        stream.next_in = (Bytef*)data.data();
+        stream.avail_in = (uInt)data.size();
+        stream.next_out = (Bytef*)&out[0];
+        stream.avail_out = (uInt)out.size();
+        bool ok = deflate(&stream, Z_FINISH) == Z_STREAM_END;
+        out.resize(stream.total_out);
+        deflateEnd(&stream);
+        return ok;
+    }
+
+    void write(const string& data) {
+        if (fwrite(data.data(), 1, data.size(), file) != data.size()) failed = true;
+        offset += (uint32_t)data.size();
+    }
+
+    FILE* file;
+    uint32_t offset;
+    bool failed;
+    vector<Entry> entries;
+};
+
+string chapterName(size_t chapter) {
+    char name[48];
+    snprintf(name, sizeof(name), "chapter%03zu.xhtml", chapter + 1);
+    return name;
+}
+
+// One paragraph of about length bytes, references scattered at the
+// requested density and now and then a run of inline markup.
+void appendParagraph(string& out, size_t length, const SyntheticBook& book, Random& random) {
+    size_t start = out.size();
+    double referenceChance = book.entityDensity / 1000.0;
+    size_t openInline = 0;
+    const char* openTags[8];
+    while (out.size() - start < length) {
+        if (out.size() > start) out += ' ';
+        if (openInline < 8 && random.below(40) == 0) {
+            const char* tag = inlineTags[random.below(sizeof(inlineTags) / sizeof(inlineTags[0]))];
+            openTags[openInline++] = tag;
+            out += '<';
+            out += tag;
+            out += '>';
+        }
+
+        const char* word = words[random.below(wordCount)];
+        out += word;
+        // Every byte of text has a density / 1000 chance of a reference after it.
+        double expected = (strlen(word) + 1) * referenceChance;
+        while (expected > 0) {
+            if (random.unit() < expected) out += references[random.below(referenceCount)];
+            expected -= 1;
+        }
+
+        if (openInline > 0 && random.below(6) == 0) {
+            out += "</";
+            out += openTags[--openInline];
+            out += '>';
+        }
+    }
+    while (openInline > 0) {
+        out += "</";
+        out += openTags[--openInline];
+        out += '>';
+    }
+}
+
+string chapterDocument(size_t chapter, const SyntheticBook& book, Random& random) {
+    string out =
+        "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+        "<!DOCTYPE html>\n"
+        "<html xmlns=\"http://www.w3.org/1999/xhtml\" xmlns:epub=\"http://www.idpf.org/2007/ops\">\n"
+        "<head><title>Chapter</title>\n"
+        "<style type=\"text/css\">p { text-indent: 1em; margin: 0 } h2 { page-break-before: always }</style>\n"
+        "</head>\n<body>\n";
+    char heading[96];
+    snprintf(heading, sizeof(heading), "<h1 id=\"c%zu\">Chapter %zu</h1>\n", chapter + 1, chapter + 1);
+    out += heading;
+
+    size_t sectionBytes = book.chapterBytes / sectionsPerChapter;
+    for (size_t section = 0; section < sectionsPerChapter; section++) {
+        size_t sectionEnd = out.size() + sectionBytes;
+        snprintf(heading, sizeof(heading), "<h2 id=\"s%zu\">Part %zu</h2>\n", section + 1, section + 1);
+        out += heading;
+        while (out.size() < sectionEnd) {
+            for (size_t depth = 0; depth < book.nestingDepth; depth++) {
+                out += '<';
+                out += blockTags[depth % 3];
+                out += " class=\"d";
+                out += (char)('0' + depth % 10);
+                out += "\">";
+            }
+            out += "<p>";
+            appendParagraph(out, 200 + random.below(600), book, random);
+            out += "</p>";
+            for (size_t depth = book.nestingDepth; depth > 0; depth--) {
+                out += "</";
+                out += blockTags[(depth - 1) % 3];
+                out += '>';
+            }
+            out += '\n';
+        }
+    }
+    out += "</body>\n</html>\n";
+    return out;
+}
+
+string packageDocument(const SyntheticBook& book) {
+    char line[256];
+    snprintf(line, sizeof(line), "<dc:title>Synthetic Book %u</dc:title>\n", book.seed);
+    string out =
+        "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+        "<package xmlns=\"http://www.idpf.org/2007/opf\" version=\"3.0\" unique-identifier=\"id\">\n"
+        "<metadata xmlns:dc=\"http://purl.org/dc/elements/1.1/\">\n"
+        "<dc:identifier id=\"id\">synthetic</dc:identifier>\n";
+    out += line;
+    out += "<dc:creator>Bench Generator</dc:creator>\n<dc:language>en</dc:language>\n</metadata>\n<manifest>\n";
+    out += "<item id=\"nav\" href=\"nav.xhtml\" media-type=\"application/xhtml+xml\" properties=\"nav\"/>\n";
+    for (size_t i = 0; i < book.chapters; i++) {
+        snprintf(line, sizeof(line), "<item id=\"ch%zu\" href=\"%s\" media-type=\"application/xhtml+xml\"/>\n", i + 1,
+                 chapterName(i).c_str());
+        out += line;
+    }
+    out += "</manifest>\n<spine>\n";
+    for (size_t i = 0; i < book.chapters; i++) {
+        snprintf(line, sizeof(line), "<itemref idref=\"ch%zu\"/>\n", i + 1);
+        out += line;
+    }
+    out += "</spine>\n</package>\n";
+    return out;
+}
+
+string navDocument(const SyntheticBook& book) {
+    string out =
+        "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+        "<html xmlns=\"http://www.w3.org/1999/xhtml\" xmlns:epub=\"http://www.idpf.org/2007/ops\">\n"
+        "<head><title>Contents</title></head>\n<body>\n<nav epub:type=\"toc\"><ol>\n";
+    char line[160];
+    for (size_t i = 0; i < book.chapters; i++) {
+        string name = chapterName(i);
+        snprintf(line, sizeof(line), "<li><a href=\"%s\">Chapter %zu</a><ol>\n", name.c_str(), i + 1);
+        out += line;
+        for (size_t section = 0; section < sectionsPerChapter; section++) {
+            snprintf(line, sizeof(line), "<li><a href=\"%s#s%zu\">Part %zu</a></li>\n", name.c_str(), section + 1,
+                     section + 1);
+            out += line;
+        }
+        out += "</ol></li>\n";
+    }
+    out += "</ol></nav>\n</body>\n</html>\n";
+    return out;
+}
+
+}
+
+bool writeSyntheticEpub(const string& path, const SyntheticBook& book, string& error) {
+    ZipWriter zip;
+    if (!zip.open(path)) {
+        error = "Can't write " + path;
+        return false;
+    }
+
+    Random random(book.seed);
+    zip.add("mimetype", "application/epub+zip", false);
+    zip.add("META-INF/container.xml",
+            "<?xml version=\"1.0\"?>\n"
+            "<container version=\"1.0\" xmlns=\"urn:oasis:names:tc:opendocument:xmlns:container\">\n"
+            "<rootfiles><rootfile full-path=\"OEBPS/content.opf\" media-type=\"application/oebps-package+xml\"/>"
+            "</rootfiles>\n</container>\n",
+            true);
+    zip.add("OEBPS/content.opf", packageDocument(book), true);
+    zip.add("OEBPS/nav.xhtml", navDocument(book), true);
+    for (size_t i = 0; i < book.chapters; i++) {
+        zip.add("OEBPS/" + chapterName(i), chapterDocument(i, book, random), true);
+    }
+
+    if (!zip.finish()) {
+        error = "Can't write " + path;
+        return false;
+    }
+    return true;
+}
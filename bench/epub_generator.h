@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// The shape of a made-up book for benchmarking.
+struct SyntheticBook {
+    size_t chapters;
+    size_t chapterBytes;  // XHTML per chapter, roughly
+    double entityDensity; // character references per 1000 bytes of text
+    size_t nestingDepth;  // block elements around each paragraph
+    uint32_t seed;
+};
+
+// Writes an EPUB 3 of random English-looking text: a container, an OPF
+// with title and author, a nav document linking every chapter and a few
+// sections inside each, and chapters with a stylesheet in the head, headings
+// with ids, inline markup, named, decimal and hex character references and
+// raw UTF-8 punctuation. The same seed always gives the same book. Entries
+// are deflated like a real EPUB, with the mimetype stored first. False with
+// a message in error if the file can't be written.
+bool writeSyntheticEpub(const std::string& path, const SyntheticBook& book, std::string& error);
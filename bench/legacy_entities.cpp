@@ -0,0 +1,63 @@
+#include "legacy_entities.h"
+
+#include <map>
+
+using namespace std;
+
+namespace {
+
+void replace_all(std::string& s, const std::string& from, const std::string& to) {
+    if (from.empty()) return;
+    size_t start_pos = 0;
+    while((start_pos = s.find(from, start_pos)) != std::string::npos) {
+        s.replace(start_pos, from.length(), to);
+        start_pos += to.length();
+    }
+}
+
+std::map<std::string, char> htmlEntities = {
+    {"&apos;", '\''}, {"&#39;", '\''},
+    {"&quot;", '\"'}, {"&#34;", '\"'},
+    {"&amp;", '&'},
+    {"&lt;", '<'},
+    {"&gt;", '>'},
+    {"&lsquo;", '\''}, {"&#x2018;", '\''},
+    {"&rsquo;", '\''}, {"&#x2019;", '\''},
+    {"&ldquo;", '\"'}, {"&#x201C;", '\"'},
+    {"&rdquo;", '\"'}, {"&#x201D;", '\"'},
+    {"&mdash;", '-'}, {"&#x2014;", '-'},
+    {"&ndash;", '-'}, {"&#x2013;", '-'},
+    {"&hellip;", '.'}, {"&#x2026;", '.'},
+    {"&nbsp;", ' '},  {"&#xa0;", ' '},
+};
+
+}
+
+std::string legacyDecodeHtmlEntities(const std::string& input) {
+    std::string output = input;
+
+    for (const auto& pair : htmlEntities) {
+        replace_all(output, pair.first, string(1, pair.second));
+    }
+
+    replace_all(output, "\xE2\x80\x99", "'");
+    replace_all(output, "\xE2\x80\x98", "'");
+    replace_all(output, "\xE2\x80\x9C", "\"");
+    replace_all(output, "\xE2\x80\x9D", "\"");
+    replace_all(output, "\xE2\x80\xA6", "...");
+    replace_all(output, "\xE2\x80\x93", "-");
+    replace_all(output, "\xE2\x80\x94", "-");
+
+    std::string cleanedOutput;
+    for (char c : output) {
+        if ((static_cast<unsigned char>(c) >= 32 && static_cast<unsigned char>(c) <= 126) ||
+            c == '\n' || c == '\r' || c == '\t') {
+            cleanedOutput += c;
+        } else if (static_cast<unsigned char>(c) > 126) { // Replace non-ASCII chars
+            cleanedOutput += ' ';
+        } else {
+            cleanedOutput += c; // Keep other control chars like newline
+        }
+    }
+    return cleanedOutput;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <string>
+
+// decodeHtmlEntities as it was before the single-pass EntityDecoder: one
+// replace_all pass over the whole text per entity and UTF-8 sequence, then
+// a copy that blanks whatever is left outside ASCII. Kept so the bench can
+// race the two on the same chapter.
+std::string legacyDecodeHtmlEntities(const std::string& input);
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// On-disk copy of a book's preprocessed text, so reopening it skips the ZIP,
+// the OPF and the XHTML entirely.
+//
+// There is one file per book in the cache directory, named after a hash of the
+// EPUB path and only trusted while the EPUB's path, size and modification time
+// and the line width still match. The file starts with a fixed header, the
+// EPUB path and the spine, followed by a table with one record per chapter.
+// Chapters are appended as they are first decoded: the text bytes, then the
+// line starts and the table of contents anchor offsets as 4-byte aligned
+// uint32_t arrays, and only then is the table record filled in, so a file
+// cut short by a crash or a full SD card just reads as having fewer chapters
+// cached. Everything is stored in the console's native (little-endian) byte
+// order and can be read chapter by chapter with one seek each. The book's
+// table of contents and, once built, its search index are appended the same
+// way and pointed to from the header.
+class BookCache {
+public:
+    BookCache();
+    ~BookCache();
+
+    // Sets where cache files live and how many bytes they may take in total.
+    // An empty directory turns the cache off.
+    void configure(const std::string& directory, uint64_t byteBudget);
+    bool enabled() const { return !directory.empty(); }
+
+    // Opens the cache file for epubPath. Returns true only if it exists and
+    // is still valid for this exact file and line width; otherwise the key is
+    // remembered so create() can start a new one after the book is parsed.
+    bool open(const std::string& epubPath, uint32_t lineWidth);
+    bool create(const std::vector<std::string>& spine, const std::vector<uint16_t>& parts);
+    void close();
+    bool isOpen() const { return file != nullptr; }
+
+    const std::vector<std::string>& spine() const { return spineNames; }
+    const std::vector<uint16_t>& spineParts() const { return partNumbers; }
+
+    bool hasChapter(size_t spineIndex) const;
+    bool readChapter(size_t spineIndex, std::string& text, std::vector<uint32_t>& lineStarts,
+                     std::vector<uint32_t>& anchors);
+    bool writeChapter(size_t spineIndex, const std::string& text, const std::vector<uint32_t>& lineStarts,
+                      const std::vector<uint32_t>& anchors);
+
+    // The book's serialised search index, stored once after every chapter
+    // has been indexed.
+    bool hasSearchIndex() const { return file && indexOffset != 0; }
+    bool readSearchIndex(std::vector<uint8_t>& data);
+    bool writeSearchIndex(const std::vector<uint8_t>& data);
+
+    // The serialised table of contents, stored right after create().
+    bool hasContents() const { return file && contentsOffset != 0; }
+    bool readContents(std::vector<uint8_t>& data);
+    bool writeContents(const std::vector<uint8_t>& data);
+
+    // Deletes the least recently opened cache files until the directory fits
+    // the budget. The file currently open is never removed.
+    void trim();
+
+private:
+    struct ChapterRecord {
+        uint32_t offset;     // 0 = not cached yet
+        uint32_t textLength;
+        uint32_t lineCount;
+        uint32_t anchorCount;
+    };
+
+    BookCache(const BookCache&);
+    BookCache& operator=(const BookCache&);
+
+    bool readHeader(const std::string& epubPath, uint32_t lineWidth);
+    bool readBlob(uint32_t& offset, uint32_t length, std::vector<uint8_t>& data);
+    bool writeBlob(size_t headerField, const std::vector<uint8_t>& data, uint32_t& offset, uint32_t& length);
+
+    std::string directory;
+    uint64_t byteBudget;
+
+    FILE* file;
+    std::string cachePath;
+    std::string bookPath;
+    uint64_t bookSize;
+    uint64_t bookMtime;
+    uint32_t bookLineWidth;
+
+    std::vector<std::string> spineNames;
+    std::vector<uint16_t> partNumbers;
+    std::vector<ChapterRecord> records;
+    uint32_t tableOffset;
+    uint32_t fileEnd;
+    uint32_t indexOffset;
+    uint32_t indexLength;
+    uint32_t contentsOffset;
+    uint32_t contentsLength;
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <map>
+#include <string>
+
+struct BookMetadata {
+    std::string title;
+    std::string author;
+};
+
+// Titles and authors from each book's OPF, saved so browsing the library
+// doesn't reopen archives. An entry is trusted while the file keeps the size
+// and mtime it had when it was read; that is checked with one stat per book
+// per session, the first time the book is looked up.
+class BookMetadataCache {
+public:
+    BookMetadataCache();
+
+    bool load(const char* path);
+    bool save(const char* path);
+    bool changed() const { return dirty; }
+
+    // The saved metadata if it is still current, without opening the book;
+    // null if the book has to be read first.
+    const BookMetadata* find(const std::string& bookPath);
+    // The saved metadata as it is, without the stat; null if there is none.
+    const BookMetadata* saved(const std::string& bookPath) const;
+    // find() or read() has already looked at the book this session.
+    bool checked(const std::string& bookPath) const;
+    // Opens the book and records its metadata. A book that can't be read is
+    // recorded with empty fields so it isn't retried on every visit.
+    const BookMetadata& read(const std::string& bookPath);
+
+private:
+    struct Entry {
+        uint64_t size;
+        uint64_t mtime;
+        bool checked; // stat'ed and found unchanged this session
+        BookMetadata metadata;
+    };
+
+    std::map<std::string, Entry> entries;
+    bool dirty;
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+// Storage traffic of one open file.
+struct FileReadStats {
+    uint64_t bytesRead;    // from storage, read-ahead included
+    uint64_t bytesReread;  // of those, bytes that had been read before in the same open
+    uint32_t readCalls;
+    uint32_t seekCalls;
+    uint64_t busyMicroseconds; // spent inside reads and seeks
+
+    void add(const FileReadStats& other);
+    double megabytesPerSecond() const;
+};
+
+// Read-only file tuned for the SD card, where every read call is expensive
+// and small ones are the worst case.
+//
+// Reads go through one large buffer that is filled from block-aligned
+// offsets, so reading on from where the last read stopped is served from
+// memory, and whatever the caller asks for next in the same stretch of the
+// file costs nothing. Requests at least as large as the buffer bypass it and
+// go to storage in one call. A bitmap of the blocks read so far keeps the
+// read-ahead from running into data already fetched once, and counts any
+// block that has to be fetched again.
+//
+// Off the console the whole file is memory-mapped instead; there the page
+// cache does the reading and the stats count the bytes handed out.
+class BufferedFile {
+public:
+    static const size_t blockSize = 4096;
+    static const size_t defaultBufferSize = 128 * 1024;
+
+    explicit BufferedFile(size_t bufferSize = defaultBufferSize);
+    ~BufferedFile();
+
+    bool open(const char* path);
+    void close();
+    bool isOpen() const { return file != nullptr; }
+    uint64_t size() const { return fileSize; }
+
+    // Copies length bytes at offset into buffer. False on a short read.
+    bool read(uint64_t offset, void* buffer, size_t length);
+
+    // Points at up to maxLength bytes from offset on without copying them,
+    // filling the buffer if needed; available is how many are there. The
+    // pointer is good until the next call. Null at the end of the file or on
+    // a read error.
+    const unsigned char* peek(uint64_t offset, size_t maxLength, size_t& available);
+
+    // Since open(); kept after close() until the next open.
+    const FileReadStats& stats() const { return readStats; }
+
+private:
+    BufferedFile(const BufferedFile&);
+    BufferedFile& operator=(const BufferedFile&);
+
+    bool inWindow(uint64_t offset) const { return offset >= windowStart && offset - windowStart < windowLength; }
+    bool fill(uint64_t offset);
+    bool readStorage(uint64_t offset, void* buffer, size_t length);
+
+    size_t capacity;
+    FILE* file;
+#ifndef __3DS__
+    const unsigned char* mapped;
+#endif
+    uint64_t fileSize;
+    uint64_t filePosition;
+
+    std::vector<unsigned char> storage;
+    unsigned char* window; // storage, aligned to a cache line
+    uint64_t windowStart;
+    size_t windowLength;
+
+    std::vector<bool> blocksRead;
+    FileReadStats readStats;
+};
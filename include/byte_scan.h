@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+
+// Finders for the bytes the text pipeline stops at. Each returns the first
+// matching byte in [p, end), or end if there is none.
+//
+// They test a whole word or vector per step instead of a byte: ARMv6 SIMD
+// (USUB8/SEL) on the console, SSE2 or NEON on a development host, and
+// portable 32-bit SWAR bit tricks anywhere else. Every candidate a block
+// turns up is confirmed with a plain byte test, so the fast paths only have
+// to be right about where a match might be, never about what it is. With
+// the 32-bit word kernels, findSpace is the plain byte loop.
+const char* findAmpersandOrNonAscii(const char* p, const char* end);
+const char* findTagOpen(const char* p, const char* end);
+const char* findSpace(const char* p, const char* end); // ' ', '\t', '\n', '\r' or '\f'
+const char* findNewline(const char* p, const char* end);
+const char* findNonAscii(const char* p, const char* end);
+
+// Which of the implementations above was compiled in.
+const char* byteScanKernel();
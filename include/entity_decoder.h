@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// Single-pass decoder for HTML character references and UTF-8 text.
+//
+// Named references (the full HTML5 set), decimal "&#NNN;" and hex "&#xHH;"
+// references and raw UTF-8 sequences are all turned into plain ASCII that the
+// 3DS console font can draw, using a compact transliteration table. Input can
+// be fed in arbitrary chunks: a reference or UTF-8 sequence cut off at the end
+// of one chunk is carried over to the next.
+class EntityDecoder {
+public:
+    // With preserveMarkup set, references that would produce '<', '>' or '&'
+    // are copied through untouched so the result can still be parsed as XML.
+    explicit EntityDecoder(bool preserveMarkup = false);
+
+    // Appends the decoded form of in[0, len) to out.
+    void decode(const char* in, size_t len, std::string& out);
+    // Flushes anything still held back from an incomplete reference.
+    void finish(std::string& out);
+    void reset() { pendingLength = 0; }
+
+private:
+    static const size_t maxPending = 40;
+
+    size_t decodeRun(const char* in, size_t len, std::string& out, size_t& written, bool final);
+
+    bool preserveMarkup;
+    char pending[maxPending];
+    size_t pendingLength;
+};
+
+// Appends the ASCII rendering of a Unicode code point to out and returns its length.
+size_t transliterate(uint32_t codepoint, char* out);
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "book_cache.h"
+#include "html_text.h"
+#include "search_index.h"
+#include "spsc_queue.h"
+#include "task_pool.h"
+#include "text_store.h"
+#include "zip_index.h"
+
+namespace tinyxml2 {
+class XMLElement;
+}
+
+// Plain text of one spine item plus the offsets where its display lines start.
+struct Chapter {
+    std::string text;
+    std::vector<uint32_t> lineStarts;
+    std::vector<uint32_t> anchors; // text offsets of the table of contents links into the chapter
+
+    size_t memoryUsage() const {
+        return sizeof(Chapter) + text.capacity() + (lineStarts.capacity() + anchors.capacity()) * sizeof(uint32_t);
+    }
+};
+
+// One entry of the book's table of contents, from nav.xhtml or toc.ncx.
+struct TocEntry {
+    std::string title;
+    size_t depth;         // 0 for top-level entries
+    size_t spineIndex;
+    std::string fragment; // element id the link points at, empty for the chapter start
+    size_t anchor;        // index into the chapter's anchors, SIZE_MAX without a fragment
+};
+
+// Least-recently-used set of decoded chapters, bounded by a byte budget.
+// The most recently inserted chapter is always kept, even if it alone is
+// larger than the budget, so the chapter being read is never dropped.
+class ChapterCache {
+public:
+    explicit ChapterCache(size_t byteBudget);
+
+    std::shared_ptr<const Chapter> get(size_t spineIndex);
+    // Like get(), but doesn't count as a use, so the eviction order stays as it was.
+    std::shared_ptr<const Chapter> peek(size_t spineIndex) const;
+    bool contains(size_t spineIndex) const;
+    void put(size_t spineIndex, const std::shared_ptr<const Chapter>& chapter);
+    void clear();
+
+    void setBudget(size_t byteBudget);
+    size_t budget() const { return byteBudget; }
+    size_t usedBytes() const { return bytesUsed; }
+
+private:
+    struct Slot {
+        std::shared_ptr<const Chapter> chapter;
+        std::list<size_t>::iterator lruPos;
+    };
+
+    void evict();
+
+    size_t byteBudget;
+    size_t bytesUsed;
+    std::list<size_t> lru; // front = most recently used
+    std::map<size_t, Slot> slots;
+};
+
+// An open EPUB: the ZIP index, the reading order from the OPF spine and a
+// cache of decoded chapters. Chapters are only inflated and extracted when
+// they are asked for. With a disk cache configured, decoded chapters are also
+// saved to the SD card, and a book whose cache file is still valid is opened
+// from it without touching the ZIP until an uncached chapter is needed.
+//
+// Behind the decoded cache sits an LZ4 text store holding as much of the
+// book as its budget allows, compressed by the loader threads. Only the
+// chapters around the reading position are kept decoded; the rest come back
+// from the store with a fast unpack and line break instead of a disk read.
+// The decoded cache's budget shrinks by whatever the store holds, down to a
+// quarter of what it was given, so the compressed copies mostly take the
+// place of decoded text instead of adding to it.
+class EpubBook {
+public:
+    EpubBook(size_t cacheBudget, size_t lineWidth);
+    ~EpubBook();
+
+    // Takes effect from the next open().
+    void setDiskCache(const std::string& directory, uint64_t byteBudget) { diskCache.configure(directory, byteBudget); }
+
+    // Caps what a book may hold in memory besides the chapter cache, so an
+    // oversized book is shortened instead of running the heap dry: chapter
+    // text is cut off at an eighth of the budget, search indexing is given
+    // up once the index terms pass a quarter of it, and the compressed text
+    // store gets another quarter. Set before open(). Spine items with large
+    // XHTML are split into parts at open(), so the cut-off is only a
+    // backstop; a chapter that hits it is never saved to the disk cache.
+    void setMemoryBudget(size_t bytes);
+
+    bool open(const char* path);
+    void close();
+
+    // From the OPF metadata; empty if the book has none or was opened from
+    // the disk cache.
+    const std::string& title() const { return bookTitle; }
+    const std::string& author() const { return bookAuthor; }
+
+    // The table of contents in document order, limited to entries that point
+    // into the spine; empty if the book has none.
+    const std::vector<TocEntry>& contents() const { return tableOfContents; }
+    // Where an entry starts in its chapter's text. The offsets of the links
+    // into a chapter are recorded while it is extracted, so this is a lookup
+    // once the chapter has been decoded and false before then.
+    bool contentsOffset(size_t entry, size_t& offset) const;
+
+    size_t chapterCount() const { return spine.size(); }
+    const std::string& chapterPath(size_t spineIndex) const { return spine[spineIndex]; }
+
+    // Returns the decoded chapter, loading it on a cache miss. Never null;
+    // a chapter that fails to load comes back empty.
+    std::shared_ptr<const Chapter> chapter(size_t spineIndex);
+    // The chapter if it is decoded and in memory, null otherwise. Never
+    // loads anything, and looking doesn't keep the chapter in the cache any
+    // longer, so it suits drawing ahead.
+    std::shared_ptr<const Chapter> decodedChapter(size_t spineIndex) const { return chapterCache.peek(spineIndex); }
+
+    // Makes sure the chapters either side of spineIndex are decoded. While
+    // the background loader runs this only queues them.
+    void prefetchAround(size_t spineIndex);
+
+    // Starts decoding every chapter in the background, one task per chapter
+    // on a pool of threadCount workers, queued from firstChapter onwards in
+    // spine order. Each worker opens its own copy of the ZIP; the disk cache
+    // is shared under a lock. While the pool runs, chapter() asks it for
+    // anything not in memory instead of decoding on the UI thread, unless
+    // the search index build has the only worker. Returns
+    // false if no thread could be started, in which case chapters keep
+    // loading on demand.
+    bool startLoading(size_t firstChapter, size_t threadCount);
+    void stopLoading();
+
+    // Takes in chapters the workers have finished, in whatever order they
+    // finished; everything is filed by spine index. Call once per frame;
+    // returns how many arrived.
+    size_t poll();
+
+    // Chapters decoded at least once since open(). Their line lengths are
+    // kept so pages can be counted without holding on to the text.
+    size_t loadedCount() const { return chaptersLoaded; }
+    bool isMeasured(size_t spineIndex) const { return measured[spineIndex]; }
+    const std::vector<uint8_t>& lineLengths(size_t spineIndex) const { return measuredLines[spineIndex]; }
+
+    // Full-text search. The index is built by the background loader once
+    // every chapter has been through it, or read back from the disk cache.
+    bool searchReady() const { return searchIndex.ready(); }
+    size_t indexedCount() const { return termsCount; }
+    // True once indexing was given up because the book is over the budget.
+    bool searchSkipped() const { return indexSkipped; }
+    // Finds up to maxHits case-insensitive matches in book order, each with
+    // up to snippetLength characters of text starting snippetLead before it.
+    // Returns false if the index isn't ready or the query can't be looked up.
+    bool search(const std::string& query, std::vector<SearchHit>& hits, size_t maxHits, size_t snippetLead,
+                size_t snippetLength);
+
+    // EPUB reads from storage since open(): the UI thread's archive handle
+    // plus those of loader threads that have been stopped.
+    FileReadStats readStats() const;
+
+    ChapterCache& cache() { return chapterCache; }
+    const TextStore& compressedText() const { return textStore; }
+    const std::string& error() const { return lastError; }
+
+private:
+    struct LoadedChapter {
+        size_t spineIndex;
+        std::shared_ptr<const Chapter> chapter;
+        bool requested; // asked for by the UI rather than part of the spine pass
+        bool indexed;   // searchTerms was filled in
+        std::vector<uint8_t> searchTerms;
+        bool packed;    // compressed was filled in
+        CompressedText compressed;
+    };
+
+    bool readSpine();
+    void readMetadata(const tinyxml2::XMLElement* metadata);
+    bool readNav(const std::string& path, const std::map<std::string, size_t>& spineIndexOf);
+    bool readNcx(const std::string& path, const std::map<std::string, size_t>& spineIndexOf);
+    void readNavList(const tinyxml2::XMLElement* list, size_t depth, const std::string& baseDir,
+                     const std::map<std::string, size_t>& spineIndexOf);
+    void readNavPoints(const tinyxml2::XMLElement* parent, size_t depth, const std::string& baseDir,
+                       const std::map<std::string, size_t>& spineIndexOf);
+    void addContentsEntry(const std::string& title, size_t depth, const std::string& baseDir, const char* href,
+                          const std::map<std::string, size_t>& spineIndexOf);
+    void saveContents(std::vector<uint8_t>& data) const;
+    bool loadContents(const std::vector<uint8_t>& data);
+    void readFallbackChapterList();
+    void splitLargeChapters();
+    void prepareChapterState();
+    // Each loader thread has its own archive handle, extraction scratch and
+    // result queue.
+    struct LoaderSlot {
+        ZipIndex zip;
+        HtmlTextExtractor extractor;
+        SpscQueue<LoadedChapter, 4> results; // worker -> UI thread
+    };
+
+    std::shared_ptr<const Chapter> loadChapter(size_t spineIndex, ZipIndex& archive, HtmlTextExtractor& extractor);
+    void received(LoadedChapter& loaded);
+    bool takeResult(LoadedChapter& loaded);
+    void loadInBackground(size_t spineIndex, bool requested, size_t worker);
+    size_t postedResults();
+    void postResult();
+    void submitIndexBuild();
+    void buildSearchIndex();
+    void skipIndexing();
+
+    std::string bookPath;
+    ZipIndex zip;     // opened lazily when the book came from the disk cache
+    HtmlTextExtractor extractor; // scratch for chapters decoded on the UI thread
+    FileReadStats loaderReadStats; // from loader archive handles already closed
+    BookCache diskCache;
+    Mutex diskCacheLock;
+    std::vector<std::string> spine; // archive paths in reading order
+    std::vector<uint16_t> spineParts; // which part of its archive file each spine entry holds
+    std::string bookTitle;
+    std::string bookAuthor;
+    std::vector<TocEntry> tableOfContents;
+    std::vector<std::vector<std::string>> anchorIds; // per chapter, sorted: the fragments linked to
+    ChapterCache chapterCache;
+    size_t decodedBudget; // the chapter cache's budget with an empty store
+    TextStore textStore;
+    std::atomic<bool> packing; // the store has room; read by the loaders
+    size_t lineWidth;
+    size_t maxChapterText;
+    size_t maxSearchTermBytes;
+    std::string lastError;
+
+    std::vector<bool> measured;
+    std::vector<std::vector<uint8_t>> measuredLines;
+    std::vector<std::vector<uint32_t>> anchorOffsets; // per chapter, lined up with anchorIds once measured
+    size_t chaptersLoaded;
+
+    SearchIndex searchIndex;
+    std::vector<std::vector<uint8_t>> chapterTerms; // per chapter, until all are in
+    std::vector<bool> termsReceived;
+    size_t termsCount;
+    size_t termBytes;
+    bool indexSkipped;
+    std::atomic<bool> indexing;                        // set while loaders run; read by them
+    std::vector<std::vector<uint8_t>> pendingIndexTerms; // handed to the build task
+    std::unique_ptr<SearchIndex> builtIndex;
+    std::atomic<bool> indexBuilt;
+    std::atomic<bool> indexBuilding; // the build task is queued or running and will hold a worker a while
+
+    TaskPool loaders;
+    std::vector<std::unique_ptr<LoaderSlot>> loaderSlots;
+    std::unique_ptr<std::atomic<bool>[]> claimed; // chapter already taken by a spine pass task
+    Mutex resultLock;
+    Condition resultPosted;
+    size_t resultsPosted; // results handed in or dropped by the loaders, under resultLock
+    std::atomic<bool> stopRequested;
+};
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+// Last-modified time of a file or directory, or 0 if it can't be read.
+// Only meant for spotting changes, so the unit is whatever the platform uses.
+uint64_t modificationTime(const std::string& path);
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "surface.h"
+
+// A 1-bit font: count glyphs from firstCodepoint on, each cellHeight rows
+// of one byte with bit 0 the leftmost pixel.
+struct BitmapFont {
+    const uint8_t* bits;
+    uint32_t firstCodepoint;
+    size_t count;
+    int cellWidth; // at most 8
+    int cellHeight;
+};
+
+// The font the reader draws with: printable ASCII, 8x8.
+BitmapFont builtinFont();
+
+struct Glyph {
+    uint32_t offset; // of its first column in the atlas
+    uint8_t width;   // columns with ink
+    uint8_t advance; // how far the pen moves
+    int8_t bearing;  // from the pen to the first column with ink
+};
+
+// A font rasterised once into a strip of 8-bit coverage, so drawing a
+// glyph is a copy with no bit unpacking or scaling. Each glyph keeps only
+// its inked columns, stored one after another top to bottom, which is the
+// order a console framebuffer is written in.
+//
+// Glyphs can be spaced by their own width (proportional) or by the cell;
+// either way digits share one advance so columns of numbers line up.
+class GlyphAtlas {
+public:
+    GlyphAtlas();
+
+    void build(const BitmapFont& font, bool proportional);
+
+    int lineHeight() const { return height; }
+    int cellWidth() const { return cell; }
+
+    // A code point's own glyph, a close ASCII stand-in for typographic
+    // punctuation and accented Latin letters, or '?'.
+    const Glyph& glyph(uint32_t codepoint) const;
+    int advance(uint32_t codepoint) const { return glyph(codepoint).advance; }
+
+    // Draws a glyph with the pen at (x, top), blending it over what is
+    // there, clipped to the surface. Returns the advance.
+    int draw(const Surface& surface, int x, int top, uint32_t codepoint, uint16_t colour) const;
+
+private:
+    GlyphAtlas(const GlyphAtlas&);
+    GlyphAtlas& operator=(const GlyphAtlas&);
+
+    size_t indexOf(uint32_t codepoint) const;
+
+    std::vector<Glyph> glyphs;
+    std::vector<uint8_t> coverage;
+    uint32_t firstCodepoint;
+    size_t fallback; // '?'
+    int cell;
+    int height;
+};
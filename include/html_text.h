@@ -0,0 +1,119 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "entity_decoder.h"
+
+std::string toLower(const std::string& input);
+
+// Decodes character references and transliterates UTF-8 to ASCII in one pass.
+std::string decodeHtmlEntities(const std::string& input, bool preserveMarkup = false);
+
+// Event-driven XHTML to plain text converter.
+//
+// Markup is consumed byte by byte as it is inflated, so no document tree is
+// built and nothing recurses: the only state kept is the current tag name and
+// a few flags. Malformed or plain-HTML chapters are handled the same way as
+// well-formed XHTML. Block elements start and end a line (headings and
+// quotes get a blank line), list items get a bullet, <br> forces a break,
+// and the contents of <head>, <script> and <style> are dropped.
+class HtmlTextExtractor {
+public:
+    HtmlTextExtractor();
+
+    void reset();
+    void feed(const char* data, size_t length);
+    void finish();
+
+    // Stops taking in text once the output reaches limit bytes, so one huge
+    // chapter can't exhaust memory. reset() keeps the limit and the output
+    // buffer's capacity, which lets a reused extractor serve as scratch space
+    // for chapter after chapter; releaseMemory() hands the buffer back.
+    void setOutputLimit(size_t limit) { outputLimit = limit; }
+    bool truncated() const { return wasTruncated; }
+    void releaseMemory();
+
+    // Keeps only the text from offset start to offset end of the whole
+    // document's text, so a chapter too large to hold can be extracted one
+    // part per pass. Each cut moves back to just after the last line break
+    // in the windowSlack bytes before it, decided identically whichever side
+    // of it is being kept, so consecutive windows join up exactly. end =
+    // SIZE_MAX runs to the end of the document. reset() clears the window.
+    void setWindow(size_t start, size_t end);
+    // True once the window's end is cut: the rest of the document can be skipped.
+    bool windowDone() const { return windowClosed; }
+
+    // Notes where the elements with these ids (or <a name>) start in the
+    // output, for table of contents links into the middle of a chapter. The
+    // ids must be sorted and outlive the extraction; reset() forgets them.
+    // After finish(), anchors() lines up with ids, and an id that never
+    // turned up points at the start of the text.
+    void setAnchors(const std::vector<std::string>* ids);
+    const std::vector<uint32_t>& anchors() const { return anchorOffsets; }
+
+    std::string& text() { return output; }
+
+private:
+    enum State {
+        TEXT,
+        TAG_OPEN,      // just after '<'
+        TAG_NAME,
+        TAG_ATTRIBUTES,
+        ATTRIBUTE_VALUE,
+        MARKUP_DECLARATION, // just after "<!"
+        COMMENT,
+        CDATA,
+        SKIP_TO_CLOSE, // doctype, processing instruction
+        RAW_TEXT       // inside <script> or <style>
+    };
+
+    static const size_t maxTagName = 16;
+    static const size_t maxAttributeName = 8;  // longer names are never id or name
+    static const size_t maxAnchorLength = 256;
+    static const size_t windowSlack = 4096;
+
+    void feedMarkup(const char* data, size_t length);
+    void applyWindow(bool final);
+    size_t windowCut(size_t offset) const;
+    void appendText(const char* data, size_t length);
+    void flushText();
+    void collapseWhitespace(size_t from);
+    void lineBreak(bool force);
+    void blankLine();
+    void finishTag();
+    bool isAnchorAttribute() const;
+    void matchAnchor();
+
+    State state;
+    char tagName[maxTagName];
+    size_t tagNameLength;
+    bool closingTag;
+    bool selfClosing;
+    char quote;
+    size_t markupMatch; // progress through "--", "[CDATA[", "-->", "]]>" or "</script"
+    const char* markupTarget;
+    const char* rawTextTag;
+    int headDepth;
+
+    char attributeName[maxAttributeName];
+    size_t attributeNameLength;
+    bool inAttributeName;
+    bool capturingValue; // the value being read is an id that may be an anchor
+    std::string attributeValue;
+    const std::vector<std::string>* anchorIds;
+    std::vector<uint32_t> anchorOffsets;
+    size_t pendingAnchor; // matched in the current tag; placed once it closes
+
+    EntityDecoder decoder;
+    std::string output;
+    size_t outputLimit;
+    bool wasTruncated;
+    size_t windowStart;
+    size_t windowEnd;
+    size_t dropped;     // document text before output[0], outside the window
+    bool windowOpened;  // the start cut has been made
+    bool windowClosed;  // the end cut has been made; the rest is ignored
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// Counters from the last scan, for the status line.
+struct LibraryScanStats {
+    size_t directoriesVisited;
+    size_t directoriesRead;  // directories whose listing had to be read again
+    size_t statCalls;        // entries readdir couldn't classify by d_type
+};
+
+// Persisted list of the EPUB files under the library root.
+//
+// Every directory is stored with its modification time, its subdirectories
+// and the books directly inside it. A scan walks the saved tree and only
+// reads the listing of directories whose mtime has changed (or is unknown);
+// unchanged ones cost one timestamp lookup each. Entries are classified by
+// readdir's d_type, falling back to stat() only when that is DT_UNKNOWN.
+class LibraryIndex {
+public:
+    LibraryIndex();
+
+    bool load(const char* path);
+    bool save(const char* path) const;
+
+    // Brings the index up to date with the tree under root. With fullRescan,
+    // every directory is read again regardless of its saved mtime.
+    void scan(const std::string& root, bool fullRescan = false);
+
+    // Directories that directly contain books, each with its sorted book names.
+    std::map<std::string, std::vector<std::string>> booksByDirectory() const;
+
+    const LibraryScanStats& stats() const { return lastStats; }
+
+private:
+    struct Directory {
+        uint64_t mtime;
+        std::vector<std::string> subdirectories; // names, not paths
+        std::vector<std::string> books;
+    };
+
+    void scanDirectory(const std::string& path, bool fullRescan, std::map<std::string, Directory>& scanned);
+    bool readListing(const std::string& path, Directory& dir);
+
+    std::map<std::string, Directory> directories; // keyed by full path
+    LibraryScanStats lastStats;
+};
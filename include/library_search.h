@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+struct LibrarySearchResult {
+    std::string path;
+    std::string title;
+    std::string author;
+    bool inMetadata; // every query word is in the title or author
+};
+
+// Reports indexing progress: books done, books to index and the one being
+// read. Returning false stops the update; books already done are kept.
+typedef std::function<bool(size_t done, size_t total, const std::string& path)> IndexProgress;
+
+// Word index over the title, author and text of every book in the library,
+// kept on the SD card so searching never opens an EPUB.
+//
+// A catalog file lists every indexed book with its size and mtime, and the
+// postings live in a handful of immutable segment files. A segment maps
+// 32-bit word hashes to ascending book ids: varint-coded postings first, then
+// the sorted term table, then every 64th term hash as a sparse index. Only
+// that sparse index is held in memory; a lookup reads one 64-entry block of
+// the term table and one posting list.
+//
+// update() indexes new and changed books into a fresh segment and marks the
+// old entries of changed or deleted books dead in the catalog. Book ids only
+// grow, so merging segments oldest first keeps posting lists sorted; once
+// there are too many segments they are merged into one and dead books are
+// dropped for good.
+class LibrarySearch {
+public:
+    explicit LibrarySearch(const std::string& directory);
+    ~LibrarySearch();
+
+    bool load();
+    bool update(const std::vector<std::string>& bookPaths, const IndexProgress& progress);
+
+    // Books containing every word of the query, metadata matches first.
+    bool search(const std::string& query, std::vector<LibrarySearchResult>& results, size_t maxResults);
+
+    size_t bookCount() const;
+    const std::string& error() const { return lastError; }
+
+private:
+    struct Book {
+        uint32_t id;
+        uint64_t size;
+        uint64_t mtime;
+        bool live;
+        std::string path;
+        std::string title;
+        std::string author;
+    };
+
+    struct Segment {
+        uint32_t number;
+        FILE* file;
+        uint32_t termCount;
+        uint32_t postingsOffset;
+        uint32_t tableOffset;
+        std::vector<uint32_t> samples;
+    };
+
+    LibrarySearch(const LibrarySearch&);
+    LibrarySearch& operator=(const LibrarySearch&);
+
+    bool saveCatalog();
+    std::string segmentPath(uint32_t number) const;
+    bool openSegment(uint32_t number, Segment& segment);
+    void closeSegments();
+    bool readPostings(Segment& segment, uint32_t offset, uint32_t length, std::vector<uint32_t>& ids);
+    bool findPostings(Segment& segment, uint32_t hash, std::vector<uint32_t>& ids);
+    bool writeSegment(std::vector<uint64_t>& pairs);
+    bool mergeSegments();
+    bool indexBook(const std::string& path, Book& book, std::vector<uint64_t>& pairs);
+    std::vector<bool> liveIds() const;
+    bool fail(const std::string& message);
+
+    std::string directory;
+    std::vector<Book> books; // ascending id
+    std::vector<Segment> segments; // oldest first
+    uint32_t nextBookId;
+    uint32_t nextSegment;
+    std::string lastError;
+};
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#ifdef __3DS__
+#include <3ds.h>
+#else
+// The console's key bits and integer types, so the UI code reads the same on both sides.
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+enum {
+    KEY_A = 1u << 0, KEY_B = 1u << 1, KEY_SELECT = 1u << 2, KEY_START = 1u << 3,
+    KEY_DRIGHT = 1u << 4, KEY_DLEFT = 1u << 5, KEY_DUP = 1u << 6, KEY_DDOWN = 1u << 7,
+    KEY_R = 1u << 8, KEY_L = 1u << 9, KEY_X = 1u << 10, KEY_Y = 1u << 11,
+    KEY_ZL = 1u << 14, KEY_ZR = 1u << 15,
+    KEY_CPAD_RIGHT = 1u << 28, KEY_CPAD_LEFT = 1u << 29, KEY_CPAD_UP = 1u << 30, KEY_CPAD_DOWN = 1u << 31,
+    KEY_UP = KEY_DUP | KEY_CPAD_UP, KEY_DOWN = KEY_DDOWN | KEY_CPAD_DOWN,
+    KEY_LEFT = KEY_DLEFT | KEY_CPAD_LEFT, KEY_RIGHT = KEY_DRIGHT | KEY_CPAD_RIGHT
+};
+#endif
+
+// Everything the UI needs from the machine it runs on: input, the text
+// console, frame pacing, clocks and where files live.
+//
+// Text printed with screenPrint() goes into a TextScreen, and presentFrame()
+// draws what changed into the back framebuffer and flips. On the console
+// that is the real double-buffered RGB565 framebuffer and the rest wraps
+// libctru. Everywhere else the reader runs headless into framebuffers in
+// memory: keys come from a script, and every keypress is timed until the
+// frame it causes is finished, which makes interaction latency measurable
+// off-device:
+//
+//   g++ -std=gnu++11 -O2 -Iinclude source/*.cpp -ltinyxml2 -llz4 -lz -lpthread -o ereader
+//   ./ereader --script open-and-page.keys --sd ./sdmc [--screen screen.txt]
+//             [--snapshot top.ppm] [--console-path]
+//
+// --screen also writes the printed text and escapes to a file (page images
+// as they are drawn, not when they are shown), --snapshot saves the last
+// top screen, and --console-path clears and redraws every frame whole in
+// fixed-width cells, the way the libctru console did, to compare against.
+//
+// A script has one command per line; '#' starts a comment:
+//
+//   press KEYS [times]   press and release, once per two frames
+//   hold KEYS frames     hold down, so lists auto-repeat
+//   wait frames          nothing pressed
+//   sleep ms             really wait, e.g. for background loading
+//   type TEXT            answer for the next on-screen keyboard
+//
+// KEYS is one or more of A B X Y L R ZL ZR START SELECT UP DOWN LEFT RIGHT
+// joined with '+'. When the script runs out, platformRunning() turns false
+// and the app unwinds as if closed, then the latency report for each key is
+// printed.
+
+// False if the app can't start (on the host: bad arguments or script).
+// bottomScreen sets up a second console for status text.
+bool platformInit(int argc, char** argv, bool bottomScreen);
+void platformExit();
+
+// Once per frame; false once the app should close.
+bool platformRunning();
+
+// Input, sampled once per frame by scanInput().
+void scanInput();
+u32 keysDown();
+u32 keysHeld();
+u32 keysDownRepeat(); // keysDown(), plus held keys again after delay frames, then every interval
+void setKeyRepeat(u32 delay, u32 interval);
+
+// Top screen text console; ANSI escapes position the cursor and set colours.
+void clearScreen();
+void screenPrint(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void presentFrame(); // shows what was printed since the last one
+void waitForFrame(); // presents first if anything was printed since
+
+// Top screens drawn ahead of time. Between beginPageImage() and
+// endPageImage(), clearScreen() and screenPrint() write to an off-screen
+// copy of the top screen kept in that slot, which endPageImage() draws into
+// the slot's own pixels. showPageImage() later copies those pixels into
+// the top screen's back buffer and takes over the slot's text, so showing
+// the page costs a copy instead of a page of glyphs; anything printed after
+// it is drawn on top by the next presentFrame() as usual.
+const size_t pageImageCount = 3;
+void beginPageImage(size_t slot);
+void endPageImage();
+void showPageImage(size_t slot);
+
+// The bottom console, if platformInit() was asked for it.
+void drawBottomScreen(const std::string& text);
+size_t bottomScreenColumns();
+
+// On-screen keyboard. False if cancelled or left empty.
+bool askText(const char* hint, size_t maxLength, std::string& text);
+
+bool isNew3DS();
+
+// Milliseconds since some fixed point, for intervals a person would notice.
+uint64_t clockMilliseconds();
+// A much finer clock for short operations.
+uint64_t clockTicks();
+double ticksAsMilliseconds(uint64_t ticks);
+
+// Paths under "sdmc:/" are on the SD card; headless runs map them into a
+// directory on the host.
+std::string storagePath(const char* path);
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// Stage timers and counters for finding out where opening a book spends its
+// time. Everything here is only built with -DEREADER_PROFILE; otherwise the
+// macros expand to nothing and no profiling code is compiled in (a disabled
+// PROFILE_COUNT still names its amount, unevaluated, to keep it "used").
+//
+// PROFILE_SCOPE times the rest of the enclosing block against a stage, using
+// the system tick counter. Scopes nest per thread and each stage is charged
+// only its own time, so an HTML scope around a zip stream doesn't also count
+// the reads and inflates inside it. Stages run on loader threads too, so the
+// totals are thread time and can add up to more than the wall clock.
+enum ProfileStage {
+    STAGE_OPEN,         // archive directory and package setup
+    STAGE_SD_READ,
+    STAGE_INFLATE,
+    STAGE_XML,          // container.xml and the OPF
+    STAGE_HTML,         // tag scanning in chapter documents
+    STAGE_ENTITIES,     // character references and UTF-8
+    STAGE_WRAP,         // line breaking and measuring
+    STAGE_DISK_CACHE,
+    STAGE_SEARCH_INDEX,
+    STAGE_LZ4,          // packing and unpacking the in-memory text store
+    STAGE_LIBRARY_SCAN,
+    STAGE_RENDER,       // drawing text into the framebuffers
+    STAGE_COUNT
+};
+
+enum ProfileCounter {
+    COUNTER_BYTES_READ,
+    COUNTER_READ_CALLS,
+    COUNTER_BYTES_INFLATED,
+    COUNTER_ALLOCATIONS,
+    COUNTER_COUNT
+};
+
+#ifdef EREADER_PROFILE
+
+class ProfileScope {
+public:
+    explicit ProfileScope(ProfileStage stage);
+    ~ProfileScope();
+
+private:
+    ProfileScope(const ProfileScope&);
+    ProfileScope& operator=(const ProfileScope&);
+
+    ProfileStage stage;
+    uint64_t start;
+    uint64_t childTicks;
+    ProfileScope* parent;
+};
+
+void profileCount(ProfileCounter counter, uint64_t amount);
+
+// Clears every total, and restarts the peak heap from what is in use now.
+void profileReset();
+
+// One line per stage that ran, then the counters and the heap peak, each
+// line at most width characters.
+std::string profileReport(size_t width);
+
+// Appends the report to a log file under a heading. False if it can't be written.
+bool profileAppendLog(const char* path, const std::string& heading);
+
+// The same totals as numbers, for tools that format them their own way.
+struct ProfileTotals {
+    double stageMilliseconds[STAGE_COUNT];
+    uint64_t stageCalls[STAGE_COUNT];
+    uint64_t counters[COUNTER_COUNT];
+    size_t heapPeak; // bytes
+};
+
+ProfileTotals profileTotals();
+const char* profileStageName(ProfileStage stage);
+
+#define PROFILE_JOIN2(a, b) a##b
+#define PROFILE_JOIN(a, b) PROFILE_JOIN2(a, b)
+#define PROFILE_SCOPE(stage) ProfileScope PROFILE_JOIN(profileScope, __LINE__)(stage)
+#define PROFILE_COUNT(counter, amount) profileCount(counter, amount)
+
+#else
+
+#define PROFILE_SCOPE(stage) ((void)0)
+#define PROFILE_COUNT(counter, amount) ((void)sizeof(amount))
+
+#endif
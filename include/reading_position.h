@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// A place in a book that survives page size changes: the chapter and the
+// byte offset of the first character on screen in its extracted text.
+struct ReadingPosition {
+    size_t spineIndex;
+    size_t offset;
+};
+
+// Last reading position of each recently read book, keyed by EPUB path.
+//
+// Stored as one "<spine>\t<offset>\t<path>" line per book, most recently
+// read first. Only the newest maxBooks entries are kept, so the file stays
+// small no matter how many books pass through the reader.
+class ReadingPositions {
+public:
+    static const size_t maxBooks = 256;
+
+    bool load(const char* path);
+    bool save(const char* path) const;
+
+    bool find(const std::string& bookPath, ReadingPosition& position) const;
+    void set(const std::string& bookPath, const ReadingPosition& position);
+
+private:
+    struct Entry {
+        std::string bookPath;
+        ReadingPosition position;
+    };
+
+    std::vector<Entry> entries; // most recent first
+};
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Where a search query was found: a chapter and a byte offset into its text,
+// plus what a result list shows, taken while the chapter was at hand.
+struct SearchHit {
+    size_t spineIndex;
+    size_t offset;
+    size_t line;         // display line holding the offset
+    std::string snippet; // text around the hit, newlines as spaces
+};
+
+// Case-insensitive trigram index over the text of a whole book.
+//
+// Text is folded to 37 symbols (letters, digits and "anything else"), so
+// every trigram fits a fixed table of 37^3 posting lists and no hashing is
+// needed. Chapters are cut into 128-byte blocks, and a trigram's list holds
+// each block it occurs in, as varint-coded deltas of (chapter << 16 | block).
+// A query keeps the blocks where every one of its trigrams appears in the
+// block or the one after it, which covers matches that cross a block
+// boundary; those candidates are then confirmed against the text itself.
+//
+// Building happens in two steps so chapters can be indexed on any thread and
+// in any order: encodeChapter() turns one chapter into a sorted list of its
+// (trigram, block) pairs, and build() merges the lists in spine order.
+class SearchIndex {
+public:
+    static const size_t blockSize = 128;
+    static const size_t minQueryLength = 3;
+    static const size_t maxQueryLength = blockSize;
+
+    SearchIndex();
+
+    static void encodeChapter(const std::string& text, std::vector<uint8_t>& encoded);
+    void build(const std::vector<std::vector<uint8_t>>& chapters);
+
+    bool ready() const { return !offsets.empty(); }
+    void clear();
+
+    // Appends the serialised index to out / restores it. load() rejects data
+    // from another format version or with inconsistent sizes.
+    void save(std::vector<uint8_t>& out) const;
+    bool load(const std::vector<uint8_t>& data);
+
+    // Candidate blocks for query, in book order, as (chapter << 16 | block).
+    // Returns false if the query is too short or too long to look up.
+    bool candidates(const std::string& query, std::vector<uint32_t>& blocks) const;
+
+    // Appends the offsets in text where query starts within [from, to),
+    // compared without regard to case.
+    static void findMatches(const std::string& text, const std::string& query, size_t from, size_t to,
+                            std::vector<size_t>& offsets);
+
+private:
+    std::vector<uint32_t> offsets; // start of each trigram's list in postings, plus an end marker
+    std::vector<uint8_t> postings;
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+#include <utility>
+
+// Fixed-size lock-free queue for exactly one producer thread and one consumer
+// thread. push() and pop() never block; they return false when the queue is
+// full or empty and the caller decides whether to wait or do something else.
+template <typename T, size_t Capacity>
+class SpscQueue {
+public:
+    SpscQueue() : head(0), tail(0) {}
+
+    // Producer side.
+    bool push(T value) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t next = (t + 1) % slotCount;
+        if (next == head.load(std::memory_order_acquire)) return false;
+        slots[t] = std::move(value);
+        tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side.
+    bool pop(T& out) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+        out = std::move(slots[h]);
+        slots[h] = T();
+        head.store((h + 1) % slotCount, std::memory_order_release);
+        return true;
+    }
+
+private:
+    SpscQueue(const SpscQueue&);
+    SpscQueue& operator=(const SpscQueue&);
+
+    // One slot stays empty to tell a full queue from an empty one.
+    static const size_t slotCount = Capacity + 1;
+
+    T slots[slotCount];
+    std::atomic<size_t> head; // next slot to pop, owned by the consumer
+    std::atomic<size_t> tail; // next slot to fill, owned by the producer
+};
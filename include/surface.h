@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+inline uint16_t rgb565(uint8_t r, uint8_t g, uint8_t b) {
+    return (uint16_t)(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+}
+
+// A 16-bit RGB565 drawing target addressed in screen coordinates. Pixel
+// (x, y) is at origin + x * xStep + y * yStep, so the console's
+// framebuffers, which are stored turned a quarter, and plain row-major
+// buffers on a host are drawn by the same code.
+struct Surface {
+    uint16_t* origin;
+    ptrdiff_t xStep;
+    ptrdiff_t yStep;
+    int width;
+    int height;
+
+    uint16_t* at(int x, int y) const { return origin + x * xStep + y * yStep; }
+};
+
+// Rows of width pixels, top to bottom.
+inline Surface rowMajorSurface(uint16_t* pixels, int width, int height) {
+    Surface surface = { pixels, 1, width, width, height };
+    return surface;
+}
+
+// A framebuffer from gfxGetFramebuffer(): one column of height pixels
+// after another, each stored bottom to top.
+inline Surface columnMajorSurface(uint16_t* pixels, int width, int height) {
+    Surface surface = { pixels + (height - 1), height, -1, width, height };
+    return surface;
+}
+
+// Clipped to the surface. Walks columns on the outside, which is the
+// memory order of a console framebuffer.
+inline void fillRect(const Surface& surface, int x, int y, int width, int height, uint16_t colour) {
+    int left = x < 0 ? 0 : x;
+    int top = y < 0 ? 0 : y;
+    int right = x + width > surface.width ? surface.width : x + width;
+    int bottom = y + height > surface.height ? surface.height : y + height;
+    for (int column = left; column < right; column++) {
+        uint16_t* pixel = surface.at(column, top);
+        for (int row = top; row < bottom; row++, pixel += surface.yStep) *pixel = colour;
+    }
+}
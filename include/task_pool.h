@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "worker_thread.h"
+
+// Receives the index of the worker running it, so a task can use state that
+// belongs to that worker (an open archive, an output queue) without locking.
+typedef std::function<void(size_t worker)> Task;
+
+// Small work-stealing thread pool.
+//
+// Every worker has its own deque. submit() deals tasks out to them in turn;
+// a worker takes its own tasks oldest first, and once it runs dry it steals
+// the newest task from another worker, so submission order is roughly kept
+// while no thread sits idle with work queued elsewhere. submitUrgent() puts a
+// task on a shared queue that every worker checks before its own deque.
+class TaskPool {
+public:
+    TaskPool();
+    ~TaskPool();
+
+    // Returns the number of threads actually started.
+    size_t start(size_t threadCount);
+    // Drops queued tasks and waits for the running ones to return.
+    void stop();
+
+    size_t threadCount() const { return workers.size(); }
+
+    void submit(const Task& task);
+    void submitUrgent(const Task& task);
+
+private:
+    struct Worker {
+        TaskPool* pool;
+        size_t index;
+        WorkerThread thread;
+        Mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    TaskPool(const TaskPool&);
+    TaskPool& operator=(const TaskPool&);
+
+    static void workerEntry(void* worker);
+    void run(Worker& worker);
+    bool take(Worker& worker, Task& task);
+    void post();
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    Mutex urgentLock;
+    std::deque<Task> urgent;
+    Mutex idleLock;
+    Condition workPosted;
+    size_t postedTasks; // under idleLock; idle workers sleep until it moves
+    std::atomic<bool> stopping;
+    size_t nextWorker;
+};
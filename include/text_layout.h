@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+// A line of laid-out text, pointing into the chapter's own buffer.
+struct LineView {
+    const char* data;
+    size_t length;
+};
+
+// Scans text once and records the offset at which every display line starts.
+// Lines are broken at '\n' and word-wrapped to at most width - 1 characters,
+// matching what fits on one row of the console without it wrapping by itself.
+// Words longer than a line are split.
+void breakLines(const std::string& text, size_t width, std::vector<uint32_t>& lineStarts);
+
+// The visible part of a line, without the space or newline that ended it.
+LineView lineAt(const std::string& text, const std::vector<uint32_t>& lineStarts, size_t line);
+
+// Visible length of every line, capped at 255. Enough to count a chapter's
+// pages at any page size once its text has been dropped from memory.
+void measureLines(const std::string& text, const std::vector<uint32_t>& lineStarts, std::vector<uint8_t>& lengths);
+
+// Number of pages PageIndex produces for a chapter laid out from its first line.
+size_t countPages(const std::vector<uint8_t>& lengths, size_t maxChars, size_t maxLines);
+
+// Zero-based page that line falls on under the same layout, and the line
+// that page starts at.
+size_t pageOfLine(const std::vector<uint8_t>& lengths, size_t maxChars, size_t maxLines, size_t line, size_t& pageStart);
+
+// Display line that holds the given text offset.
+size_t lineOfOffset(const std::vector<uint32_t>& lineStarts, size_t offset);
+
+// Page boundaries for one chapter, worked out outward from a reading anchor.
+//
+// A page is a run of whole lines: at most maxLines lines and, unless a single
+// line is longer, at most maxChars characters. Instead of paginating the whole
+// chapter up front, reset() lays out only the page that starts at the anchor
+// line; neighbouring pages are added on demand by nextPage()/previousPage()
+// and the rest a few at a time through extend(), so changing the page size
+// costs one page of work and the reader stays on the same passage.
+class PageIndex {
+public:
+    PageIndex();
+
+    // Starts over with the current page beginning at anchorLine.
+    void reset(const std::string& text, const std::vector<uint32_t>& lineStarts,
+               size_t maxChars, size_t maxLines, size_t anchorLine);
+    // Starts over with the current page being the last page of the text.
+    void resetAtEnd(const std::string& text, const std::vector<uint32_t>& lineStarts,
+                    size_t maxChars, size_t maxLines);
+
+    // Lays out up to maxPages more pages, alternating before and after the
+    // known ones. Returns true once every page is known.
+    bool extend(size_t maxPages);
+    bool complete() const { return reachedStart && reachedEnd; }
+
+    bool nextPage();
+    bool previousPage();
+
+    // Index of the current page and number of pages; exact once complete().
+    size_t pageNumber() const { return current; }
+    size_t pageCount() const { return starts.size(); }
+
+    size_t firstLine() const { return starts[current]; }
+    size_t endLine() const { return current + 1 < starts.size() ? starts[current + 1] : forwardEnd; }
+
+private:
+    size_t lineLength(size_t line) const;
+    size_t fillForward(size_t line) const;
+    size_t fillBackward(size_t line) const;
+    bool addPageAfter();
+    bool addPageBefore();
+
+    const std::string* text;
+    const std::vector<uint32_t>* lineStarts;
+    size_t maxChars;
+    size_t maxLines;
+
+    std::deque<uint32_t> starts; // first line of each known page, ascending
+    size_t current;
+    size_t forwardEnd;           // line after the last known page
+    bool reachedStart;
+    bool reachedEnd;
+};
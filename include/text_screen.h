@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "glyph_atlas.h"
+#include "surface.h"
+
+// A text console drawn into a framebuffer with a GlyphAtlas.
+//
+// write() takes the same output the libctru console did: UTF-8 text and
+// the ANSI escapes the UI uses (cursor position, clearing the line or the
+// screen, the eight foreground colours). It only updates a grid of cells.
+// present() then draws into a surface just the rows, and from the first
+// differing cell on, that are not already showing there.
+//
+// Each surface cycled through is a numbered buffer with its own record of
+// what it shows, so with double buffering a change is drawn into the back
+// buffer now and into the other one the frame after, and a page turn
+// costs one page of glyphs per buffer, not a clear and a reprint.
+class TextScreen {
+public:
+    TextScreen(int columns, int rows, size_t buffers);
+
+    int columns() const { return width; }
+    int rows() const { return height; }
+
+    void clear();
+    void write(const char* text, size_t length);
+
+    void present(const GlyphAtlas& atlas, const Surface& surface, size_t buffer);
+    // Forgets what buffer shows, so the next present() clears and draws it all.
+    void invalidate(size_t buffer);
+    // Takes over other's text as if it had been written here, for when the
+    // pixels of its otherBuffer have been copied into buffer; what that
+    // buffer shows is taken over with them. Both screens must be the same size.
+    void adopt(const TextScreen& other, size_t otherBuffer, size_t buffer);
+
+    // Colour indices for the ANSI foreground colours 30 to 37, then the default.
+    static const uint8_t defaultColour = 8;
+    static uint16_t palette(uint8_t colour);
+
+private:
+    struct Cell {
+        uint32_t codepoint;
+        uint8_t colour;
+
+        bool operator==(const Cell& other) const { return codepoint == other.codepoint && colour == other.colour; }
+        bool operator!=(const Cell& other) const { return !(*this == other); }
+    };
+
+    struct Shown {
+        std::vector<Cell> cells;
+        bool valid; // false until drawn whole once
+    };
+
+    enum ParseState { PLAIN, ESCAPE, CONTROL };
+    static const int maxParameters = 4;
+
+    Cell blank() const;
+    void put(uint32_t codepoint);
+    void newLine();
+    void clearCells(size_t from, size_t to);
+    void control(char command);
+
+    int width;
+    int height;
+    std::vector<Cell> cells;
+    std::vector<Shown> shown;
+
+    int cursorColumn;
+    int cursorRow;
+    uint8_t colour;
+
+    ParseState state;
+    int parameters[maxParameters];
+    int parameterCount;
+    uint32_t pendingCodepoint; // a UTF-8 sequence split across writes
+    int pendingBytes;
+};
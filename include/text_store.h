@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// One chapter's text as independently LZ4-compressed blocks. Each block can
+// be unpacked on its own, straight into its place in the output, so nothing
+// bigger than the finished text is ever allocated.
+struct CompressedText {
+    static const size_t blockSize = 32 * 1024;
+
+    std::vector<char> data;          // compressed blocks back to back
+    std::vector<uint32_t> blockEnds; // end of each block in data
+    uint32_t originalSize;
+
+    CompressedText() : originalSize(0) {}
+
+    static bool compress(const std::string& text, CompressedText& out);
+    bool decompress(std::string& text) const;
+
+    size_t memoryUsage() const { return sizeof(CompressedText) + data.capacity() + blockEnds.capacity() * sizeof(uint32_t); }
+};
+
+// Compressed text of every chapter that fits a byte budget, so chapters that
+// drop out of the decoded cache can come back without touching the SD card.
+// Chapters arrive nearest the reading position first, so the first one that
+// doesn't fit closes the store and it takes no more after that.
+class TextStore {
+public:
+    TextStore();
+
+    void setBudget(size_t byteBudget) { budget = byteBudget; }
+    bool full() const { return closed || bytesUsed >= budget; }
+
+    bool contains(size_t spineIndex) const { return chapters.count(spineIndex) != 0; }
+    // Takes over text's buffers. False if the chapter is already stored or
+    // doesn't fit, in which case text is left alone; one that doesn't fit
+    // also makes the store full until clear().
+    bool put(size_t spineIndex, CompressedText& text);
+    bool get(size_t spineIndex, std::string& text) const;
+    void clear();
+
+    size_t originalBytes() const { return bytesOriginal; }
+    size_t usedBytes() const { return bytesUsed; }
+
+private:
+    std::map<size_t, CompressedText> chapters;
+    size_t budget;
+    size_t bytesUsed;
+    size_t bytesOriginal;
+    bool closed; // a chapter was turned away for lack of room
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __3DS__
+#include <3ds.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+// A background thread: a libctru thread on the console and a std::thread
+// everywhere else.
+//
+// On the console, slot picks the core: slot 0 goes to the system core when
+// the app is allowed time there, slot 1 to the extra app core of a New 3DS,
+// and anything else (or a core that can't be used) to the app core at a
+// lower priority than the UI, so it only runs while the UI waits for VBlank.
+class WorkerThread {
+public:
+    typedef void (*Entry)(void* arg);
+
+    WorkerThread();
+    ~WorkerThread();
+
+    bool start(Entry entry, void* arg, size_t slot = 0);
+    void join();
+    bool running() const;
+
+    // Cores background work can usefully spread over.
+    static size_t coreCount();
+
+private:
+    WorkerThread(const WorkerThread&);
+    WorkerThread& operator=(const WorkerThread&);
+
+#ifdef __3DS__
+    Thread thread;
+#else
+    std::thread thread;
+#endif
+};
+
+// Plain mutual exclusion; usable with std::lock_guard.
+class Mutex {
+public:
+    Mutex();
+
+    void lock();
+    void unlock();
+
+private:
+    friend class Condition;
+
+    Mutex(const Mutex&);
+    Mutex& operator=(const Mutex&);
+
+#ifdef __3DS__
+    LightLock handle;
+#else
+    std::mutex handle;
+#endif
+};
+
+// Lets a thread sleep until another one signals it. Waits are made with the
+// mutex locked, which is released while asleep, as with
+// std::condition_variable; a waiter can also wake without a signal, so it
+// re-checks what it waits for.
+class Condition {
+public:
+    Condition();
+
+    void wait(Mutex& mutex);
+    // False if the time ran out first.
+    bool wait(Mutex& mutex, unsigned timeoutMilliseconds);
+    void signal();    // wakes one waiter
+    void broadcast(); // wakes them all
+
+private:
+    Condition(const Condition&);
+    Condition& operator=(const Condition&);
+
+#ifdef __3DS__
+    CondVar handle;
+#else
+    std::condition_variable_any handle;
+#endif
+};
+
+// Gives up the CPU for roughly the given time.
+void sleepMilliseconds(unsigned milliseconds);
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "buffered_file.h"
+
+// One file inside the archive, as described by the ZIP central directory.
+struct ZipEntry {
+    std::string name;
+    uint32_t localHeaderOffset;
+    uint32_t compressedSize;
+    uint32_t uncompressedSize;
+    uint32_t crc32;
+    uint16_t method; // 0 = stored, 8 = deflate
+};
+
+// Receives an entry's uncompressed bytes piece by piece; returns false once
+// it has seen all it needs.
+typedef std::function<bool(const char* data, size_t length)> ZipChunkHandler;
+
+// Random-access view of a ZIP (EPUB) file.
+//
+// The central directory is parsed once in open(), after which any entry can be
+// read with a single seek to its local header followed by one inflate pass.
+// This replaces walking every header with libarchive for each chapter. All
+// reads go through a BufferedFile, and inflate takes its input straight out
+// of that buffer, so entries stored next to each other are read from the SD
+// card in a few large reads rather than one small one per chunk.
+class ZipIndex {
+public:
+    ZipIndex();
+    ~ZipIndex();
+
+    bool open(const char* path);
+    void close();
+    bool isOpen() const { return file.isOpen(); }
+
+    const ZipEntry* find(const std::string& name) const;
+    const std::vector<ZipEntry>& entries() const { return entryList; }
+
+    // Decompresses the whole entry into out. Returns false on I/O, format or CRC errors.
+    bool readEntry(const ZipEntry& entry, std::string& out);
+    bool readEntry(const std::string& name, std::string& out);
+
+    // Inflates the entry in small chunks and hands each one to handler, so the
+    // whole uncompressed file never has to be held in memory. A handler that
+    // stops early leaves the rest unread and its CRC unchecked.
+    bool streamEntry(const ZipEntry& entry, const ZipChunkHandler& handler);
+
+    // Storage reads since open(), kept after close().
+    const FileReadStats& readStats() const { return file.stats(); }
+
+    const std::string& error() const { return lastError; }
+
+private:
+    ZipIndex(const ZipIndex&);
+    ZipIndex& operator=(const ZipIndex&);
+
+    bool readCentralDirectory();
+    bool seekToData(const ZipEntry& entry);
+    const unsigned char* nextInput(uint32_t remaining, size_t& available);
+    bool fail(const std::string& message);
+
+    BufferedFile file;
+    uint64_t position; // of the next entry byte to read
+    std::vector<ZipEntry> entryList;
+    std::map<std::string, size_t> entriesByName;
+    std::vector<unsigned char> outputBuffer;
+    std::string lastError;
+};
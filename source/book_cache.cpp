@@ -0,0 +1,419 @@
+#include "book_cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+#include "file_util.h"
+
+using namespace std;
+
+namespace {
+
+// Bump whenever the file layout, the text extractor or line breaking changes
+// what ends up in a cache file, so stale copies are rebuilt.
+const uint32_t cacheVersion = 4;
+const char cacheMagic[8] = { 'E', 'R', 'C', 'A', 'C', 'H', 'E', '\0' };
+const char cacheExtension[] = ".bin";
+
+const uint32_t maxChapters = 65536;
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t lineWidth;
+    uint64_t epubSize;
+    uint64_t epubMtime;
+    uint64_t lastUsed;   // time of the last open, for eviction
+    uint32_t chapterCount;
+    uint32_t pathLength;
+    uint32_t spineBytes; // each name is a uint16_t length, the bytes and a uint16_t part number
+    uint32_t indexOffset; // search index blob, 0 until one has been written
+    uint32_t indexLength;
+    uint32_t contentsOffset; // table of contents blob, 0 if the book has none
+    uint32_t contentsLength;
+};
+
+// FNV-1a; the full path is stored in the file as well, so collisions only cost a rebuild.
+string cacheFileName(const string& epubPath) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < epubPath.size(); i++) {
+        hash ^= (unsigned char)epubPath[i];
+        hash *= 1099511628211ULL;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx%s", (unsigned long long)hash, cacheExtension);
+    return name;
+}
+
+bool endsWith(const char* name, const char* suffix) {
+    size_t nameLength = strlen(name);
+    size_t suffixLength = strlen(suffix);
+    return nameLength >= suffixLength && strcmp(name + nameLength - suffixLength, suffix) == 0;
+}
+
+uint64_t alignUp4(uint64_t offset) {
+    return (offset + 3) & ~(uint64_t)3;
+}
+
+}
+
+BookCache::BookCache()
+    : byteBudget(0), file(nullptr), bookSize(0), bookMtime(0), bookLineWidth(0), tableOffset(0), fileEnd(0),
+      indexOffset(0), indexLength(0), contentsOffset(0), contentsLength(0) {}
+
+BookCache::~BookCache() {
+    close();
+}
+
+void BookCache::configure(const string& cacheDirectory, uint64_t budget) {
+    directory = cacheDirectory;
+    byteBudget = budget;
+}
+
+bool BookCache::open(const string& epubPath, uint32_t lineWidth) {
+    close();
+    bookPath.clear();
+    if (!enabled()) return false;
+
+    struct stat info;
+    if (stat(epubPath.c_str(), &info) != 0) return false;
+
+    bookPath = epubPath;
+    bookSize = (uint64_t)info.st_size;
+    bookMtime = modificationTime(epubPath);
+    bookLineWidth = lineWidth;
+    cachePath = directory + "/" + cacheFileName(epubPath);
+
+    file = fopen(cachePath.c_str(), "r+b");
+    if (!file) return false;
+    if (!readHeader(epubPath, lineWidth)) {
+        close();
+        return false;
+    }
+
+    // Record the open so eviction drops books that haven't been read in a while first.
+    uint64_t now = (uint64_t)time(nullptr);
+    if (fseek(file, offsetof(FileHeader, lastUsed), SEEK_SET) == 0) {
+        fwrite(&now, sizeof(now), 1, file);
+        fflush(file);
+    }
+    return true;
+}
+
+bool BookCache::readHeader(const string& epubPath, uint32_t lineWidth) {
+    if (fseek(file, 0, SEEK_END) != 0) return false;
+    long fileSize = ftell(file);
+    if (fileSize < (long)sizeof(FileHeader) || (unsigned long)fileSize > UINT32_MAX) return false;
+    rewind(file);
+
+    FileHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1) return false;
+    if (memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0 || header.version != cacheVersion) return false;
+    if (header.lineWidth != lineWidth || header.epubSize != bookSize || header.epubMtime != bookMtime) return false;
+    if (header.pathLength != epubPath.size() || header.chapterCount == 0 || header.chapterCount > maxChapters) return false;
+
+    uint64_t table = (uint64_t)sizeof(header) + header.pathLength + header.spineBytes;
+    if (table + (uint64_t)header.chapterCount * sizeof(ChapterRecord) > (uint64_t)fileSize) return false;
+
+    vector<char> names(header.pathLength + header.spineBytes);
+    if (!names.empty() && fread(names.data(), 1, names.size(), file) != names.size()) return false;
+    if (memcmp(names.data(), epubPath.data(), epubPath.size()) != 0) return false;
+
+    spineNames.clear();
+    partNumbers.clear();
+    size_t pos = header.pathLength;
+    while (spineNames.size() < header.chapterCount) {
+        uint16_t length;
+        uint16_t part;
+        if (pos + sizeof(length) > names.size()) return false;
+        memcpy(&length, &names[pos], sizeof(length));
+        pos += sizeof(length);
+        if (pos + length + sizeof(part) > names.size()) return false;
+        spineNames.push_back(string(&names[pos], length));
+        pos += length;
+        memcpy(&part, &names[pos], sizeof(part));
+        partNumbers.push_back(part);
+        pos += sizeof(part);
+    }
+
+    records.resize(header.chapterCount);
+    if (fread(records.data(), sizeof(ChapterRecord), records.size(), file) != records.size()) return false;
+
+    tableOffset = (uint32_t)table;
+    fileEnd = (uint32_t)fileSize;
+    uint32_t dataStart = tableOffset + (uint32_t)(records.size() * sizeof(ChapterRecord));
+    for (size_t i = 0; i < records.size(); i++) {
+        // A record pointing past the end was written after its data went missing; decode it again.
+        ChapterRecord& record = records[i];
+        if (record.offset == 0) continue;
+        uint64_t end = alignUp4((uint64_t)record.offset + record.textLength) +
+                       ((uint64_t)record.lineCount + record.anchorCount) * sizeof(uint32_t);
+        if (record.offset < dataStart || end > fileEnd) memset(&record, 0, sizeof(record));
+    }
+
+    indexOffset = header.indexOffset;
+    indexLength = header.indexLength;
+    if (indexOffset < dataStart || (uint64_t)indexOffset + indexLength > fileEnd) {
+        indexOffset = 0;
+        indexLength = 0;
+    }
+    contentsOffset = header.contentsOffset;
+    contentsLength = header.contentsLength;
+    if (contentsOffset < dataStart || (uint64_t)contentsOffset + contentsLength > fileEnd) {
+        contentsOffset = 0;
+        contentsLength = 0;
+    }
+    return true;
+}
+
+bool BookCache::create(const vector<string>& spine, const vector<uint16_t>& parts) {
+    close();
+    if (!enabled() || bookPath.empty() || spine.empty() || spine.size() > maxChapters || parts.size() != spine.size()) {
+        return false;
+    }
+
+    if (mkdir(directory.c_str(), 0777) != 0 && errno != EEXIST) return false;
+    trim();
+
+    FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+    header.version = cacheVersion;
+    header.lineWidth = bookLineWidth;
+    header.epubSize = bookSize;
+    header.epubMtime = bookMtime;
+    header.lastUsed = (uint64_t)time(nullptr);
+    header.chapterCount = (uint32_t)spine.size();
+    header.pathLength = (uint32_t)bookPath.size();
+
+    string names = bookPath;
+    for (size_t i = 0; i < spine.size(); i++) {
+        if (spine[i].size() > 0xFFFF) return false;
+        uint16_t length = (uint16_t)spine[i].size();
+        names.append((const char*)&length, sizeof(length));
+        names += spine[i];
+        names.append((const char*)&parts[i], sizeof(parts[i]));
+    }
+    header.spineBytes = (uint32_t)(names.size() - bookPath.size());
+
+    file = fopen(cachePath.c_str(), "w+b");
+    if (!file) return false;
+
+    records.assign(spine.size(), ChapterRecord());
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(names.data(), 1, names.size(), file) == names.size() &&
+              fwrite(records.data(), sizeof(ChapterRecord), records.size(), file) == records.size() &&
+              fflush(file) == 0;
+    if (!ok) {
+        close();
+        remove(cachePath.c_str());
+        return false;
+    }
+
+    spineNames = spine;
+    partNumbers = parts;
+    indexOffset = 0;
+    indexLength = 0;
+    contentsOffset = 0;
+    contentsLength = 0;
+    tableOffset = (uint32_t)(sizeof(header) + names.size());
+    fileEnd = tableOffset + (uint32_t)(records.size() * sizeof(ChapterRecord));
+    return true;
+}
+
+void BookCache::close() {
+    if (file) {
+        fclose(file);
+        file = nullptr;
+    }
+    spineNames.clear();
+    partNumbers.clear();
+    records.clear();
+}
+
+bool BookCache::hasChapter(size_t spineIndex) const {
+    return file && spineIndex < records.size() && records[spineIndex].offset != 0;
+}
+
+bool BookCache::readChapter(size_t spineIndex, string& text, vector<uint32_t>& lineStarts, vector<uint32_t>& anchors) {
+    if (!hasChapter(spineIndex)) return false;
+
+    const ChapterRecord& record = records[spineIndex];
+    text.resize(record.textLength);
+    lineStarts.resize(record.lineCount);
+    anchors.resize(record.anchorCount);
+
+    bool ok = fseek(file, record.offset, SEEK_SET) == 0 &&
+              (text.empty() || fread(&text[0], 1, text.size(), file) == text.size());
+    if (ok && (!lineStarts.empty() || !anchors.empty())) {
+        // The anchors follow the line starts directly.
+        ok = fseek(file, (long)alignUp4(record.offset + record.textLength), SEEK_SET) == 0 &&
+             fread(lineStarts.data(), sizeof(uint32_t), lineStarts.size(), file) == lineStarts.size() &&
+             fread(anchors.data(), sizeof(uint32_t), anchors.size(), file) == anchors.size();
+    }
+    for (size_t i = 0; ok && i < lineStarts.size(); i++) {
+        if (lineStarts[i] >= record.textLength || (i > 0 && lineStarts[i] <= lineStarts[i - 1])) ok = false;
+    }
+    for (size_t i = 0; ok && i < anchors.size(); i++) {
+        if (anchors[i] > record.textLength) ok = false;
+    }
+
+    if (!ok) {
+        text.clear();
+        lineStarts.clear();
+        anchors.clear();
+        memset(&records[spineIndex], 0, sizeof(ChapterRecord));
+    }
+    return ok;
+}
+
+bool BookCache::writeChapter(size_t spineIndex, const string& text, const vector<uint32_t>& lineStarts,
+                             const vector<uint32_t>& anchors) {
+    if (!file || spineIndex >= records.size() || records[spineIndex].offset != 0) return false;
+
+    uint64_t linesOffset = alignUp4((uint64_t)fileEnd + text.size());
+    uint64_t end = linesOffset + ((uint64_t)lineStarts.size() + anchors.size()) * sizeof(uint32_t);
+    if (text.size() > UINT32_MAX || end > UINT32_MAX) return false;
+
+    static const char padding[4] = { 0, 0, 0, 0 };
+    size_t paddingLength = (size_t)(linesOffset - fileEnd - text.size());
+
+    ChapterRecord record;
+    record.offset = fileEnd;
+    record.textLength = (uint32_t)text.size();
+    record.lineCount = (uint32_t)lineStarts.size();
+    record.anchorCount = (uint32_t)anchors.size();
+
+    // Data first, table record last: an interrupted write leaves the chapter uncached, not corrupt.
+    bool ok = fseek(file, fileEnd, SEEK_SET) == 0 &&
+              fwrite(text.data(), 1, text.size(), file) == text.size() &&
+              fwrite(padding, 1, paddingLength, file) == paddingLength &&
+              fwrite(lineStarts.data(), sizeof(uint32_t), lineStarts.size(), file) == lineStarts.size() &&
+              fwrite(anchors.data(), sizeof(uint32_t), anchors.size(), file) == anchors.size() &&
+              fflush(file) == 0 &&
+              fseek(file, tableOffset + spineIndex * sizeof(ChapterRecord), SEEK_SET) == 0 &&
+              fwrite(&record, sizeof(record), 1, file) == 1 &&
+              fflush(file) == 0;
+    if (!ok) {
+        // Stop writing after an error; whatever was already written stays valid.
+        close();
+        return false;
+    }
+
+    records[spineIndex] = record;
+    fileEnd = (uint32_t)end;
+    return true;
+}
+
+bool BookCache::readSearchIndex(vector<uint8_t>& data) {
+    return readBlob(indexOffset, indexLength, data);
+}
+
+bool BookCache::writeSearchIndex(const vector<uint8_t>& data) {
+    return indexOffset == 0 && writeBlob(offsetof(FileHeader, indexOffset), data, indexOffset, indexLength);
+}
+
+bool BookCache::readContents(vector<uint8_t>& data) {
+    return readBlob(contentsOffset, contentsLength, data);
+}
+
+bool BookCache::writeContents(const vector<uint8_t>& data) {
+    return contentsOffset == 0 && writeBlob(offsetof(FileHeader, contentsOffset), data, contentsOffset, contentsLength);
+}
+
+bool BookCache::readBlob(uint32_t& offset, uint32_t length, vector<uint8_t>& data) {
+    if (!file || offset == 0) return false;
+
+    data.resize(length);
+    bool ok = fseek(file, offset, SEEK_SET) == 0 &&
+              (data.empty() || fread(data.data(), 1, data.size(), file) == data.size());
+    if (!ok) {
+        data.clear();
+        offset = 0;
+    }
+    return ok;
+}
+
+// headerField is the offset of the blob's offset/length pair in the header.
+bool BookCache::writeBlob(size_t headerField, const vector<uint8_t>& data, uint32_t& offset, uint32_t& length) {
+    if (!file) return false;
+
+    uint64_t start = alignUp4(fileEnd);
+    if (start + data.size() > UINT32_MAX) return false;
+
+    static const char padding[4] = { 0, 0, 0, 0 };
+    size_t paddingLength = (size_t)(start - fileEnd);
+    uint32_t location[2] = { (uint32_t)start, (uint32_t)data.size() };
+
+    // Same order as chapters: the blob first, then the header fields pointing at it.
+    bool ok = fseek(file, fileEnd, SEEK_SET) == 0 &&
+              fwrite(padding, 1, paddingLength, file) == paddingLength &&
+              fwrite(data.data(), 1, data.size(), file) == data.size() &&
+              fflush(file) == 0 &&
+              fseek(file, (long)headerField, SEEK_SET) == 0 &&
+              fwrite(location, sizeof(location), 1, file) == 1 &&
+              fflush(file) == 0;
+    if (!ok) {
+        close();
+        return false;
+    }
+
+    offset = location[0];
+    length = location[1];
+    fileEnd = (uint32_t)(start + data.size());
+    return true;
+}
+
+void BookCache::trim() {
+    if (!enabled()) return;
+    DIR* dir = opendir(directory.c_str());
+    if (!dir) return;
+
+    struct CacheFile {
+        string path;
+        uint64_t size;
+        uint64_t lastUsed;
+    };
+    vector<CacheFile> files;
+    uint64_t totalSize = 0;
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (!endsWith(entry->d_name, cacheExtension)) continue;
+
+        CacheFile cached;
+        cached.path = directory + "/" + entry->d_name;
+        struct stat info;
+        if (stat(cached.path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) continue;
+        cached.size = (uint64_t)info.st_size;
+
+        // Files from an older version or cut short have no usable timestamp and go first.
+        cached.lastUsed = 0;
+        FILE* in = fopen(cached.path.c_str(), "rb");
+        if (in) {
+            FileHeader header;
+            if (fread(&header, sizeof(header), 1, in) == 1 && memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) == 0 &&
+                header.version == cacheVersion) {
+                cached.lastUsed = header.lastUsed;
+            }
+            fclose(in);
+        }
+
+        totalSize += cached.size;
+        files.push_back(cached);
+    }
+    closedir(dir);
+
+    sort(files.begin(), files.end(), [](const CacheFile& a, const CacheFile& b) {
+        return a.lastUsed < b.lastUsed;
+    });
+    for (size_t i = 0; i < files.size() && totalSize > byteBudget; i++) {
+        if (file && files[i].path == cachePath) continue;
+        if (remove(files[i].path.c_str()) == 0) totalSize -= files[i].size;
+    }
+}
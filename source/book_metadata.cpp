@@ -0,0 +1,136 @@
+#include "book_metadata.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <fstream>
+
+#include "epub_book.h"
+#include "file_util.h"
+
+using namespace std;
+
+namespace {
+
+const char* metadataHeader = "ereader-metadata 1";
+const char* metadataEnd = "end";
+
+// Tabs and newlines separate fields and records.
+string field(const string& value) {
+    string result = value;
+    replace(result.begin(), result.end(), '\t', ' ');
+    replace(result.begin(), result.end(), '\n', ' ');
+    replace(result.begin(), result.end(), '\r', ' ');
+    return result;
+}
+
+bool fileIdentity(const string& path, uint64_t& size, uint64_t& mtime) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) return false;
+    size = (uint64_t)info.st_size;
+    mtime = modificationTime(path);
+    return true;
+}
+
+}
+
+BookMetadataCache::BookMetadataCache() : dirty(false) {}
+
+// "<size>\t<mtime>\t<path>\t<title>\t<author>" per book, between a header
+// line and "end" so a file cut short is ignored.
+bool BookMetadataCache::load(const char* path) {
+    entries.clear();
+    dirty = false;
+
+    ifstream file(path);
+    string line;
+    if (!file.is_open() || !getline(file, line) || line != metadataHeader) return false;
+
+    bool complete = false;
+    while (getline(file, line)) {
+        if (line == metadataEnd) {
+            complete = true;
+            break;
+        }
+        size_t tabs[4];
+        size_t from = 0;
+        size_t found = 0;
+        for (; found < 4; found++) {
+            tabs[found] = line.find('\t', from);
+            if (tabs[found] == string::npos) break;
+            from = tabs[found] + 1;
+        }
+        if (found != 4) break;
+
+        Entry entry;
+        entry.size = strtoull(line.c_str(), nullptr, 10);
+        entry.mtime = strtoull(line.c_str() + tabs[0] + 1, nullptr, 10);
+        entry.checked = false;
+        entry.metadata.title = line.substr(tabs[2] + 1, tabs[3] - tabs[2] - 1);
+        entry.metadata.author = line.substr(tabs[3] + 1);
+        entries[line.substr(tabs[1] + 1, tabs[2] - tabs[1] - 1)] = entry;
+    }
+
+    if (!complete) entries.clear();
+    return complete;
+}
+
+bool BookMetadataCache::save(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) return false;
+
+    fprintf(file, "%s\n", metadataHeader);
+    for (const auto& entry : entries) {
+        // Such a path can't be saved; the book is just read again next session.
+        if (entry.first.find_first_of("\t\n") != string::npos) continue;
+        fprintf(file, "%llu\t%llu\t%s\t%s\t%s\n", (unsigned long long)entry.second.size,
+                (unsigned long long)entry.second.mtime, entry.first.c_str(),
+                field(entry.second.metadata.title).c_str(), field(entry.second.metadata.author).c_str());
+    }
+    fprintf(file, "%s\n", metadataEnd);
+
+    bool ok = !ferror(file);
+    ok = fclose(file) == 0 && ok;
+    if (ok) dirty = false;
+    return ok;
+}
+
+const BookMetadata* BookMetadataCache::find(const string& bookPath) {
+    map<string, Entry>::iterator it = entries.find(bookPath);
+    if (it == entries.end()) return nullptr;
+    if (it->second.checked) return &it->second.metadata;
+
+    uint64_t size = 0;
+    uint64_t mtime = 0;
+    if (!fileIdentity(bookPath, size, mtime) || size != it->second.size || mtime != it->second.mtime) return nullptr;
+    it->second.checked = true;
+    return &it->second.metadata;
+}
+
+const BookMetadata* BookMetadataCache::saved(const string& bookPath) const {
+    map<string, Entry>::const_iterator it = entries.find(bookPath);
+    return it == entries.end() ? nullptr : &it->second.metadata;
+}
+
+bool BookMetadataCache::checked(const string& bookPath) const {
+    map<string, Entry>::const_iterator it = entries.find(bookPath);
+    return it != entries.end() && it->second.checked;
+}
+
+const BookMetadata& BookMetadataCache::read(const string& bookPath) {
+    Entry& entry = entries[bookPath];
+    entry.size = 0;
+    entry.mtime = 0;
+    entry.checked = true;
+    entry.metadata = BookMetadata();
+    dirty = true;
+
+    fileIdentity(bookPath, entry.size, entry.mtime);
+    EpubBook book(0, 1);
+    if (book.open(bookPath.c_str())) {
+        entry.metadata.title = book.title();
+        entry.metadata.author = book.author();
+    }
+    return entry.metadata;
+}
@@ -0,0 +1,207 @@
+#include "buffered_file.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "profile.h"
+
+#ifdef __3DS__
+#include <3ds.h>
+#else
+#include <sys/mman.h>
+#include <chrono>
+#endif
+
+using namespace std;
+
+namespace {
+
+const size_t cacheLine = 64;
+
+uint64_t microsecondsNow() {
+#ifdef __3DS__
+    return (uint64_t)(svcGetSystemTick() / (SYSCLOCK_ARM11 / 1000000.0));
+#else
+    return (uint64_t)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+}
+
+void FileReadStats::add(const FileReadStats& other) {
+    bytesRead += other.bytesRead;
+    bytesReread += other.bytesReread;
+    readCalls += other.readCalls;
+    seekCalls += other.seekCalls;
+    busyMicroseconds += other.busyMicroseconds;
+}
+
+double FileReadStats::megabytesPerSecond() const {
+    return busyMicroseconds == 0 ? 0.0 : (double)bytesRead / busyMicroseconds;
+}
+
+BufferedFile::BufferedFile(size_t bufferSize)
+    : capacity(max((size_t)blockSize, bufferSize / blockSize * blockSize)), file(nullptr),
+#ifndef __3DS__
+      mapped(nullptr),
+#endif
+      fileSize(0), filePosition(0), window(nullptr), windowStart(0), windowLength(0) {
+    memset(&readStats, 0, sizeof(readStats));
+}
+
+BufferedFile::~BufferedFile() {
+    close();
+}
+
+bool BufferedFile::open(const char* path) {
+    close();
+    memset(&readStats, 0, sizeof(readStats));
+
+    file = fopen(path, "rb");
+    if (!file) return false;
+    // Every read below is already large; stdio's own buffer would only add a copy.
+    setvbuf(file, nullptr, _IONBF, 0);
+
+    if (fseek(file, 0, SEEK_END) != 0) {
+        close();
+        return false;
+    }
+    long end = ftell(file);
+    if (end < 0) {
+        close();
+        return false;
+    }
+    fileSize = (uint64_t)end;
+    filePosition = fileSize;
+
+#ifndef __3DS__
+    if (fileSize > 0 && fileSize <= SIZE_MAX) {
+        void* map = mmap(nullptr, (size_t)fileSize, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (map != MAP_FAILED) {
+            mapped = (const unsigned char*)map;
+            return true;
+        }
+    }
+#endif
+
+    storage.resize(capacity + cacheLine);
+    uintptr_t address = (uintptr_t)storage.data();
+    window = storage.data() + (cacheLine - address % cacheLine) % cacheLine;
+    blocksRead.assign((size_t)((fileSize + blockSize - 1) / blockSize), false);
+    return true;
+}
+
+void BufferedFile::close() {
+#ifndef __3DS__
+    if (mapped) {
+        munmap((void*)mapped, (size_t)fileSize);
+        mapped = nullptr;
+    }
+#endif
+    if (file) {
+        fclose(file);
+        file = nullptr;
+    }
+    fileSize = 0;
+    filePosition = 0;
+    vector<unsigned char>().swap(storage);
+    window = nullptr;
+    windowStart = 0;
+    windowLength = 0;
+    vector<bool>().swap(blocksRead);
+}
+
+bool BufferedFile::read(uint64_t offset, void* buffer, size_t length) {
+    if (!file || offset > fileSize || length > fileSize - offset) return false;
+
+#ifndef __3DS__
+    if (mapped) {
+        memcpy(buffer, mapped + offset, length);
+        readStats.bytesRead += length;
+        return true;
+    }
+#endif
+
+    unsigned char* out = (unsigned char*)buffer;
+    while (length > 0) {
+        // Large reads go straight into the caller's memory in one call.
+        if (length >= capacity && !inWindow(offset)) return readStorage(offset, out, length);
+
+        size_t available = 0;
+        const unsigned char* data = peek(offset, length, available);
+        if (!data) return false;
+        memcpy(out, data, available);
+        out += available;
+        offset += available;
+        length -= available;
+    }
+    return true;
+}
+
+const unsigned char* BufferedFile::peek(uint64_t offset, size_t maxLength, size_t& available) {
+    available = 0;
+    if (!file || offset >= fileSize || maxLength == 0) return nullptr;
+
+#ifndef __3DS__
+    if (mapped) {
+        available = (size_t)min<uint64_t>(maxLength, fileSize - offset);
+        readStats.bytesRead += available;
+        return mapped + offset;
+    }
+#endif
+
+    if (!inWindow(offset) && !fill(offset)) return nullptr;
+    available = (size_t)min<uint64_t>(maxLength, windowStart + windowLength - offset);
+    return window + (offset - windowStart);
+}
+
+// Loads the buffer from the block holding offset on. If that block is new,
+// the read-ahead stops short of the first block that was already read, so
+// nothing is fetched twice just for being nearby.
+bool BufferedFile::fill(uint64_t offset) {
+    uint64_t start = offset / blockSize * blockSize;
+    size_t length = (size_t)min<uint64_t>(capacity, fileSize - start);
+
+    size_t firstBlock = (size_t)(start / blockSize);
+    if (!blocksRead[firstBlock]) {
+        size_t blocks = (length + blockSize - 1) / blockSize;
+        for (size_t i = 1; i < blocks; i++) {
+            if (blocksRead[firstBlock + i]) {
+                length = i * blockSize;
+                break;
+            }
+        }
+    }
+
+    windowLength = 0;
+    if (!readStorage(start, window, length)) return false;
+    windowStart = start;
+    windowLength = length;
+    return true;
+}
+
+bool BufferedFile::readStorage(uint64_t offset, void* buffer, size_t length) {
+    PROFILE_SCOPE(STAGE_SD_READ);
+    uint64_t start = microsecondsNow();
+
+    bool ok = true;
+    if (filePosition != offset) {
+        readStats.seekCalls++;
+        ok = fseek(file, (long)offset, SEEK_SET) == 0;
+    }
+    size_t read = ok ? fread(buffer, 1, length, file) : 0;
+    readStats.readCalls++;
+    readStats.bytesRead += read;
+    filePosition = ok ? offset + read : fileSize + 1;
+    PROFILE_COUNT(COUNTER_BYTES_READ, read);
+    PROFILE_COUNT(COUNTER_READ_CALLS, 1);
+
+    size_t lastBlock = (size_t)((offset + read + blockSize - 1) / blockSize);
+    for (size_t block = (size_t)(offset / blockSize); block < lastBlock; block++) {
+        if (blocksRead[block]) readStats.bytesReread += blockSize;
+        blocksRead[block] = true;
+    }
+
+    readStats.busyMicroseconds += microsecondsNow() - start;
+    return read == length;
+}
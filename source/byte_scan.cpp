@@ -0,0 +1,263 @@
+#include "byte_scan.h"
+
+#include <stdint.h>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define BYTE_SCAN_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define BYTE_SCAN_NEON
+#elif defined(__ARM_FEATURE_SIMD32)
+#include <arm_acle.h>
+#define BYTE_SCAN_ARMV6
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BYTE_SCAN_SWAR
+#endif
+
+#if defined(BYTE_SCAN_SSE2) || defined(BYTE_SCAN_NEON) || defined(BYTE_SCAN_ARMV6) || defined(BYTE_SCAN_SWAR)
+#define BYTE_SCAN_BLOCKS
+#endif
+
+using namespace std;
+
+namespace {
+
+bool isSpaceByte(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+// Each platform section below loads blockBytes input bytes into a Block and
+// turns it into a ScanMask with bitsPerByte bits per byte, lowest byte
+// first. A byte's bits are set if it may match; false positives are fine,
+// misses are not.
+#if defined(BYTE_SCAN_SSE2)
+
+typedef __m128i Block;
+typedef uint32_t ScanMask;
+const size_t blockBytes = 16;
+const size_t blockAlignment = 1; // unaligned loads are fine
+const unsigned bitsPerByte = 1;
+const char* kernelName = "SSE2";
+
+Block load(const char* p) {
+    return _mm_loadu_si128((const __m128i*)p);
+}
+
+ScanMask equalTo(Block b, char c) {
+    return (ScanMask)_mm_movemask_epi8(_mm_cmpeq_epi8(b, _mm_set1_epi8(c)));
+}
+
+ScanMask atMost(Block b, unsigned char limit) {
+    return (ScanMask)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(b, _mm_set1_epi8((char)limit)), b));
+}
+
+ScanMask highBitSet(Block b) {
+    return (ScanMask)_mm_movemask_epi8(b);
+}
+
+#elif defined(BYTE_SCAN_NEON)
+
+typedef uint8x16_t Block;
+typedef uint64_t ScanMask;
+const size_t blockBytes = 16;
+const size_t blockAlignment = 1;
+const unsigned bitsPerByte = 4;
+const char* kernelName = "NEON";
+
+Block load(const char* p) {
+    return vld1q_u8((const uint8_t*)p);
+}
+
+// Narrows a byte-wide 0x00/0xFF mask to a nibble per byte.
+ScanMask toMask(uint8x16_t matches) {
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+}
+
+ScanMask equalTo(Block b, char c) {
+    return toMask(vceqq_u8(b, vdupq_n_u8((uint8_t)c)));
+}
+
+ScanMask atMost(Block b, unsigned char limit) {
+    return toMask(vcleq_u8(b, vdupq_n_u8(limit)));
+}
+
+ScanMask highBitSet(Block b) {
+    return toMask(vcgeq_u8(b, vdupq_n_u8(0x80)));
+}
+
+#elif defined(BYTE_SCAN_ARMV6) || defined(BYTE_SCAN_SWAR)
+
+typedef uint32_t Block;
+typedef uint32_t ScanMask;
+const size_t blockBytes = 4;
+const size_t blockAlignment = 4; // aligned word loads, so the head is scanned bytewise
+const unsigned bitsPerByte = 8;
+const uint32_t ones = 0x01010101;
+const uint32_t highBits = 0x80808080;
+
+Block load(const char* p) {
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+#if defined(BYTE_SCAN_ARMV6)
+const char* kernelName = "ARMv6 SIMD";
+
+// USUB8 sets a GE flag for every byte that did not borrow; SEL then picks
+// 0xFF for the others. Exact, byte by byte.
+ScanMask below(uint32_t word, unsigned char limit) {
+    __usub8(word, ones * limit);
+    return __sel(0, 0xFFFFFFFF);
+}
+
+ScanMask zeroBytes(uint32_t word) {
+    return below(word, 1);
+}
+#else
+const char* kernelName = "SWAR";
+
+// The classic bit tricks. A borrow out of a matching byte can flag the bytes
+// above it too, but never hides one, and the lowest flag is always real.
+ScanMask below(uint32_t word, unsigned char limit) {
+    return (word - ones * limit) & ~word & highBits;
+}
+
+ScanMask zeroBytes(uint32_t word) {
+    return (word - ones) & ~word & highBits;
+}
+#endif
+
+ScanMask equalTo(Block b, char c) {
+    return zeroBytes(b ^ (ones * (unsigned char)c));
+}
+
+ScanMask atMost(Block b, unsigned char limit) {
+    return below(b, limit + 1);
+}
+
+ScanMask highBitSet(Block b) {
+    return b & highBits;
+}
+
+#endif
+
+// The plain loop: what the scalar build uses for everything, and the word
+// kernels for spaces.
+template <typename Kernel>
+const char* scanBytes(const char* p, const char* end) {
+    for (; p < end; p++) {
+        if (Kernel::accept((unsigned char)*p)) return p;
+    }
+    return end;
+}
+
+#ifdef BYTE_SCAN_BLOCKS
+
+// NEON's masks are 64 bits wide, everyone else's 32.
+unsigned lowestSetBit(ScanMask mask) {
+    return sizeof(ScanMask) > sizeof(unsigned) ? __builtin_ctzll(mask) : __builtin_ctz((unsigned)mask);
+}
+
+// Scans bytewise up to the first aligned block, then a block at a time, and
+// the tail bytewise again; nothing is ever read past end.
+template <typename Kernel>
+const char* scan(const char* p, const char* end) {
+    while (p < end && ((uintptr_t)p & (blockAlignment - 1)) != 0) {
+        if (Kernel::accept((unsigned char)*p)) return p;
+        p++;
+    }
+    const ScanMask byteBits = (ScanMask)(((ScanMask)1 << bitsPerByte) - 1);
+    for (; end - p >= (ptrdiff_t)blockBytes; p += blockBytes) {
+        ScanMask mask = Kernel::mask(load(p));
+        while (mask != 0) {
+            size_t index = lowestSetBit(mask) / bitsPerByte;
+            if (Kernel::accept((unsigned char)p[index])) return p + index;
+            mask &= ~(byteBits << (index * bitsPerByte));
+        }
+    }
+    return scanBytes<Kernel>(p, end);
+}
+
+#else
+
+const char* kernelName = "scalar";
+
+template <typename Kernel>
+const char* scan(const char* p, const char* end) {
+    return scanBytes<Kernel>(p, end);
+}
+
+#endif
+
+struct AmpersandOrNonAscii {
+#ifdef BYTE_SCAN_BLOCKS
+    static ScanMask mask(Block b) { return equalTo(b, '&') | highBitSet(b); }
+#endif
+    static bool accept(unsigned char c) { return c == '&' || c >= 0x80; }
+};
+
+struct TagOpen {
+#ifdef BYTE_SCAN_BLOCKS
+    static ScanMask mask(Block b) { return equalTo(b, '<'); }
+#endif
+    static bool accept(unsigned char c) { return c == '<'; }
+};
+
+// Every whitespace byte is at most ' '; the rare control character that also
+// is gets turned away by accept().
+struct Space {
+#ifdef BYTE_SCAN_BLOCKS
+    static ScanMask mask(Block b) { return atMost(b, ' '); }
+#endif
+    static bool accept(unsigned char c) { return isSpaceByte(c); }
+};
+
+struct Newline {
+#ifdef BYTE_SCAN_BLOCKS
+    static ScanMask mask(Block b) { return equalTo(b, '\n'); }
+#endif
+    static bool accept(unsigned char c) { return c == '\n'; }
+};
+
+struct NonAscii {
+#ifdef BYTE_SCAN_BLOCKS
+    static ScanMask mask(Block b) { return highBitSet(b); }
+#endif
+    static bool accept(unsigned char c) { return c >= 0x80; }
+};
+
+}
+
+const char* findAmpersandOrNonAscii(const char* p, const char* end) {
+    return scan<AmpersandOrNonAscii>(p, end);
+}
+
+const char* findTagOpen(const char* p, const char* end) {
+    return scan<TagOpen>(p, end);
+}
+
+// Text has a space every few bytes, too often for a four-byte word to pay
+// for its setup: SWAR measured 0.9x the plain loop, and the ARMv6 kernel
+// has never been timed on a console, so both stay with the loop.
+const char* findSpace(const char* p, const char* end) {
+#if defined(BYTE_SCAN_ARMV6) || defined(BYTE_SCAN_SWAR)
+    return scanBytes<Space>(p, end);
+#else
+    return scan<Space>(p, end);
+#endif
+}
+
+const char* findNewline(const char* p, const char* end) {
+    return scan<Newline>(p, end);
+}
+
+const char* findNonAscii(const char* p, const char* end) {
+    return scan<NonAscii>(p, end);
+}
+
+const char* byteScanKernel() {
+    return kernelName;
+}
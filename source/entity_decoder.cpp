@@ -0,0 +1,336 @@
+#include "entity_decoder.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "byte_scan.h"
+#include "profile.h"
+
+using namespace std;
+
+namespace {
+
+struct NamedEntity {
+    const char* name;
+    uint32_t codepoint;
+    uint16_t second;
+    uint8_t legacy;
+};
+
+#include "html_entity_table.inc"
+
+const size_t namedEntityCount = sizeof(namedEntities) / sizeof(namedEntities[0]);
+const size_t maxEntityNameLength = 32;
+const size_t maxLegacyNameLength = 6;
+const size_t maxNumericDigits = 8;
+// Longest ASCII rendering of one reference (two code points of up to 4 chars each).
+const size_t maxReferenceOutput = 8;
+
+// ASCII renderings for U+00A0..U+017F (Latin-1 Supplement and Latin Extended-A).
+const char latinTable[][5] = {
+    " ", "!", "c", "L", "$", "Y", "|", "S", // U+00A0
+    "\"", "(c)", "a", "<<", "!", "", "(R)", "-", // U+00A8
+    "o", "+-", "2", "3", "'", "u", "P", ".", // U+00B0
+    ",", "1", "o", ">>", "1/4", "1/2", "3/4", "?", // U+00B8
+    "A", "A", "A", "A", "A", "A", "AE", "C", // U+00C0
+    "E", "E", "E", "E", "I", "I", "I", "I", // U+00C8
+    "D", "N", "O", "O", "O", "O", "O", "x", // U+00D0
+    "O", "U", "U", "U", "U", "Y", "Th", "ss", // U+00D8
+    "a", "a", "a", "a", "a", "a", "ae", "c", // U+00E0
+    "e", "e", "e", "e", "i", "i", "i", "i", // U+00E8
+    "d", "n", "o", "o", "o", "o", "o", "/", // U+00F0
+    "o", "u", "u", "u", "u", "y", "th", "y", // U+00F8
+    "A", "a", "A", "a", "A", "a", "C", "c", // U+0100
+    "C", "c", "C", "c", "C", "c", "D", "d", // U+0108
+    "D", "d", "E", "e", "E", "e", "E", "e", // U+0110
+    "E", "e", "E", "e", "G", "g", "G", "g", // U+0118
+    "G", "g", "G", "g", "H", "h", "H", "h", // U+0120
+    "I", "i", "I", "i", "I", "i", "I", "i", // U+0128
+    "I", "i", "IJ", "ij", "J", "j", "K", "k", // U+0130
+    "k", "L", "l", "L", "l", "L", "l", "L", // U+0138
+    "l", "L", "l", "N", "n", "N", "n", "N", // U+0140
+    "n", "'n", "N", "n", "O", "o", "O", "o", // U+0148
+    "O", "o", "OE", "oe", "R", "r", "R", "r", // U+0150
+    "R", "r", "S", "s", "S", "s", "S", "s", // U+0158
+    "S", "s", "T", "t", "T", "t", "T", "t", // U+0160
+    "U", "u", "U", "u", "U", "u", "U", "u", // U+0168
+    "U", "u", "U", "u", "W", "w", "Y", "y", // U+0170
+    "Y", "Z", "z", "Z", "z", "Z", "z", "s", // U+0178
+};
+
+// ASCII renderings for U+2000..U+206F (General Punctuation).
+const char punctuationTable[][5] = {
+    " ", " ", " ", " ", " ", " ", " ", " ", // U+2000
+    " ", " ", " ", "", "", "", "", "", // U+2008
+    "-", "-", "-", "-", "-", "-", "||", "_", // U+2010
+    "'", "'", "'", "'", "\"", "\"", "\"", "\"", // U+2018
+    "+", "+", "*", ">", ".", "..", "...", "-", // U+2020
+    "\n", "\n", "", "", "", "", "", " ", // U+2028
+    "%o", "%oo", "'", "\"", "'''", "`", "``", " ", // U+2030
+    " ", "<", ">", "*", "!!", "?!", " ", " ", // U+2038
+    " ", " ", " ", "-", "/", " ", " ", "??", // U+2040
+    "?!", "!?", " ", " ", " ", " ", "*", " ", // U+2048
+    " ", " ", "%", "~", " ", " ", " ", " ", // U+2050
+    " ", " ", " ", " ", " ", " ", " ", " ", // U+2058
+    "", "", "", "", "", "", "", "", // U+2060
+    "", "", "", "", "", "", "", "", // U+2068
+};
+
+struct Transliteration {
+    uint32_t codepoint;
+    char text[5];
+};
+
+// Everything else with a sensible ASCII form, sorted by code point.
+const Transliteration otherTable[] = {
+    {0x0192, "f"}, {0x02BC, "'"}, {0x02C6, "^"}, {0x02DC, "~"},
+    {0x20AC, "EUR"}, {0x2116, "No"}, {0x2122, "TM"},
+    {0x2153, "1/3"}, {0x2154, "2/3"}, {0x215B, "1/8"},
+    {0x2190, "<-"}, {0x2191, "^"}, {0x2192, "->"}, {0x2193, "v"}, {0x2194, "<->"},
+    {0x21D0, "<="}, {0x21D2, "=>"}, {0x21D4, "<=>"},
+    {0x2212, "-"}, {0x2215, "/"}, {0x2217, "*"}, {0x221E, "oo"},
+    {0x2248, "~"}, {0x2260, "!="}, {0x2264, "<="}, {0x2265, ">="},
+    {0x2E3A, "--"}, {0x2E3B, "---"}, {0x3000, " "},
+    {0xFB00, "ff"}, {0xFB01, "fi"}, {0xFB02, "fl"}, {0xFB03, "ffi"}, {0xFB04, "ffl"},
+    {0xFEFF, ""}, {0xFFFD, "?"},
+};
+
+// Numeric references in 0x80..0x9F mean Windows-1252 characters (HTML5 8.2.4.69).
+const uint16_t windows1252Table[32] = {
+    0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+    0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178,
+};
+
+bool isNameChar(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+bool isCombiningMark(uint32_t cp) {
+    return (cp >= 0x0300 && cp <= 0x036F) || (cp >= 0x20D0 && cp <= 0x20FF) || (cp >= 0xFE00 && cp <= 0xFE0F);
+}
+
+const NamedEntity* findEntity(const char* name, size_t length) {
+    size_t lo = 0, hi = namedEntityCount;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        const char* candidate = namedEntities[mid].name;
+        int cmp = strncmp(candidate, name, length);
+        if (cmp == 0 && candidate[length] != '\0') cmp = 1;
+        if (cmp == 0) return &namedEntities[mid];
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return nullptr;
+}
+
+// Length of a UTF-8 sequence from its lead byte, or 0 if the byte cannot start one.
+size_t utf8SequenceLength(unsigned char lead) {
+    if (lead >= 0xC2 && lead <= 0xDF) return 2;
+    if (lead >= 0xE0 && lead <= 0xEF) return 3;
+    if (lead >= 0xF0 && lead <= 0xF4) return 4;
+    return 0;
+}
+
+}
+
+size_t transliterate(uint32_t cp, char* out) {
+    const char* text;
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    }
+    if (cp >= 0xA0 && cp < 0x180) {
+        text = latinTable[cp - 0xA0];
+    }
+    else if (cp >= 0x2000 && cp < 0x2070) {
+        text = punctuationTable[cp - 0x2000];
+    }
+    else if (isCombiningMark(cp)) {
+        return 0;
+    }
+    else {
+        const Transliteration* end = otherTable + sizeof(otherTable) / sizeof(otherTable[0]);
+        const Transliteration* it = lower_bound(otherTable, end, cp,
+            [](const Transliteration& t, uint32_t value) { return t.codepoint < value; });
+        text = (it != end && it->codepoint == cp) ? it->text : " ";
+    }
+
+    size_t length = strlen(text);
+    memcpy(out, text, length);
+    return length;
+}
+
+EntityDecoder::EntityDecoder(bool preserveMarkup) : preserveMarkup(preserveMarkup), pendingLength(0) {}
+
+void EntityDecoder::decode(const char* in, size_t len, string& out) {
+    PROFILE_SCOPE(STAGE_ENTITIES);
+    size_t written = out.size();
+    out.resize(written + len + pendingLength + maxReferenceOutput);
+
+    if (pendingLength > 0) {
+        char joined[2 * maxPending];
+        size_t head = min(len, sizeof(joined) - pendingLength);
+        memcpy(joined, pending, pendingLength);
+        memcpy(joined + pendingLength, in, head);
+        size_t joinedLength = pendingLength + head;
+
+        size_t used = decodeRun(joined, joinedLength, out, written, false);
+        if (used < pendingLength) {
+            // Still not enough input to finish the held-back reference.
+            pendingLength = joinedLength - used;
+            memmove(pending, joined + used, pendingLength);
+            out.resize(written);
+            return;
+        }
+        in += used - pendingLength;
+        len -= used - pendingLength;
+        pendingLength = 0;
+    }
+
+    size_t used = decodeRun(in, len, out, written, false);
+    pendingLength = len - used;
+    memcpy(pending, in + used, pendingLength);
+    out.resize(written);
+}
+
+void EntityDecoder::finish(string& out) {
+    size_t written = out.size();
+    out.resize(written + pendingLength * maxReferenceOutput);
+    decodeRun(pending, pendingLength, out, written, true);
+    pendingLength = 0;
+    out.resize(written);
+}
+
+// Decodes as much of in[0, len) as possible into out starting at written.
+// Returns the number of input bytes consumed; unless final is set, a trailing
+// reference or UTF-8 sequence that might continue in the next chunk is left.
+size_t EntityDecoder::decodeRun(const char* in, size_t len, string& out, size_t& written, bool final) {
+    const unsigned char* p = (const unsigned char*)in;
+    const unsigned char* end = p + len;
+    char* w = &out[written];
+
+    while (p < end) {
+        // Plain ASCII is by far the common case; copy whole runs of it.
+        const unsigned char* run = p;
+        p = (const unsigned char*)findAmpersandOrNonAscii((const char*)p, (const char*)end);
+        if (p > run) {
+            memcpy(w, run, p - run);
+            w += p - run;
+            if (p == end) break;
+        }
+
+        // The slow paths below can expand, so keep room for the rest of the input.
+        size_t room = out.size() - (w - &out[0]);
+        if (room < (size_t)(end - p) + maxReferenceOutput) {
+            size_t used = w - &out[0];
+            out.resize(used + (end - p) + 4 * maxReferenceOutput);
+            w = &out[used];
+        }
+
+        const unsigned char* start = p;
+        if (*p == '&') {
+            p++;
+            uint32_t first = 0, second = 0;
+            bool matched = false;
+
+            if (p < end && *p == '#') {
+                p++;
+                bool hex = (p < end && (*p == 'x' || *p == 'X'));
+                if (hex) p++;
+                const unsigned char* digits = p;
+                uint32_t value = 0;
+                while (p < end && (size_t)(p - digits) <= maxNumericDigits) {
+                    unsigned char c = *p;
+                    if (c >= '0' && c <= '9') value = value * (hex ? 16 : 10) + (c - '0');
+                    else if (hex && (c | 0x20) >= 'a' && (c | 0x20) <= 'f') value = value * 16 + ((c | 0x20) - 'a' + 10);
+                    else break;
+                    p++;
+                }
+                if (p == end && !final && (size_t)(p - digits) <= maxNumericDigits) {
+                    p = start;
+                    break;
+                }
+                if (p > digits) {
+                    if (p < end && *p == ';') p++;
+                    if (value >= 0x80 && value <= 0x9F) value = windows1252Table[value - 0x80];
+                    if (value == 0 || value > 0x10FFFF || (value >= 0xD800 && value <= 0xDFFF)) value = 0xFFFD;
+                    first = value;
+                    matched = true;
+                }
+            }
+            else {
+                const unsigned char* name = p;
+                while (p < end && isNameChar(*p) && (size_t)(p - name) < maxEntityNameLength) p++;
+                size_t nameLength = p - name;
+                if (p == end && !final && nameLength < maxEntityNameLength) {
+                    p = start;
+                    break;
+                }
+
+                const NamedEntity* entity = nullptr;
+                if (nameLength > 0 && p < end && *p == ';') {
+                    entity = findEntity((const char*)name, nameLength);
+                    if (entity) p++;
+                }
+                // Legacy names such as "&nbsp" or "&copy" may appear without ';'
+                // and match as a prefix of the following letters.
+                for (size_t n = min(nameLength, maxLegacyNameLength); !entity && n >= 2; n--) {
+                    const NamedEntity* candidate = findEntity((const char*)name, n);
+                    if (candidate && candidate->legacy) {
+                        entity = candidate;
+                        p = name + n;
+                    }
+                }
+                if (entity) {
+                    first = entity->codepoint;
+                    second = entity->second;
+                    matched = true;
+                }
+            }
+
+            if (!matched) {
+                // Not a reference after all: keep the '&' and rescan what followed it.
+                *w++ = '&';
+                p = start + 1;
+                continue;
+            }
+            if (preserveMarkup && (first == '<' || first == '>' || first == '&')) {
+                memcpy(w, start, p - start);
+                w += p - start;
+                continue;
+            }
+            w += transliterate(first, w);
+            if (second) w += transliterate(second, w);
+        }
+        else {
+            size_t length = utf8SequenceLength(*p);
+            if (length > 0 && (size_t)(end - p) < length && !final) {
+                // Make sure what we have so far is valid before holding it back.
+                bool valid = true;
+                for (const unsigned char* c = p + 1; c < end; c++) valid = valid && (*c & 0xC0) == 0x80;
+                if (valid) break;
+            }
+
+            bool valid = length > 0 && (size_t)(end - p) >= length;
+            for (size_t i = 1; valid && i < length; i++) valid = (p[i] & 0xC0) == 0x80;
+            if (!valid) {
+                // Stray or truncated byte: blank it like any other unknown character.
+                *w++ = ' ';
+                p++;
+                continue;
+            }
+
+            uint32_t cp;
+            if (length == 2) cp = ((p[0] & 0x1F) << 6) | (p[1] & 0x3F);
+            else if (length == 3) cp = ((p[0] & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+            else cp = ((p[0] & 0x07) << 18) | ((p[1] & 0x3F) << 12) | ((p[2] & 0x3F) << 6) | (p[3] & 0x3F);
+            p += length;
+            w += transliterate(cp, w);
+        }
+    }
+
+    written = w - &out[0];
+    return (const char*)p - in;
+}
@@ -0,0 +1,942 @@
+#include "epub_book.h"
+
+#include <tinyxml2.h>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <mutex>
+
+#include "html_text.h"
+#include "profile.h"
+#include "text_layout.h"
+
+using namespace std;
+using namespace tinyxml2;
+
+namespace {
+
+// Extraction scratch grown past this by a large chapter is given back afterwards.
+const size_t scratchKeepBytes = 512 * 1024;
+const char* truncationNotice = "\n\n[The rest of this chapter is too large to load.]";
+// Chapter files with more XHTML than this are read as several spine entries
+// of about this much text each. Fixed, so a disk cache reads the same on
+// any console.
+const size_t chapterPartBytes = 1024 * 1024;
+// A requested chapter that hasn't come back from the loaders by then is
+// decoded on the UI thread instead.
+const unsigned requestTimeoutMs = 2000;
+
+// Deeper table of contents levels are folded into the last one; very long
+// tables are cut off.
+const size_t maxContentsDepth = 8;
+const size_t maxContentsEntries = 4096;
+const size_t maxContentsTitle = 200;
+
+// OPF files in the wild use both <item> and <opf:item>, so compare without the prefix.
+bool hasLocalName(const XMLElement* elem, const char* name) {
+    const char* tag = elem->Name();
+    const char* colon = strchr(tag, ':');
+    return strcmp(colon ? colon + 1 : tag, name) == 0;
+}
+
+const XMLElement* findChild(const XMLElement* parent, const char* name) {
+    for (const XMLElement* child = parent->FirstChildElement(); child; child = child->NextSiblingElement()) {
+        if (hasLocalName(child, name)) return child;
+    }
+    return nullptr;
+}
+
+int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Undoes %XX escapes up to the end of the string or the first stop character.
+string unescapeHref(const char* href, char stop) {
+    string decoded;
+    for (const char* p = href; *p && *p != stop; p++) {
+        if (*p == '%' && hexValue(p[1]) >= 0 && hexValue(p[2]) >= 0) {
+            decoded += (char)(hexValue(p[1]) * 16 + hexValue(p[2]));
+            p += 2;
+        } else {
+            decoded += *p;
+        }
+    }
+    return decoded;
+}
+
+// Resolves an OPF href against the OPF's directory into an archive path:
+// drops the fragment, undoes %XX escapes and collapses "." and "..".
+string resolveHref(const string& baseDir, const char* href) {
+    string decoded = unescapeHref(href, '#');
+
+    vector<string> parts;
+    string joined = baseDir + decoded;
+    size_t start = 0;
+    while (start <= joined.size()) {
+        size_t slash = joined.find('/', start);
+        if (slash == string::npos) slash = joined.size();
+        string part = joined.substr(start, slash - start);
+        if (part == "..") {
+            if (!parts.empty()) parts.pop_back();
+        } else if (!part.empty() && part != ".") {
+            parts.push_back(part);
+        }
+        start = slash + 1;
+    }
+
+    string path;
+    for (size_t i = 0; i < parts.size(); i++) {
+        if (i > 0) path += '/';
+        path += parts[i];
+    }
+    return path;
+}
+
+string directoryOf(const string& path) {
+    size_t lastSlash = path.find_last_of('/');
+    return (lastSlash == string::npos) ? "" : path.substr(0, lastSlash + 1);
+}
+
+// Whether a space-separated attribute value such as properties="nav svg" has token.
+bool hasToken(const char* list, const char* token) {
+    size_t length = strlen(token);
+    for (const char* p = list; *p;) {
+        while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+        const char* end = p;
+        while (*end && *end != ' ' && *end != '\t' && *end != '\n' && *end != '\r') end++;
+        if ((size_t)(end - p) == length && strncmp(p, token, length) == 0) return true;
+        p = end;
+    }
+    return false;
+}
+
+// All the text inside an element, such as a link label split up by <span>s.
+void appendElementText(const XMLNode* node, string& text) {
+    for (const XMLNode* child = node->FirstChild(); child; child = child->NextSibling()) {
+        if (child->ToText()) text += child->Value();
+        else if (child->ToElement()) appendElementText(child, text);
+    }
+}
+
+// A label as shown in the list: plain ASCII on one line, spaces squeezed.
+string cleanTitle(const string& raw) {
+    string decoded = decodeHtmlEntities(raw);
+    string title;
+    for (size_t i = 0; i < decoded.size() && title.size() < maxContentsTitle; i++) {
+        char c = decoded[i];
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            if (!title.empty() && title[title.size() - 1] != ' ') title += ' ';
+        } else {
+            title += c;
+        }
+    }
+    while (!title.empty() && title[title.size() - 1] == ' ') title.erase(title.size() - 1);
+    return title;
+}
+
+// The EPUB 3 navigation document's <nav epub:type="toc">, wherever it is in the body.
+const XMLElement* findTocNav(const XMLElement* root) {
+    vector<const XMLElement*> pending(1, root);
+    while (!pending.empty()) {
+        const XMLElement* elem = pending.back();
+        pending.pop_back();
+        if (hasLocalName(elem, "nav")) {
+            const char* type = elem->Attribute("epub:type");
+            if (type && hasToken(type, "toc")) return elem;
+        }
+        for (const XMLElement* child = elem->FirstChildElement(); child; child = child->NextSiblingElement()) {
+            pending.push_back(child);
+        }
+    }
+    return nullptr;
+}
+
+void appendUint16(vector<uint8_t>& data, uint16_t value) {
+    data.push_back((uint8_t)value);
+    data.push_back((uint8_t)(value >> 8));
+}
+
+void appendUint32(vector<uint8_t>& data, uint32_t value) {
+    appendUint16(data, (uint16_t)value);
+    appendUint16(data, (uint16_t)(value >> 16));
+}
+
+void appendString(vector<uint8_t>& data, const string& text) {
+    size_t length = min<size_t>(text.size(), 0xFFFF);
+    appendUint16(data, (uint16_t)length);
+    data.insert(data.end(), text.begin(), text.begin() + length);
+}
+
+bool readUint16(const vector<uint8_t>& data, size_t& pos, uint16_t& value) {
+    if (pos + 2 > data.size()) return false;
+    value = (uint16_t)(data[pos] | (data[pos + 1] << 8));
+    pos += 2;
+    return true;
+}
+
+bool readUint32(const vector<uint8_t>& data, size_t& pos, uint32_t& value) {
+    uint16_t low, high;
+    if (!readUint16(data, pos, low) || !readUint16(data, pos, high)) return false;
+    value = low | ((uint32_t)high << 16);
+    return true;
+}
+
+bool readString(const vector<uint8_t>& data, size_t& pos, string& text) {
+    uint16_t length;
+    if (!readUint16(data, pos, length) || pos + length > data.size()) return false;
+    text.assign((const char*)data.data() + pos, length);
+    pos += length;
+    return true;
+}
+
+}
+
+ChapterCache::ChapterCache(size_t byteBudget) : byteBudget(byteBudget), bytesUsed(0) {}
+
+shared_ptr<const Chapter> ChapterCache::get(size_t spineIndex) {
+    map<size_t, Slot>::iterator it = slots.find(spineIndex);
+    if (it == slots.end()) return shared_ptr<const Chapter>();
+
+    lru.splice(lru.begin(), lru, it->second.lruPos);
+    return it->second.chapter;
+}
+
+shared_ptr<const Chapter> ChapterCache::peek(size_t spineIndex) const {
+    map<size_t, Slot>::const_iterator it = slots.find(spineIndex);
+    return it != slots.end() ? it->second.chapter : shared_ptr<const Chapter>();
+}
+
+bool ChapterCache::contains(size_t spineIndex) const {
+    return slots.find(spineIndex) != slots.end();
+}
+
+void ChapterCache::put(size_t spineIndex, const shared_ptr<const Chapter>& chapter) {
+    map<size_t, Slot>::iterator it = slots.find(spineIndex);
+    if (it != slots.end()) {
+        bytesUsed -= it->second.chapter->memoryUsage();
+        lru.erase(it->second.lruPos);
+        slots.erase(it);
+    }
+
+    lru.push_front(spineIndex);
+    Slot slot = { chapter, lru.begin() };
+    slots[spineIndex] = slot;
+    bytesUsed += chapter->memoryUsage();
+    evict();
+}
+
+void ChapterCache::clear() {
+    lru.clear();
+    slots.clear();
+    bytesUsed = 0;
+}
+
+void ChapterCache::setBudget(size_t budget) {
+    byteBudget = budget;
+    evict();
+}
+
+void ChapterCache::evict() {
+    while (bytesUsed > byteBudget && lru.size() > 1) {
+        size_t victim = lru.back();
+        lru.pop_back();
+        map<size_t, Slot>::iterator it = slots.find(victim);
+        bytesUsed -= it->second.chapter->memoryUsage();
+        slots.erase(it);
+    }
+}
+
+EpubBook::EpubBook(size_t cacheBudget, size_t lineWidth)
+    : chapterCache(cacheBudget), decodedBudget(cacheBudget), packing(false), lineWidth(lineWidth), maxChapterText(SIZE_MAX), maxSearchTermBytes(SIZE_MAX),
+      chaptersLoaded(0), termsCount(0), termBytes(0), indexSkipped(false), indexing(false), indexBuilt(false), indexBuilding(false),
+      resultsPosted(0), stopRequested(false) {
+    memset(&loaderReadStats, 0, sizeof(loaderReadStats));
+}
+
+void EpubBook::setMemoryBudget(size_t bytes) {
+    maxChapterText = bytes / 8;
+    maxSearchTermBytes = bytes / 4;
+    textStore.setBudget(bytes / 4);
+}
+
+EpubBook::~EpubBook() {
+    close();
+}
+
+bool EpubBook::open(const char* path) {
+    close();
+    bookPath = path;
+    memset(&loaderReadStats, 0, sizeof(loaderReadStats));
+
+    if (diskCache.open(bookPath, (uint32_t)lineWidth)) {
+        spine = diskCache.spine();
+        spineParts = diskCache.spineParts();
+        vector<uint8_t> contentsData;
+        if (diskCache.hasContents() && diskCache.readContents(contentsData)) loadContents(contentsData);
+        prepareChapterState();
+
+        vector<uint8_t> indexData;
+        if (diskCache.hasSearchIndex() && diskCache.readSearchIndex(indexData)) searchIndex.load(indexData);
+        return true;
+    }
+
+    if (!zip.open(path)) {
+        lastError = zip.error();
+        return false;
+    }
+
+    if (!readSpine()) readFallbackChapterList();
+
+    if (spine.empty()) {
+        lastError = "No chapters (.xhtml or .html files) found in this EPUB.";
+        zip.close();
+        return false;
+    }
+
+    splitLargeChapters();
+    if (diskCache.create(spine, spineParts) && !tableOfContents.empty()) {
+        vector<uint8_t> contentsData;
+        saveContents(contentsData);
+        diskCache.writeContents(contentsData);
+    }
+    prepareChapterState();
+    return true;
+}
+
+void EpubBook::prepareChapterState() {
+    // Each chapter gets the sorted list of ids the contents link to in it;
+    // the extractor records where those land in the text.
+    anchorIds.assign(spine.size(), vector<string>());
+    for (const TocEntry& entry : tableOfContents) {
+        if (!entry.fragment.empty()) anchorIds[entry.spineIndex].push_back(entry.fragment);
+    }
+    for (vector<string>& ids : anchorIds) {
+        sort(ids.begin(), ids.end());
+        ids.erase(unique(ids.begin(), ids.end()), ids.end());
+    }
+    for (TocEntry& entry : tableOfContents) {
+        const vector<string>& ids = anchorIds[entry.spineIndex];
+        entry.anchor = entry.fragment.empty() ? SIZE_MAX
+                                              : lower_bound(ids.begin(), ids.end(), entry.fragment) - ids.begin();
+    }
+    anchorOffsets.assign(spine.size(), vector<uint32_t>());
+
+    measured.assign(spine.size(), false);
+    measuredLines.assign(spine.size(), vector<uint8_t>());
+    chapterTerms.assign(spine.size(), vector<uint8_t>());
+    termsReceived.assign(spine.size(), false);
+    termsCount = 0;
+    termBytes = 0;
+    indexSkipped = false;
+}
+
+void EpubBook::close() {
+    stopLoading();
+    if (diskCache.isOpen()) {
+        // Trim while the file is still open so the book just read is kept.
+        diskCache.trim();
+        diskCache.close();
+    }
+    zip.close();
+    spine.clear();
+    spineParts.clear();
+    bookTitle.clear();
+    bookAuthor.clear();
+    tableOfContents.clear();
+    anchorIds.clear();
+    anchorOffsets.clear();
+    chapterCache.clear();
+    chapterCache.setBudget(decodedBudget);
+    textStore.clear();
+    packing = false;
+    measured.clear();
+    measuredLines.clear();
+    chaptersLoaded = 0;
+    chapterTerms.clear();
+    termsReceived.clear();
+    termsCount = 0;
+    termBytes = 0;
+    indexSkipped = false;
+    searchIndex.clear();
+    extractor.releaseMemory();
+}
+
+// META-INF/container.xml names the OPF package; its <spine> lists manifest ids in reading order.
+bool EpubBook::readSpine() {
+    string content;
+    if (!zip.readEntry("META-INF/container.xml", content)) return false;
+
+    string opfPath;
+    {
+        XMLDocument container;
+        PROFILE_SCOPE(STAGE_XML);
+        if (container.Parse(content.c_str(), content.size()) != XML_SUCCESS) return false;
+        const XMLElement* root = container.RootElement();
+        const XMLElement* rootfiles = root ? findChild(root, "rootfiles") : nullptr;
+        const XMLElement* rootfile = rootfiles ? findChild(rootfiles, "rootfile") : nullptr;
+        const char* fullPath = rootfile ? rootfile->Attribute("full-path") : nullptr;
+        if (!fullPath) return false;
+        opfPath = fullPath;
+    }
+
+    if (!zip.readEntry(opfPath, content)) return false;
+
+    PROFILE_SCOPE(STAGE_XML);
+    XMLDocument opf;
+    if (opf.Parse(content.c_str(), content.size()) != XML_SUCCESS) return false;
+    const XMLElement* package = opf.RootElement();
+    readMetadata(package ? findChild(package, "metadata") : nullptr);
+
+    const XMLElement* manifest = package ? findChild(package, "manifest") : nullptr;
+    const XMLElement* spineElem = package ? findChild(package, "spine") : nullptr;
+    if (!manifest || !spineElem) return false;
+
+    string baseDir = directoryOf(opfPath);
+
+    // EPUB 3 marks its navigation document in the manifest; EPUB 2 names the
+    // NCX from the spine, or at least gives it the NCX media type.
+    map<string, string> hrefsById;
+    string navPath;
+    string ncxPath;
+    for (const XMLElement* item = manifest->FirstChildElement(); item; item = item->NextSiblingElement()) {
+        if (!hasLocalName(item, "item")) continue;
+        const char* id = item->Attribute("id");
+        const char* href = item->Attribute("href");
+        if (!id || !href) continue;
+        hrefsById[id] = resolveHref(baseDir, href);
+
+        const char* properties = item->Attribute("properties");
+        const char* mediaType = item->Attribute("media-type");
+        if (properties && hasToken(properties, "nav")) navPath = hrefsById[id];
+        if (mediaType && strcmp(mediaType, "application/x-dtbncx+xml") == 0) ncxPath = hrefsById[id];
+    }
+    const char* tocId = spineElem->Attribute("toc");
+    if (tocId && hrefsById.count(tocId)) ncxPath = hrefsById[tocId];
+
+    map<string, size_t> spineIndexOf;
+    for (const XMLElement* ref = spineElem->FirstChildElement(); ref; ref = ref->NextSiblingElement()) {
+        if (!hasLocalName(ref, "itemref")) continue;
+        const char* idref = ref->Attribute("idref");
+        if (!idref) continue;
+        map<string, string>::const_iterator it = hrefsById.find(idref);
+        if (it != hrefsById.end() && zip.find(it->second)) {
+            spineIndexOf.insert(make_pair(it->second, spine.size()));
+            spine.push_back(it->second);
+        }
+    }
+
+    // The nav document is preferred; books carrying both tend to keep the NCX for old readers.
+    if (!(!navPath.empty() && readNav(navPath, spineIndexOf)) && !ncxPath.empty()) readNcx(ncxPath, spineIndexOf);
+    return !spine.empty();
+}
+
+bool EpubBook::readNav(const string& path, const map<string, size_t>& spineIndexOf) {
+    string content;
+    if (!zip.readEntry(path, content)) return false;
+
+    PROFILE_SCOPE(STAGE_XML);
+    XMLDocument nav;
+    if (nav.Parse(content.c_str(), content.size()) != XML_SUCCESS || !nav.RootElement()) return false;
+    const XMLElement* toc = findTocNav(nav.RootElement());
+    const XMLElement* list = toc ? findChild(toc, "ol") : nullptr;
+    if (!list) return false;
+
+    tableOfContents.clear();
+    readNavList(list, 0, directoryOf(path), spineIndexOf);
+    return !tableOfContents.empty();
+}
+
+// <ol><li><a href="...">Label</a><ol>...</ol></li></ol>; an <li> may have a
+// <span> heading instead of a link, which is left out but its list is kept.
+void EpubBook::readNavList(const XMLElement* list, size_t depth, const string& baseDir,
+                           const map<string, size_t>& spineIndexOf) {
+    for (const XMLElement* item = list->FirstChildElement(); item; item = item->NextSiblingElement()) {
+        if (!hasLocalName(item, "li")) continue;
+        const XMLElement* link = findChild(item, "a");
+        const char* href = link ? link->Attribute("href") : nullptr;
+        if (href) {
+            string label;
+            appendElementText(link, label);
+            addContentsEntry(cleanTitle(label), depth, baseDir, href, spineIndexOf);
+        }
+
+        const XMLElement* children = findChild(item, "ol");
+        if (children) readNavList(children, min(depth + 1, maxContentsDepth - 1), baseDir, spineIndexOf);
+    }
+}
+
+bool EpubBook::readNcx(const string& path, const map<string, size_t>& spineIndexOf) {
+    string content;
+    if (!zip.readEntry(path, content)) return false;
+
+    PROFILE_SCOPE(STAGE_XML);
+    XMLDocument ncx;
+    if (ncx.Parse(content.c_str(), content.size()) != XML_SUCCESS || !ncx.RootElement()) return false;
+    const XMLElement* navMap = findChild(ncx.RootElement(), "navMap");
+    if (!navMap) return false;
+
+    tableOfContents.clear();
+    readNavPoints(navMap, 0, directoryOf(path), spineIndexOf);
+    return !tableOfContents.empty();
+}
+
+// <navPoint><navLabel><text>Label</text></navLabel><content src="..."/><navPoint>...</navPoint></navPoint>
+void EpubBook::readNavPoints(const XMLElement* parent, size_t depth, const string& baseDir,
+                             const map<string, size_t>& spineIndexOf) {
+    for (const XMLElement* point = parent->FirstChildElement(); point; point = point->NextSiblingElement()) {
+        if (!hasLocalName(point, "navPoint")) continue;
+        const XMLElement* navLabel = findChild(point, "navLabel");
+        const XMLElement* text = navLabel ? findChild(navLabel, "text") : nullptr;
+        const XMLElement* content = findChild(point, "content");
+        const char* src = content ? content->Attribute("src") : nullptr;
+        if (src) {
+            string label;
+            if (text) appendElementText(text, label);
+            addContentsEntry(cleanTitle(label), depth, baseDir, src, spineIndexOf);
+        }
+        readNavPoints(point, min(depth + 1, maxContentsDepth - 1), baseDir, spineIndexOf);
+    }
+}
+
+// Links to files outside the spine, such as the nav document itself, are dropped.
+void EpubBook::addContentsEntry(const string& title, size_t depth, const string& baseDir, const char* href,
+                                const map<string, size_t>& spineIndexOf) {
+    if (tableOfContents.size() >= maxContentsEntries) return;
+    map<string, size_t>::const_iterator it = spineIndexOf.find(resolveHref(baseDir, href));
+    if (it == spineIndexOf.end()) return;
+
+    const char* hash = strchr(href, '#');
+    TocEntry entry = { title, depth, it->second, hash ? unescapeHref(hash + 1, '\0') : string(), SIZE_MAX };
+    if (entry.title.empty()) entry.title = "(untitled)";
+    tableOfContents.push_back(entry);
+}
+
+// Entry count, then per entry its depth, spine index, title and fragment.
+void EpubBook::saveContents(vector<uint8_t>& data) const {
+    data.clear();
+    appendUint32(data, (uint32_t)tableOfContents.size());
+    for (const TocEntry& entry : tableOfContents) {
+        appendUint16(data, (uint16_t)entry.depth);
+        appendUint32(data, (uint32_t)entry.spineIndex);
+        appendString(data, entry.title);
+        appendString(data, entry.fragment);
+    }
+}
+
+bool EpubBook::loadContents(const vector<uint8_t>& data) {
+    tableOfContents.clear();
+    size_t pos = 0;
+    uint32_t count;
+    if (!readUint32(data, pos, count) || count > maxContentsEntries) return false;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint16_t depth;
+        uint32_t spineIndex;
+        TocEntry entry = { string(), 0, 0, string(), SIZE_MAX };
+        if (!readUint16(data, pos, depth) || !readUint32(data, pos, spineIndex) || !readString(data, pos, entry.title) ||
+            !readString(data, pos, entry.fragment) || spineIndex >= spine.size()) {
+            tableOfContents.clear();
+            return false;
+        }
+        entry.depth = min<size_t>(depth, maxContentsDepth - 1);
+        entry.spineIndex = spineIndex;
+        tableOfContents.push_back(entry);
+    }
+    return true;
+}
+
+FileReadStats EpubBook::readStats() const {
+    FileReadStats stats = loaderReadStats;
+    stats.add(zip.readStats());
+    return stats;
+}
+
+bool EpubBook::contentsOffset(size_t entry, size_t& offset) const {
+    const TocEntry& target = tableOfContents[entry];
+    if (target.anchor == SIZE_MAX) {
+        offset = 0;
+        return true;
+    }
+    const vector<uint32_t>& offsets = anchorOffsets[target.spineIndex];
+    if (!measured[target.spineIndex] || target.anchor >= offsets.size()) return false;
+    offset = offsets[target.anchor];
+    return true;
+}
+
+// The first dc:title and dc:creator, as plain ASCII like the chapter text.
+void EpubBook::readMetadata(const XMLElement* metadata) {
+    if (!metadata) return;
+    for (const XMLElement* elem = metadata->FirstChildElement(); elem; elem = elem->NextSiblingElement()) {
+        const char* text = elem->GetText();
+        if (!text) continue;
+        if (bookTitle.empty() && hasLocalName(elem, "title")) bookTitle = decodeHtmlEntities(text);
+        else if (bookAuthor.empty() && hasLocalName(elem, "creator")) bookAuthor = decodeHtmlEntities(text);
+    }
+}
+
+// Books without a usable OPF spine fall back to every (X)HTML file in name order.
+void EpubBook::readFallbackChapterList() {
+    spine.clear();
+    for (const auto& entry : zip.entries()) {
+        const char* name = entry.name.c_str();
+        if (strstr(name, ".xhtml") || strstr(name, ".html")) {
+            spine.push_back(entry.name);
+        }
+    }
+    sort(spine.begin(), spine.end());
+}
+
+// Each part of a split file is a spine entry of its own. The contents keep
+// pointing at the first part, so a link further into the file opens at the
+// end of that part.
+void EpubBook::splitLargeChapters() {
+    vector<string> files;
+    files.swap(spine);
+    vector<size_t> firstPart(files.size());
+    spineParts.clear();
+    for (size_t i = 0; i < files.size(); i++) {
+        const ZipEntry* entry = zip.find(files[i]);
+        size_t parts = entry ? max((size_t)1, (entry->uncompressedSize + chapterPartBytes - 1) / chapterPartBytes) : 1;
+        firstPart[i] = spine.size();
+        for (size_t part = 0; part < parts; part++) {
+            spine.push_back(files[i]);
+            spineParts.push_back((uint16_t)part);
+        }
+    }
+    for (TocEntry& entry : tableOfContents) entry.spineIndex = firstPart[entry.spineIndex];
+}
+
+// Runs on the UI thread or on a loader thread, so it leaves lastError alone.
+shared_ptr<const Chapter> EpubBook::loadChapter(size_t spineIndex, ZipIndex& archive, HtmlTextExtractor& extractor) {
+    shared_ptr<Chapter> loaded = make_shared<Chapter>();
+    {
+        lock_guard<Mutex> guard(diskCacheLock);
+        PROFILE_SCOPE(STAGE_DISK_CACHE);
+        if (diskCache.readChapter(spineIndex, loaded->text, loaded->lineStarts, loaded->anchors)) return loaded;
+    }
+
+    if (!archive.isOpen() && !archive.open(bookPath.c_str())) return loaded;
+
+    // Inflated bytes go straight into the extractor; the XHTML is never held
+    // whole. The extractor's buffer is reused from chapter to chapter, so
+    // the text only grows in place once and is then copied out at its exact
+    // size.
+    extractor.reset();
+    extractor.setOutputLimit(maxChapterText);
+    extractor.setAnchors(&anchorIds[spineIndex]);
+    // A part inflates its file up to the end of its own stretch of text and
+    // keeps only that; the file's last part takes whatever is left.
+    size_t part = spineParts[spineIndex];
+    bool lastPart = spineIndex + 1 == spine.size() || spineParts[spineIndex + 1] == 0;
+    extractor.setWindow(part * chapterPartBytes, lastPart ? SIZE_MAX : (part + 1) * chapterPartBytes);
+    bool ok = false;
+    {
+        PROFILE_SCOPE(STAGE_HTML);
+        const ZipEntry* entry = archive.find(spine[spineIndex]);
+        ok = entry && archive.streamEntry(*entry, [&](const char* data, size_t length) {
+            extractor.feed(data, length);
+            return !extractor.windowDone();
+        });
+        extractor.finish();
+    }
+    loaded->text.assign(extractor.text());
+    loaded->anchors = extractor.anchors();
+    bool truncated = extractor.truncated();
+    if (truncated) loaded->text += truncationNotice;
+    if (extractor.text().capacity() > scratchKeepBytes) extractor.releaseMemory();
+
+    {
+        PROFILE_SCOPE(STAGE_WRAP);
+        breakLines(loaded->text, lineWidth, loaded->lineStarts);
+        loaded->lineStarts.shrink_to_fit();
+    }
+
+    // A cut-off chapter is decoded again next time rather than kept short
+    // for good.
+    if (ok && !truncated) {
+        lock_guard<Mutex> guard(diskCacheLock);
+        PROFILE_SCOPE(STAGE_DISK_CACHE);
+        diskCache.writeChapter(spineIndex, loaded->text, loaded->lineStarts, loaded->anchors);
+    }
+    return loaded;
+}
+
+void EpubBook::received(LoadedChapter& loaded) {
+    if (!measured[loaded.spineIndex]) {
+        PROFILE_SCOPE(STAGE_WRAP);
+        measureLines(loaded.chapter->text, loaded.chapter->lineStarts, measuredLines[loaded.spineIndex]);
+        anchorOffsets[loaded.spineIndex] = loaded.chapter->anchors;
+        measured[loaded.spineIndex] = true;
+        chaptersLoaded++;
+    }
+
+    if (loaded.indexed && !termsReceived[loaded.spineIndex] && !indexSkipped) {
+        termBytes += loaded.searchTerms.size();
+        if (termBytes > maxSearchTermBytes) {
+            skipIndexing();
+        } else {
+            chapterTerms[loaded.spineIndex] = loaded.searchTerms;
+            termsReceived[loaded.spineIndex] = true;
+            if (++termsCount == spine.size() && loaders.threadCount() > 0) submitIndexBuild();
+        }
+    }
+
+    // Chapters decoded here on the UI thread weren't packed by a loader.
+    if (!textStore.contains(loaded.spineIndex) && !textStore.full()) {
+        if (!loaded.packed) loaded.packed = CompressedText::compress(loaded.chapter->text, loaded.compressed);
+        if (loaded.packed && textStore.put(loaded.spineIndex, loaded.compressed)) {
+            // Stored chapters come back with a quick unpack, so they needn't
+            // also be held decoded; the cache gives up what the store takes.
+            size_t stored = min(textStore.usedBytes(), decodedBudget - decodedBudget / 4);
+            chapterCache.setBudget(decodedBudget - stored);
+        }
+        packing = !textStore.full();
+    }
+
+    // Chapters from the spine pass only fill spare room, so they never push
+    // out the ones around the reading position; the store or the disk cache
+    // has them anyway.
+    if (loaded.requested || chapterCache.usedBytes() + loaded.chapter->memoryUsage() <= chapterCache.budget()) {
+        chapterCache.put(loaded.spineIndex, loaded.chapter);
+    }
+}
+
+bool EpubBook::takeResult(LoadedChapter& loaded) {
+    for (size_t i = 0; i < loaderSlots.size(); i++) {
+        if (loaderSlots[i]->results.pop(loaded)) {
+            received(loaded);
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t EpubBook::poll() {
+    size_t count = 0;
+    LoadedChapter loaded;
+    while (takeResult(loaded)) count++;
+
+    if (indexBuilt) {
+        indexBuilt = false;
+        searchIndex = std::move(*builtIndex);
+        builtIndex.reset();
+
+        vector<uint8_t> indexData;
+        searchIndex.save(indexData);
+        lock_guard<Mutex> guard(diskCacheLock);
+        PROFILE_SCOPE(STAGE_DISK_CACHE);
+        diskCache.writeSearchIndex(indexData);
+    }
+    return count;
+}
+
+// The index would not fit next to the book's text; search stays unavailable.
+void EpubBook::skipIndexing() {
+    indexing = false;
+    indexSkipped = true;
+    vector<vector<uint8_t>>().swap(chapterTerms);
+}
+
+// Merging every chapter's terms is the slow part; leave it to a worker.
+void EpubBook::submitIndexBuild() {
+    pendingIndexTerms.swap(chapterTerms);
+    chapterTerms.clear();
+    indexBuilding = true;
+    loaders.submit(bind(&EpubBook::buildSearchIndex, this));
+}
+
+void EpubBook::buildSearchIndex() {
+    PROFILE_SCOPE(STAGE_SEARCH_INDEX);
+    unique_ptr<SearchIndex> index(new SearchIndex());
+    index->build(pendingIndexTerms);
+    pendingIndexTerms.clear();
+    builtIndex.swap(index);
+    indexBuilt = true;
+    indexBuilding = false;
+}
+
+bool EpubBook::search(const string& query, vector<SearchHit>& hits, size_t maxHits, size_t snippetLead,
+                      size_t snippetLength) {
+    hits.clear();
+    vector<uint32_t> blocks;
+    if (!searchIndex.candidates(query, blocks)) return false;
+
+    vector<size_t> offsets;
+    shared_ptr<const Chapter> text;
+    size_t textIndex = spine.size();
+    for (size_t i = 0; i < blocks.size() && hits.size() < maxHits; i++) {
+        size_t spineIndex = blocks[i] >> 16;
+        size_t block = blocks[i] & 0xFFFF;
+        if (spineIndex >= spine.size()) continue;
+
+        // Candidates come in book order, so each chapter is fetched once and
+        // kept for the blocks after it.
+        if (spineIndex != textIndex) {
+            text = chapter(spineIndex);
+            textIndex = spineIndex;
+        }
+        size_t from = block * SearchIndex::blockSize;
+        size_t to = block == 0xFFFF ? text->text.size() : from + SearchIndex::blockSize;
+
+        offsets.clear();
+        SearchIndex::findMatches(text->text, query, from, to, offsets);
+        for (size_t j = 0; j < offsets.size() && hits.size() < maxHits; j++) {
+            hits.push_back(SearchHit());
+            SearchHit& hit = hits.back();
+            hit.spineIndex = spineIndex;
+            hit.offset = offsets[j];
+            hit.line = lineOfOffset(text->lineStarts, hit.offset);
+            size_t start = hit.offset > snippetLead ? hit.offset - snippetLead : 0;
+            hit.snippet = text->text.substr(start, snippetLength);
+            replace(hit.snippet.begin(), hit.snippet.end(), '\n', ' ');
+        }
+    }
+    return true;
+}
+
+shared_ptr<const Chapter> EpubBook::chapter(size_t spineIndex) {
+    shared_ptr<const Chapter> cached = chapterCache.get(spineIndex);
+    if (cached) return cached;
+
+    shared_ptr<Chapter> unpacked = make_shared<Chapter>();
+    if (textStore.get(spineIndex, unpacked->text)) {
+        PROFILE_SCOPE(STAGE_WRAP);
+        breakLines(unpacked->text, lineWidth, unpacked->lineStarts);
+        unpacked->lineStarts.shrink_to_fit();
+        chapterCache.put(spineIndex, unpacked);
+        return unpacked;
+    }
+
+    // Requests jump ahead of the spine pass; sleep until a loader hands in a
+    // result and check whether it is this one. The index merge can keep the
+    // only worker busy for seconds, and then the chapter is quicker decoded
+    // here; so is one that doesn't come back in time.
+    if (loaders.threadCount() > (indexBuilding ? 1 : 0)) {
+        loaders.submitUrgent(bind(&EpubBook::loadInBackground, this, spineIndex, true, placeholders::_1));
+        LoadedChapter loaded;
+        bool waiting = true;
+        while (waiting && !stopRequested) {
+            size_t seen = postedResults();
+            while (takeResult(loaded)) {
+                if (loaded.spineIndex == spineIndex) return loaded.chapter;
+            }
+            lock_guard<Mutex> guard(resultLock);
+            while (waiting && resultsPosted == seen && !stopRequested) {
+                waiting = resultPosted.wait(resultLock, requestTimeoutMs);
+            }
+        }
+    }
+
+    LoadedChapter loaded = { spineIndex, loadChapter(spineIndex, zip, extractor), true, false, vector<uint8_t>(),
+                             false, CompressedText() };
+    received(loaded);
+    return loaded.chapter;
+}
+
+void EpubBook::prefetchAround(size_t spineIndex) {
+    if (loaders.threadCount() > 0) {
+        for (size_t neighbour : { spineIndex + 1, spineIndex - 1 }) {
+            if (neighbour < spine.size() && !chapterCache.contains(neighbour)) {
+                loaders.submitUrgent(bind(&EpubBook::loadInBackground, this, neighbour, true, placeholders::_1));
+            }
+        }
+        return;
+    }
+
+    // Touch the current chapter last so it stays at the front of the LRU.
+    if (spineIndex + 1 < spine.size() && !chapterCache.contains(spineIndex + 1)) chapter(spineIndex + 1);
+    if (spineIndex > 0 && !chapterCache.contains(spineIndex - 1)) chapter(spineIndex - 1);
+    chapterCache.get(spineIndex);
+}
+
+bool EpubBook::startLoading(size_t firstChapter, size_t threadCount) {
+    stopLoading();
+    if (spine.empty() || threadCount == 0) return false;
+
+    loaderSlots.clear();
+    for (size_t i = 0; i < threadCount; i++) loaderSlots.push_back(unique_ptr<LoaderSlot>(new LoaderSlot()));
+    indexing = !searchIndex.ready();
+    packing = !textStore.full();
+    indexBuilt = false;
+    indexBuilding = false;
+    claimed.reset(new atomic<bool>[spine.size()]);
+    for (size_t i = 0; i < spine.size(); i++) claimed[i] = false;
+    stopRequested = false;
+
+    if (loaders.start(threadCount) == 0) {
+        loaderSlots.clear();
+        return false;
+    }
+
+    // Every chapter's terms may be in already, from a pass whose build was dropped.
+    if (indexing && termsCount == spine.size()) {
+        indexing = false;
+        submitIndexBuild();
+    }
+
+    if (firstChapter >= spine.size()) firstChapter = 0;
+    for (size_t i = 0; i < spine.size(); i++) {
+        size_t spineIndex = (firstChapter + i) % spine.size();
+        loaders.submit(bind(&EpubBook::loadInBackground, this, spineIndex, false, placeholders::_1));
+    }
+    return true;
+}
+
+void EpubBook::stopLoading() {
+    if (loaders.threadCount() == 0) return;
+    stopRequested = true;
+    loaders.stop();
+
+    // A build that never got to run hands its terms back for the next start.
+    if (indexBuilding) {
+        chapterTerms.swap(pendingIndexTerms);
+        pendingIndexTerms.clear();
+        indexBuilding = false;
+    }
+
+    // Keep whatever was finished.
+    poll();
+    for (size_t i = 0; i < loaderSlots.size(); i++) loaderReadStats.add(loaderSlots[i]->zip.readStats());
+    loaderSlots.clear();
+}
+
+size_t EpubBook::postedResults() {
+    lock_guard<Mutex> guard(resultLock);
+    return resultsPosted;
+}
+
+// Wakes the UI thread if it waits for a requested chapter, also when a
+// request is dropped, so it can stop waiting.
+void EpubBook::postResult() {
+    lock_guard<Mutex> guard(resultLock);
+    resultsPosted++;
+    resultPosted.broadcast();
+}
+
+void EpubBook::loadInBackground(size_t spineIndex, bool requested, size_t worker) {
+    if (stopRequested) {
+        if (requested) postResult();
+        return;
+    }
+    // The spine pass skips chapters already handed out; UI requests always run,
+    // since the cache may have dropped a chapter that was loaded before.
+    if (claimed[spineIndex].exchange(true) && !requested) return;
+
+    LoaderSlot& slot = *loaderSlots[worker];
+    bool index = indexing;
+    LoadedChapter loaded = { spineIndex, loadChapter(spineIndex, slot.zip, slot.extractor), requested, index,
+                             vector<uint8_t>(), false, CompressedText() };
+    if (index) {
+        PROFILE_SCOPE(STAGE_SEARCH_INDEX);
+        SearchIndex::encodeChapter(loaded.chapter->text, loaded.searchTerms);
+    }
+    if (packing) loaded.packed = CompressedText::compress(loaded.chapter->text, loaded.compressed);
+    while (!slot.results.push(loaded)) {
+        if (stopRequested) break;
+        sleepMilliseconds(1);
+    }
+    postResult();
+}
@@ -0,0 +1,22 @@
+#include "file_util.h"
+
+#include <sys/stat.h>
+
+#ifdef __3DS__
+#include <3ds.h>
+#endif
+
+using namespace std;
+
+uint64_t modificationTime(const string& path) {
+#ifdef __3DS__
+    // stat() leaves st_mtime at zero on the SD card; the FS archive has the real value.
+    u64 mtime = 0;
+    if (R_SUCCEEDED(sdmc_getmtime(path.c_str(), &mtime))) return mtime;
+    return 0;
+#else
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) return 0;
+    return (uint64_t)info.st_mtime;
+#endif
+}
@@ -0,0 +1,140 @@
+#include "glyph_atlas.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+#include "builtin_font.inc"
+
+const uint32_t noStandIn = 0;
+const uint32_t invisible = 0xFFFFFFFF;
+
+// U+00C0 to U+00FF with the accents taken off.
+const char latin1Letters[] = "AAAAAAACEEEEIIIIDNOOOOOxOUUUUYPsaaaaaaaceeeeiiiidnooooo/ouuuuypy";
+
+// What to draw for a code point the font doesn't have. Books are full of
+// typographic quotes and dashes, and ASCII shapes read fine for those.
+uint32_t asciiStandIn(uint32_t codepoint) {
+    switch (codepoint) {
+    case 0x00AD: // soft hyphen
+    case 0x200B: case 0x200C: case 0x200D: case 0x2060: case 0xFEFF:
+        return invisible;
+    case 0x00A0: case 0x2002: case 0x2003: case 0x2004: case 0x2005: case 0x2006:
+    case 0x2007: case 0x2008: case 0x2009: case 0x200A: case 0x202F:
+        return ' ';
+    case 0x2018: case 0x2019: case 0x201A: case 0x201B: case 0x2032:
+        return '\'';
+    case 0x00AB: case 0x00BB: case 0x201C: case 0x201D: case 0x201E: case 0x201F: case 0x2033:
+        return '"';
+    case 0x2010: case 0x2011: case 0x2012: case 0x2013: case 0x2014: case 0x2015: case 0x2212:
+        return '-';
+    case 0x00B7: case 0x2022: case 0x2026:
+        return '.';
+    case 0x2039: return '<';
+    case 0x203A: return '>';
+    case 0x00D7: return 'x';
+    }
+    if (codepoint >= 0xC0 && codepoint <= 0xFF) return (unsigned char)latin1Letters[codepoint - 0xC0];
+    return noStandIn;
+}
+
+uint16_t blend(uint16_t under, uint16_t over, unsigned alpha) {
+    unsigned r = ((over >> 11) * alpha + (under >> 11) * (255 - alpha)) / 255;
+    unsigned g = (((over >> 5) & 0x3F) * alpha + ((under >> 5) & 0x3F) * (255 - alpha)) / 255;
+    unsigned b = ((over & 0x1F) * alpha + (under & 0x1F) * (255 - alpha)) / 255;
+    return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+}
+
+BitmapFont builtinFont() {
+    BitmapFont font = { builtinFontBits, ' ', sizeof(builtinFontBits) / 8, 8, 8 };
+    return font;
+}
+
+GlyphAtlas::GlyphAtlas() : firstCodepoint(0), fallback(0), cell(0), height(0) {}
+
+void GlyphAtlas::build(const BitmapFont& font, bool proportional) {
+    glyphs.clear();
+    coverage.clear();
+    firstCodepoint = font.firstCodepoint;
+    cell = font.cellWidth;
+    height = font.cellHeight;
+
+    const uint8_t cellMask = (uint8_t)((1u << cell) - 1);
+    for (size_t i = 0; i < font.count; i++) {
+        const uint8_t* rows = font.bits + i * height;
+        uint8_t ink = 0;
+        for (int row = 0; row < height; row++) ink |= rows[row];
+        ink &= cellMask;
+
+        Glyph glyph = { (uint32_t)coverage.size(), 0, (uint8_t)cell, 0 };
+        if (ink != 0) {
+            int left = __builtin_ctz(ink);
+            int right = 31 - __builtin_clz(ink);
+            glyph.width = (uint8_t)(right - left + 1);
+            // One blank column between letters, and never wider than the cell.
+            glyph.advance = proportional ? (uint8_t)min(cell, glyph.width + 1) : (uint8_t)cell;
+            glyph.bearing = proportional ? 0 : (int8_t)left;
+            for (int column = left; column <= right; column++) {
+                for (int row = 0; row < height; row++) coverage.push_back((rows[row] >> column) & 1 ? 255 : 0);
+            }
+        }
+        else if (proportional) {
+            glyph.advance = (uint8_t)(cell / 2);
+        }
+        glyphs.push_back(glyph);
+    }
+
+    // Digits are centred in the widest one's advance.
+    if (proportional && firstCodepoint <= '0' && firstCodepoint + glyphs.size() > '9') {
+        uint8_t widest = 0;
+        for (uint32_t digit = '0'; digit <= '9'; digit++) widest = max(widest, glyphs[digit - firstCodepoint].advance);
+        for (uint32_t digit = '0'; digit <= '9'; digit++) {
+            Glyph& glyph = glyphs[digit - firstCodepoint];
+            glyph.bearing = (int8_t)((widest - glyph.advance) / 2);
+            glyph.advance = widest;
+        }
+    }
+
+    Glyph empty = { 0, 0, 0, 0 };
+    glyphs.push_back(empty);
+    fallback = ('?' >= firstCodepoint && '?' - firstCodepoint < font.count) ? '?' - firstCodepoint : glyphs.size() - 1;
+}
+
+size_t GlyphAtlas::indexOf(uint32_t codepoint) const {
+    size_t count = glyphs.size() - 1; // the last one is the empty glyph
+    if (codepoint - firstCodepoint < count) return codepoint - firstCodepoint;
+
+    uint32_t standIn = asciiStandIn(codepoint);
+    if (standIn == invisible) return count;
+    if (standIn != noStandIn && standIn - firstCodepoint < count) return standIn - firstCodepoint;
+    return fallback;
+}
+
+const Glyph& GlyphAtlas::glyph(uint32_t codepoint) const {
+    return glyphs[indexOf(codepoint)];
+}
+
+int GlyphAtlas::draw(const Surface& surface, int x, int top, uint32_t codepoint, uint16_t colour) const {
+    const Glyph& glyph = this->glyph(codepoint);
+    int firstRow = max(0, -top);
+    int endRow = min(height, surface.height - top);
+    if (glyph.width == 0 || firstRow >= endRow) return glyph.advance;
+
+    int left = x + glyph.bearing;
+    const uint8_t* column = coverage.data() + glyph.offset;
+    for (int c = 0; c < glyph.width; c++, column += height) {
+        int px = left + c;
+        if (px < 0 || px >= surface.width) continue;
+        uint16_t* pixel = surface.at(px, top + firstRow);
+        for (int row = firstRow; row < endRow; row++, pixel += surface.yStep) {
+            unsigned alpha = column[row];
+            if (alpha == 255) *pixel = colour;
+            else if (alpha != 0) *pixel = blend(*pixel, colour, alpha);
+        }
+    }
+    return glyph.advance;
+}
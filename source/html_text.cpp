@@ -0,0 +1,595 @@
+#include "html_text.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <stdint.h>
+
+#include "byte_scan.h"
+#include "entity_decoder.h"
+
+using namespace std;
+
+string toLower(const string& input) {
+    string output = input;
+    transform(output.begin(), output.end(), output.begin(), [](unsigned char c){ return tolower(c); });
+    return output;
+}
+
+std::string decodeHtmlEntities(const std::string& input, bool preserveMarkup) {
+    // The decoder sizes the output once for the whole input and only grows it
+    // for the rare transliteration that is longer than its source bytes.
+    std::string output;
+    EntityDecoder decoder(preserveMarkup);
+    decoder.decode(input.data(), input.size(), output);
+    decoder.finish(output);
+    return output;
+}
+
+namespace {
+
+bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+bool isTagNameChar(char c) {
+    return isalnum((unsigned char)c) || c == '-' || c == '_' || c == '.';
+}
+
+// How an element affects the flow of extracted text.
+enum TagKind {
+    TAG_INLINE = 0, // anything not in the table
+    TAG_BLOCK,      // starts and ends a line
+    TAG_SPACED,     // block with a blank line either side (headings, quotes)
+    TAG_LIST_ITEM,  // block that starts with a bullet
+    TAG_CELL,       // table cell, kept apart from its neighbours by a space
+    TAG_LINE_BREAK,
+    TAG_RULE,       // <hr>, drawn as a scene break
+    TAG_HEAD,
+    TAG_BODY,
+    TAG_RAW_TEXT    // <script>/<style>: contents are skipped unparsed
+};
+
+struct TagInfo {
+    const char* name;
+    uint8_t length;
+    TagKind kind;
+};
+
+// Perfect hash over the known tag names: no two of them share a slot, so a
+// lookup is one hash, one length check and one memcmp, with no allocation.
+const size_t tagTableSize = 134;
+
+constexpr unsigned tagHash(const char* name, size_t length) {
+    return ((unsigned char)name[0] * 23u + (unsigned char)name[length - 1] * 37u + length) % tagTableSize;
+}
+
+constexpr TagInfo tagTable[tagTableSize] = {
+    {"dl", 2, TAG_BLOCK}, // 0
+    {}, {}, {},
+    {"footer", 6, TAG_BLOCK}, // 4
+    {},
+    {"menu", 4, TAG_BLOCK}, // 6
+    {}, {}, {}, {}, {}, {}, {}, {},
+    {"main", 4, TAG_BLOCK}, // 15
+    {}, {},
+    {"pre", 3, TAG_BLOCK}, // 18
+    {}, {},
+    {"p", 1, TAG_BLOCK}, // 21
+    {"section", 7, TAG_BLOCK}, // 22
+    {}, {}, {},
+    {"legend", 6, TAG_BLOCK}, // 26
+    {"summary", 7, TAG_BLOCK}, // 27
+    {"dt", 2, TAG_BLOCK}, // 28
+    {},
+    {"h4", 2, TAG_SPACED}, // 30
+    {}, {}, {}, {},
+    {"body", 4, TAG_BODY}, // 35
+    {}, {}, {}, {}, {}, {},
+    {"br", 2, TAG_LINE_BREAK}, // 42
+    {}, {}, {},
+    {"hr", 2, TAG_RULE}, // 46
+    {},
+    {"tbody", 5, TAG_BLOCK}, // 48
+    {},
+    {"header", 6, TAG_BLOCK}, // 50
+    {}, {},
+    {"h1", 2, TAG_SPACED}, // 53
+    {"tr", 2, TAG_BLOCK}, // 54
+    {},
+    {"caption", 7, TAG_BLOCK}, // 56
+    {}, {},
+    {"figure", 6, TAG_BLOCK}, // 59
+    {},
+    {"address", 7, TAG_BLOCK}, // 61
+    {},
+    {"option", 6, TAG_BLOCK}, // 63
+    {},
+    {"nav", 3, TAG_BLOCK}, // 65
+    {"head", 4, TAG_HEAD}, // 66
+    {"h5", 2, TAG_SPACED}, // 67
+    {},
+    {"center", 6, TAG_BLOCK}, // 69
+    {}, {},
+    {"td", 2, TAG_CELL}, // 72
+    {"li", 2, TAG_LIST_ITEM}, // 73
+    {},
+    {"thead", 5, TAG_BLOCK}, // 75
+    {},
+    {"aside", 5, TAG_BLOCK}, // 77
+    {},
+    {"article", 7, TAG_BLOCK}, // 79
+    {"fieldset", 8, TAG_BLOCK}, // 80
+    {}, {}, {}, {},
+    {"form", 4, TAG_BLOCK}, // 85
+    {"th", 2, TAG_CELL}, // 86
+    {}, {},
+    {"style", 5, TAG_RAW_TEXT}, // 89
+    {"h2", 2, TAG_SPACED}, // 90
+    {}, {}, {}, {}, {}, {}, {}, {}, {}, {},
+    {}, {},
+    {"div", 3, TAG_BLOCK}, // 103
+    {"h6", 2, TAG_SPACED}, // 104
+    {"blockquote", 10, TAG_SPACED}, // 105
+    {"dd", 2, TAG_BLOCK}, // 106
+    {}, {},
+    {"script", 6, TAG_RAW_TEXT}, // 109
+    {"hgroup", 6, TAG_BLOCK}, // 110
+    {},
+    {"table", 5, TAG_BLOCK}, // 112
+    {}, {}, {}, {}, {}, {},
+    {"ol", 2, TAG_BLOCK}, // 119
+    {}, {}, {},
+    {"ul", 2, TAG_BLOCK}, // 123
+    {}, {}, {},
+    {"h3", 2, TAG_SPACED}, // 127
+    {"figcaption", 10, TAG_BLOCK}, // 128
+    {},
+    {"details", 7, TAG_BLOCK}, // 130
+    {"tfoot", 5, TAG_BLOCK}, // 131
+    {}, {},
+
+};
+
+constexpr bool tagSlotValid(size_t slot) {
+    return tagTable[slot].name == nullptr || tagHash(tagTable[slot].name, tagTable[slot].length) == slot;
+}
+
+constexpr bool tagTableValid(size_t slot) {
+    return slot == tagTableSize || (tagSlotValid(slot) && tagTableValid(slot + 1));
+}
+
+static_assert(tagTableValid(0), "every tag must sit in the slot tagHash() gives it");
+
+TagKind classifyTag(const char* name, size_t length) {
+    const TagInfo& info = tagTable[tagHash(name, length)];
+    if (info.length == length && memcmp(info.name, name, length) == 0) return info.kind;
+    return TAG_INLINE;
+}
+
+}
+
+HtmlTextExtractor::HtmlTextExtractor() : anchorIds(nullptr), outputLimit(SIZE_MAX) {
+    reset();
+}
+
+void HtmlTextExtractor::reset() {
+    state = TEXT;
+    tagNameLength = 0;
+    closingTag = false;
+    selfClosing = false;
+    quote = 0;
+    markupMatch = 0;
+    markupTarget = nullptr;
+    rawTextTag = nullptr;
+    headDepth = 0;
+    attributeNameLength = 0;
+    inAttributeName = false;
+    capturingValue = false;
+    anchorIds = nullptr;
+    anchorOffsets.clear();
+    pendingAnchor = SIZE_MAX;
+    decoder.reset();
+    output.clear();
+    wasTruncated = false;
+    windowStart = 0;
+    windowEnd = SIZE_MAX;
+    dropped = 0;
+    windowOpened = false;
+    windowClosed = false;
+}
+
+void HtmlTextExtractor::setWindow(size_t start, size_t end) {
+    windowStart = start;
+    windowEnd = end;
+}
+
+void HtmlTextExtractor::setAnchors(const vector<string>* ids) {
+    anchorIds = (ids && !ids->empty()) ? ids : nullptr;
+    anchorOffsets.assign(anchorIds ? anchorIds->size() : 0, UINT32_MAX);
+}
+
+void HtmlTextExtractor::releaseMemory() {
+    string().swap(output);
+}
+
+void HtmlTextExtractor::feed(const char* data, size_t length) {
+    if (windowClosed) return;
+    if (output.size() >= outputLimit) {
+        wasTruncated = true;
+        return;
+    }
+    feedMarkup(data, length);
+    applyWindow(false);
+}
+
+void HtmlTextExtractor::feedMarkup(const char* data, size_t length) {
+    const char* p = data;
+    const char* end = data + length;
+
+    while (p < end) {
+        switch (state) {
+        case TEXT: {
+            const char* lt = findTagOpen(p, end);
+            if (lt > p) appendText(p, lt - p);
+            if (lt == end) return;
+            flushText();
+            p = lt + 1;
+            state = TAG_OPEN;
+            break;
+        }
+        case TAG_OPEN: {
+            char c = *p;
+            tagNameLength = 0;
+            selfClosing = false;
+            attributeNameLength = 0;
+            inAttributeName = false;
+            pendingAnchor = SIZE_MAX;
+            if (c == '/') {
+                closingTag = true;
+                state = TAG_NAME;
+                p++;
+            } else if (isalpha((unsigned char)c)) {
+                closingTag = false;
+                state = TAG_NAME;
+            } else if (c == '!') {
+                markupMatch = 0;
+                state = MARKUP_DECLARATION;
+                p++;
+            } else if (c == '?') {
+                state = SKIP_TO_CLOSE;
+                p++;
+            } else {
+                // A bare '<' in sloppy HTML is just text.
+                appendText("<", 1);
+                state = TEXT;
+            }
+            break;
+        }
+        case TAG_NAME: {
+            char c = *p;
+            if (isTagNameChar(c)) {
+                if (tagNameLength < maxTagName) tagName[tagNameLength++] = (char)tolower((unsigned char)c);
+                p++;
+            } else if (c == ':') {
+                // Keep only the local name of prefixed tags such as <html:p>.
+                tagNameLength = 0;
+                p++;
+            } else {
+                state = TAG_ATTRIBUTES;
+            }
+            break;
+        }
+        case TAG_ATTRIBUTES: {
+            char c = *p++;
+            if (c == '"' || c == '\'') {
+                quote = c;
+                capturingValue = anchorIds && isAnchorAttribute();
+                attributeValue.clear();
+                attributeNameLength = 0;
+                inAttributeName = false;
+                state = ATTRIBUTE_VALUE;
+            } else if (c == '>') {
+                finishTag();
+                // Placed after the tag's own line break, so the anchor lands on its first line.
+                if (pendingAnchor != SIZE_MAX) anchorOffsets[pendingAnchor] = (uint32_t)(dropped + output.size());
+                pendingAnchor = SIZE_MAX;
+            } else if (c == '/') {
+                selfClosing = true;
+                attributeNameLength = 0;
+                inAttributeName = false;
+            } else if (isTagNameChar(c)) {
+                selfClosing = false;
+                if (!inAttributeName) attributeNameLength = 0;
+                inAttributeName = true;
+                if (attributeNameLength < maxAttributeName) attributeName[attributeNameLength++] = (char)tolower((unsigned char)c);
+            } else if (isSpace(c) || c == '=') {
+                // The name is kept until its value starts, even with spaces around the '='.
+                inAttributeName = false;
+            } else {
+                selfClosing = false;
+                attributeNameLength = 0;
+                inAttributeName = false;
+            }
+            break;
+        }
+        case ATTRIBUTE_VALUE: {
+            const char* close = (const char*)memchr(p, quote, end - p);
+            if (capturingValue) {
+                size_t length = (close ? close : end) - p;
+                size_t room = attributeValue.size() < maxAnchorLength ? maxAnchorLength - attributeValue.size() : 0;
+                attributeValue.append(p, length < room ? length : room);
+            }
+            if (!close) return;
+            p = close + 1;
+            if (capturingValue) matchAnchor();
+            capturingValue = false;
+            state = TAG_ATTRIBUTES;
+            break;
+        }
+        case MARKUP_DECLARATION: {
+            char c = *p;
+            if (markupMatch == 0) {
+                markupTarget = (c == '-') ? "--" : (c == '[') ? "[CDATA[" : nullptr;
+            }
+            if (!markupTarget || c != markupTarget[markupMatch]) {
+                state = SKIP_TO_CLOSE; // <!DOCTYPE ...> and friends
+                break;
+            }
+            p++;
+            if (markupTarget[++markupMatch] == '\0') {
+                state = (markupTarget[0] == '-') ? COMMENT : CDATA;
+                markupMatch = 0;
+            }
+            break;
+        }
+        case COMMENT: {
+            char c = *p++;
+            if (c == '>' && markupMatch >= 2) state = TEXT;
+            else markupMatch = (c == '-') ? markupMatch + 1 : 0;
+            break;
+        }
+        case CDATA: {
+            char c = *p++;
+            if (c == ']') {
+                markupMatch++;
+                break;
+            }
+            bool closes = (c == '>' && markupMatch >= 2);
+            for (size_t i = closes ? 2 : 0; i < markupMatch; i++) appendText("]", 1);
+            markupMatch = 0;
+            if (closes) {
+                flushText();
+                state = TEXT;
+            } else {
+                appendText(&c, 1);
+            }
+            break;
+        }
+        case SKIP_TO_CLOSE: {
+            const char* gt = (const char*)memchr(p, '>', end - p);
+            if (!gt) return;
+            p = gt + 1;
+            state = TEXT;
+            break;
+        }
+        case RAW_TEXT: {
+            if (markupMatch == 0) {
+                p = findTagOpen(p, end);
+                if (p == end) return;
+            }
+            char c = (char)tolower((unsigned char)*p++);
+            if (c == rawTextTag[markupMatch]) {
+                if (rawTextTag[++markupMatch] == '\0') {
+                    // Found "</script" or "</style": let the tag states skip to '>'.
+                    tagNameLength = 0;
+                    for (const char* n = rawTextTag + 2; *n; n++) tagName[tagNameLength++] = *n;
+                    closingTag = true;
+                    selfClosing = false;
+                    markupMatch = 0;
+                    state = TAG_ATTRIBUTES;
+                }
+            } else {
+                markupMatch = (c == '<') ? 1 : 0;
+            }
+            break;
+        }
+        }
+    }
+}
+
+void HtmlTextExtractor::finish() {
+    if (!windowClosed) {
+        flushText();
+        while (!output.empty() && isSpace(output[output.size() - 1])) output.erase(output.size() - 1);
+        applyWindow(true);
+    }
+    if (output.size() > outputLimit) {
+        wasTruncated = true;
+        output.resize(outputLimit);
+    }
+    while (!output.empty() && isSpace(output[output.size() - 1])) output.erase(output.size() - 1);
+    state = TEXT;
+
+    // Anchors were placed at document offsets; those outside the window
+    // are treated like ids that never turned up, or clamped to its end.
+    for (size_t i = 0; i < anchorOffsets.size(); i++) {
+        if (anchorOffsets[i] == UINT32_MAX || anchorOffsets[i] < dropped) anchorOffsets[i] = 0;
+        else if (anchorOffsets[i] - dropped > output.size()) anchorOffsets[i] = (uint32_t)output.size();
+        else anchorOffsets[i] -= (uint32_t)dropped;
+    }
+}
+
+// Where a window boundary at offset lands: just after the last line break
+// in the slack before it. Only called once the text up to offset is final.
+size_t HtmlTextExtractor::windowCut(size_t offset) const {
+    size_t from = offset > windowSlack ? offset - windowSlack : 0;
+    if (from < dropped) from = dropped;
+    for (size_t i = offset; i > from; i--) {
+        if (output[i - 1 - dropped] == '\n') return i;
+    }
+    return offset;
+}
+
+// Text is final once two more bytes follow it, since lineBreak() and
+// collapseWhitespace() look back no further than that; finish() settles the
+// rest. Before the window opens, only the slack ahead of the start and that
+// look-back are kept.
+void HtmlTextExtractor::applyWindow(bool final) {
+    size_t total = dropped + output.size();
+    if (!windowOpened) {
+        size_t keepFrom = windowStart > windowSlack ? windowStart - windowSlack : 0;
+        if (keepFrom > dropped && output.size() > 2) {
+            size_t count = min(keepFrom - dropped, output.size() - 2);
+            output.erase(0, count);
+            dropped += count;
+        }
+        if (!final && total < windowStart + 2) return;
+        size_t cut = total > windowStart ? windowCut(windowStart) : total;
+        output.erase(0, cut - dropped);
+        dropped = cut;
+        windowOpened = true;
+    }
+    if (windowEnd == SIZE_MAX || total <= windowEnd || (!final && total < windowEnd + 2)) return;
+    output.resize(windowCut(windowEnd) - dropped);
+    windowClosed = true;
+}
+
+// id on any element, and the older <a name="..."> form.
+bool HtmlTextExtractor::isAnchorAttribute() const {
+    if (attributeNameLength == 2) return memcmp(attributeName, "id", 2) == 0;
+    return attributeNameLength == 4 && memcmp(attributeName, "name", 4) == 0 && tagNameLength == 1 && tagName[0] == 'a';
+}
+
+void HtmlTextExtractor::matchAnchor() {
+    vector<string>::const_iterator it = lower_bound(anchorIds->begin(), anchorIds->end(), attributeValue);
+    if (it == anchorIds->end() || *it != attributeValue) return;
+    // Ids should be unique; if one isn't, the first element with it counts.
+    size_t index = it - anchorIds->begin();
+    if (anchorOffsets[index] == UINT32_MAX) pendingAnchor = index;
+}
+
+void HtmlTextExtractor::appendText(const char* data, size_t length) {
+    if (headDepth > 0) return;
+    size_t from = output.size();
+    decoder.decode(data, length, output);
+    collapseWhitespace(from);
+}
+
+void HtmlTextExtractor::flushText() {
+    if (headDepth > 0) {
+        decoder.reset();
+        return;
+    }
+    size_t from = output.size();
+    decoder.finish(output);
+    collapseWhitespace(from);
+}
+
+// Squeezes runs of whitespace in output[from, end) to one space, and drops
+// whitespace at the start of a line, the same way a browser renders text.
+// Text between whitespace is moved a run at a time.
+void HtmlTextExtractor::collapseWhitespace(size_t from) {
+    size_t size = output.size();
+    if (from >= size) return;
+
+    char* data = &output[0];
+    char prev = (from > 0) ? data[from - 1] : '\n';
+    size_t w = from;
+    size_t r = from;
+    while (r < size) {
+        size_t space = findSpace(data + r, data + size) - data;
+        if (space > r) {
+            if (w != r) memmove(data + w, data + r, space - r);
+            w += space - r;
+            prev = data[w - 1];
+            r = space;
+        }
+        if (r == size) break;
+
+        if (prev != ' ' && prev != '\n') {
+            data[w++] = ' ';
+            prev = ' ';
+        }
+        r++;
+    }
+    output.resize(w);
+}
+
+void HtmlTextExtractor::lineBreak(bool force) {
+    if (!output.empty() && output[output.size() - 1] == ' ') output.erase(output.size() - 1);
+    if (force || (!output.empty() && output[output.size() - 1] != '\n')) output += '\n';
+}
+
+void HtmlTextExtractor::blankLine() {
+    lineBreak(false);
+    if (output.size() >= 2 && output[output.size() - 2] != '\n') output += '\n';
+}
+
+void HtmlTextExtractor::finishTag() {
+    state = TEXT;
+    if (tagNameLength == 0 || tagNameLength >= maxTagName) return;
+
+    TagKind kind = classifyTag(tagName, tagNameLength);
+    if (kind == TAG_INLINE) return;
+
+    if (closingTag) {
+        switch (kind) {
+        case TAG_HEAD:
+            if (headDepth > 0) headDepth--;
+            break;
+        case TAG_BLOCK:
+        case TAG_LIST_ITEM:
+            lineBreak(false);
+            break;
+        case TAG_SPACED:
+            blankLine();
+            break;
+        case TAG_CELL:
+            if (!output.empty() && !isSpace(output[output.size() - 1])) output += ' ';
+            break;
+        default:
+            break;
+        }
+        return;
+    }
+
+    switch (kind) {
+    case TAG_HEAD:
+        if (!selfClosing) headDepth++;
+        break;
+    case TAG_BODY:
+        headDepth = 0; // sloppy documents sometimes never close <head>
+        break;
+    case TAG_RAW_TEXT:
+        if (!selfClosing) {
+            rawTextTag = (tagName[1] == 'c') ? "</script" : "</style";
+            markupMatch = 0;
+            state = RAW_TEXT;
+        }
+        break;
+    case TAG_LINE_BREAK:
+        lineBreak(true);
+        break;
+    case TAG_BLOCK:
+        lineBreak(false);
+        break;
+    case TAG_SPACED:
+        blankLine();
+        break;
+    case TAG_LIST_ITEM:
+        if (headDepth == 0) {
+            lineBreak(false);
+            output += "- ";
+        }
+        break;
+    case TAG_RULE:
+        if (headDepth == 0) {
+            blankLine();
+            output += "* * *\n\n";
+        }
+        break;
+    default:
+        break;
+    }
+}
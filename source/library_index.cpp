@@ -0,0 +1,159 @@
+#include "library_index.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#include "file_util.h"
+
+using namespace std;
+
+namespace {
+
+const char* indexHeader = "ereader-library 1";
+const char* indexEnd = "end";
+
+bool isEpubName(const char* name) {
+    size_t length = strlen(name);
+    return length > 5 && strcmp(name + length - 5, ".epub") == 0;
+}
+
+}
+
+LibraryIndex::LibraryIndex() {
+    memset(&lastStats, 0, sizeof(lastStats));
+}
+
+// One line per record: "D <mtime> <path>" opens a directory, followed by its
+// "S <name>" subdirectories and "B <name>" books. The trailing "end" line
+// tells a complete file from one cut short, which is thrown away.
+bool LibraryIndex::load(const char* path) {
+    directories.clear();
+
+    ifstream file(path);
+    string line;
+    if (!file.is_open() || !getline(file, line) || line != indexHeader) return false;
+
+    Directory* current = nullptr;
+    bool complete = false;
+    while (getline(file, line)) {
+        if (line == indexEnd) {
+            complete = true;
+            break;
+        }
+        if (line.size() < 3 || line[1] != ' ') break;
+
+        if (line[0] == 'D') {
+            char* end = nullptr;
+            uint64_t mtime = strtoull(line.c_str() + 2, &end, 10);
+            if (!end || *end != ' ') break;
+            current = &directories[string(end + 1)];
+            current->mtime = mtime;
+        }
+        else if (line[0] == 'S' && current) {
+            current->subdirectories.push_back(line.substr(2));
+        }
+        else if (line[0] == 'B' && current) {
+            current->books.push_back(line.substr(2));
+        }
+        else {
+            break;
+        }
+    }
+
+    if (!complete) directories.clear();
+    return complete;
+}
+
+bool LibraryIndex::save(const char* path) const {
+    FILE* file = fopen(path, "w");
+    if (!file) return false;
+
+    fprintf(file, "%s\n", indexHeader);
+    for (const auto& entry : directories) {
+        fprintf(file, "D %llu %s\n", (unsigned long long)entry.second.mtime, entry.first.c_str());
+        for (const string& name : entry.second.subdirectories) fprintf(file, "S %s\n", name.c_str());
+        for (const string& name : entry.second.books) fprintf(file, "B %s\n", name.c_str());
+    }
+    fprintf(file, "%s\n", indexEnd);
+
+    bool ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+}
+
+void LibraryIndex::scan(const string& root, bool fullRescan) {
+    memset(&lastStats, 0, sizeof(lastStats));
+
+    // Directories that are no longer reachable simply aren't carried over.
+    map<string, Directory> scanned;
+    scanDirectory(root, fullRescan, scanned);
+    directories.swap(scanned);
+}
+
+void LibraryIndex::scanDirectory(const string& path, bool fullRescan, map<string, Directory>& scanned) {
+    lastStats.directoriesVisited++;
+
+    // Adding, removing or renaming an entry updates the directory's own mtime,
+    // so an unchanged mtime means the saved listing is still right. Changes
+    // further down are caught when the walk reaches those directories.
+    Directory dir;
+    dir.mtime = modificationTime(path);
+    map<string, Directory>::const_iterator known = directories.find(path);
+    if (!fullRescan && dir.mtime != 0 && known != directories.end() && known->second.mtime == dir.mtime) {
+        dir.subdirectories = known->second.subdirectories;
+        dir.books = known->second.books;
+    }
+    else {
+        lastStats.directoriesRead++;
+        if (!readListing(path, dir)) return;
+    }
+
+    const Directory& stored = scanned[path] = dir;
+    for (const string& name : stored.subdirectories) {
+        scanDirectory(path + "/" + name, fullRescan, scanned);
+    }
+}
+
+bool LibraryIndex::readListing(const string& path, Directory& dir) {
+    DIR* handle = opendir(path.c_str());
+    if (!handle) return false;
+
+    struct dirent* entry;
+    while ((entry = readdir(handle)) != nullptr) {
+        const char* name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        // A newline would break the line-based index file
+        if (strchr(name, '\n')) continue;
+
+        bool isDirectory = entry->d_type == DT_DIR;
+        bool isFile = entry->d_type == DT_REG;
+        if (entry->d_type == DT_UNKNOWN) {
+            lastStats.statCalls++;
+            struct stat info;
+            string fullPath = path + "/" + name;
+            if (stat(fullPath.c_str(), &info) != 0) continue;
+            isDirectory = S_ISDIR(info.st_mode);
+            isFile = S_ISREG(info.st_mode);
+        }
+
+        if (isDirectory) dir.subdirectories.push_back(name);
+        else if (isFile && isEpubName(name)) dir.books.push_back(name);
+    }
+    closedir(handle);
+
+    sort(dir.subdirectories.begin(), dir.subdirectories.end());
+    sort(dir.books.begin(), dir.books.end());
+    return true;
+}
+
+map<string, vector<string>> LibraryIndex::booksByDirectory() const {
+    map<string, vector<string>> result;
+    for (const auto& entry : directories) {
+        if (!entry.second.books.empty()) result[entry.first] = entry.second.books;
+    }
+    return result;
+}
@@ -0,0 +1,626 @@
+#include "library_search.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+
+#include "epub_book.h"
+#include "file_util.h"
+
+using namespace std;
+
+namespace {
+
+const char* catalogHeader = "ereader-search 1";
+const char* catalogEnd = "end";
+const char segmentMagic[8] = { 'E', 'R', 'S', 'E', 'A', 'R', 'C', 'H' };
+const uint32_t segmentVersion = 1;
+
+const size_t termsPerSample = 64;
+const size_t minWordLength = 2;
+const size_t maxWordLength = 32;
+const size_t maxPendingPairs = 256 * 1024; // ~2 MB of (hash, id) pairs before a segment is written
+const size_t maxSegments = 4;
+const size_t indexChapterCacheBytes = 256 * 1024;
+const size_t indexLineWidth = 50;
+
+struct SegmentHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t termCount;
+    uint32_t postingsOffset;
+    uint32_t tableOffset;
+    uint32_t sampleOffset;
+    uint32_t sampleCount;
+};
+
+struct TermEntry {
+    uint32_t hash;
+    uint32_t offset; // from the start of the postings
+    uint32_t length; // bytes
+};
+
+void putVarint(vector<uint8_t>& out, uint32_t value) {
+    while (value >= 0x80) {
+        out.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((uint8_t)value);
+}
+
+// Calls onWord with the FNV-1a hash of every lowercased word of letters and
+// digits. Very short and very long runs aren't words worth indexing.
+template <typename Handler>
+void forEachWord(const char* text, size_t length, Handler onWord) {
+    size_t i = 0;
+    while (i < length) {
+        while (i < length && !isalnum((unsigned char)text[i])) i++;
+        size_t start = i;
+        uint32_t hash = 2166136261u;
+        while (i < length && isalnum((unsigned char)text[i])) {
+            hash ^= (uint32_t)tolower((unsigned char)text[i]);
+            hash *= 16777619u;
+            i++;
+        }
+        size_t wordLength = i - start;
+        if (wordLength >= minWordLength && wordLength <= maxWordLength) onWord(hash);
+    }
+}
+
+void sortUnique(vector<uint32_t>& values) {
+    sort(values.begin(), values.end());
+    values.erase(unique(values.begin(), values.end()), values.end());
+}
+
+vector<uint32_t> wordHashes(const string& text) {
+    vector<uint32_t> hashes;
+    forEachWord(text.data(), text.size(), [&](uint32_t hash) { hashes.push_back(hash); });
+    sortUnique(hashes);
+    return hashes;
+}
+
+// Tabs and newlines separate catalog fields and records.
+string catalogField(const string& value) {
+    string field = value;
+    replace(field.begin(), field.end(), '\t', ' ');
+    replace(field.begin(), field.end(), '\n', ' ');
+    replace(field.begin(), field.end(), '\r', ' ');
+    return field;
+}
+
+// Streams postings out term by term, then appends the term table and the
+// sparse index once all terms are known.
+class SegmentWriter {
+public:
+    SegmentWriter() : file(nullptr), postingsSize(0) {}
+    ~SegmentWriter() {
+        if (file) fclose(file);
+    }
+
+    bool open(const string& path) {
+        file = fopen(path.c_str(), "wb");
+        if (!file) return false;
+        SegmentHeader header;
+        memset(&header, 0, sizeof(header));
+        return fwrite(&header, sizeof(header), 1, file) == 1;
+    }
+
+    bool add(uint32_t hash, const vector<uint32_t>& ids) {
+        encoded.clear();
+        uint32_t previous = 0;
+        for (size_t i = 0; i < ids.size(); i++) {
+            putVarint(encoded, ids[i] - previous);
+            previous = ids[i];
+        }
+        TermEntry entry = { hash, postingsSize, (uint32_t)encoded.size() };
+        entries.push_back(entry);
+        postingsSize += (uint32_t)encoded.size();
+        return fwrite(encoded.data(), 1, encoded.size(), file) == encoded.size();
+    }
+
+    bool finish() {
+        SegmentHeader header;
+        memcpy(header.magic, segmentMagic, sizeof(segmentMagic));
+        header.version = segmentVersion;
+        header.termCount = (uint32_t)entries.size();
+        header.postingsOffset = sizeof(header);
+        header.tableOffset = header.postingsOffset + postingsSize;
+        header.sampleOffset = header.tableOffset + (uint32_t)(entries.size() * sizeof(TermEntry));
+
+        vector<uint32_t> samples;
+        for (size_t i = 0; i < entries.size(); i += termsPerSample) samples.push_back(entries[i].hash);
+        header.sampleCount = (uint32_t)samples.size();
+
+        bool ok = fwrite(entries.data(), sizeof(TermEntry), entries.size(), file) == entries.size() &&
+                  fwrite(samples.data(), sizeof(uint32_t), samples.size(), file) == samples.size() &&
+                  fseek(file, 0, SEEK_SET) == 0 &&
+                  fwrite(&header, sizeof(header), 1, file) == 1;
+        ok = fclose(file) == 0 && ok;
+        file = nullptr;
+        return ok;
+    }
+
+private:
+    FILE* file;
+    uint32_t postingsSize;
+    vector<TermEntry> entries;
+    vector<uint8_t> encoded;
+};
+
+// Reads a segment's term table front to back during a merge.
+class TermCursor {
+public:
+    TermCursor() : file(nullptr), remaining(0), valid(false) {}
+    ~TermCursor() {
+        if (file) fclose(file);
+    }
+
+    bool open(const string& path, uint32_t tableOffset, uint32_t termCount) {
+        file = fopen(path.c_str(), "rb");
+        remaining = termCount;
+        return file && fseek(file, tableOffset, SEEK_SET) == 0 && advance();
+    }
+
+    bool advance() {
+        valid = remaining > 0 && fread(&entry, sizeof(entry), 1, file) == 1;
+        if (valid) remaining--;
+        return true;
+    }
+
+    FILE* file;
+    uint32_t remaining;
+    bool valid;
+    TermEntry entry;
+};
+
+}
+
+LibrarySearch::LibrarySearch(const string& directory) : directory(directory), nextBookId(0), nextSegment(0) {}
+
+LibrarySearch::~LibrarySearch() {
+    closeSegments();
+}
+
+bool LibrarySearch::fail(const string& message) {
+    lastError = message;
+    return false;
+}
+
+string LibrarySearch::segmentPath(uint32_t number) const {
+    char name[32];
+    snprintf(name, sizeof(name), "/segment%u.idx", (unsigned)number);
+    return directory + name;
+}
+
+size_t LibrarySearch::bookCount() const {
+    size_t count = 0;
+    for (const Book& book : books) {
+        if (book.live) count++;
+    }
+    return count;
+}
+
+vector<bool> LibrarySearch::liveIds() const {
+    vector<bool> live(nextBookId, false);
+    for (const Book& book : books) {
+        if (book.live) live[book.id] = true;
+    }
+    return live;
+}
+
+// Catalog lines: the header with the next book id and segment number, one
+// "S <number>" per segment, then "B <id>\t<size>\t<mtime>\t<live>\t<path>\t<title>\t<author>"
+// per book, and "end" so a file cut short is noticed.
+bool LibrarySearch::load() {
+    closeSegments();
+    books.clear();
+    nextBookId = 0;
+    nextSegment = 0;
+
+    ifstream file(directory + "/catalog.txt");
+    if (!file.is_open()) file.open(directory + "/catalog.tmp");
+    string line;
+    if (!file.is_open() || !getline(file, line)) return false;
+
+    unsigned long nextId = 0;
+    unsigned long nextNumber = 0;
+    size_t headerLength = strlen(catalogHeader);
+    if (line.compare(0, headerLength, catalogHeader) != 0 ||
+        sscanf(line.c_str() + headerLength, " %lu %lu", &nextId, &nextNumber) != 2) {
+        return false;
+    }
+
+    vector<uint32_t> segmentNumbers;
+    bool complete = false;
+    while (getline(file, line)) {
+        if (line == catalogEnd) {
+            complete = true;
+            break;
+        }
+        if (line.compare(0, 2, "S ") == 0) {
+            segmentNumbers.push_back((uint32_t)strtoul(line.c_str() + 2, nullptr, 10));
+        }
+        else if (line.compare(0, 2, "B ") == 0) {
+            vector<string> fields;
+            size_t start = 2;
+            while (fields.size() < 6) {
+                size_t tab = line.find('\t', start);
+                if (tab == string::npos) break;
+                fields.push_back(line.substr(start, tab - start));
+                start = tab + 1;
+            }
+            if (fields.size() != 6) break;
+            fields.push_back(line.substr(start));
+
+            Book book;
+            book.id = (uint32_t)strtoul(fields[0].c_str(), nullptr, 10);
+            book.size = strtoull(fields[1].c_str(), nullptr, 10);
+            book.mtime = strtoull(fields[2].c_str(), nullptr, 10);
+            book.live = fields[3] == "1";
+            book.path = fields[4];
+            book.title = fields[5];
+            book.author = fields[6];
+            if (book.id >= nextId || (!books.empty() && book.id <= books.back().id)) break;
+            books.push_back(book);
+        }
+        else {
+            break;
+        }
+    }
+
+    if (complete) {
+        nextBookId = (uint32_t)nextId;
+        nextSegment = (uint32_t)nextNumber;
+        for (uint32_t number : segmentNumbers) {
+            Segment segment;
+            if (!openSegment(number, segment)) {
+                complete = false;
+                break;
+            }
+            segments.push_back(segment);
+        }
+    }
+    if (!complete) {
+        // Start over rather than trust half an index.
+        closeSegments();
+        books.clear();
+        nextBookId = 0;
+        nextSegment = 0;
+    }
+    return complete;
+}
+
+bool LibrarySearch::saveCatalog() {
+    string tmpPath = directory + "/catalog.tmp";
+    string path = directory + "/catalog.txt";
+
+    FILE* file = fopen(tmpPath.c_str(), "w");
+    if (!file) return fail("Cannot write " + tmpPath);
+
+    fprintf(file, "%s %lu %lu\n", catalogHeader, (unsigned long)nextBookId, (unsigned long)nextSegment);
+    for (const Segment& segment : segments) fprintf(file, "S %u\n", (unsigned)segment.number);
+    for (const Book& book : books) {
+        fprintf(file, "B %u\t%llu\t%llu\t%d\t%s\t%s\t%s\n", (unsigned)book.id, (unsigned long long)book.size,
+                (unsigned long long)book.mtime, book.live ? 1 : 0, book.path.c_str(),
+                catalogField(book.title).c_str(), catalogField(book.author).c_str());
+    }
+    fprintf(file, "%s\n", catalogEnd);
+
+    bool ok = !ferror(file);
+    ok = fclose(file) == 0 && ok;
+    // The SD card can't rename over an existing file; load() falls back to the .tmp.
+    if (ok) {
+        remove(path.c_str());
+        ok = rename(tmpPath.c_str(), path.c_str()) == 0;
+    }
+    return ok || fail("Cannot write " + path);
+}
+
+bool LibrarySearch::openSegment(uint32_t number, Segment& segment) {
+    segment.number = number;
+    segment.file = fopen(segmentPath(number).c_str(), "rb");
+    if (!segment.file) return false;
+
+    SegmentHeader header;
+    bool ok = fread(&header, sizeof(header), 1, segment.file) == 1 &&
+              memcmp(header.magic, segmentMagic, sizeof(segmentMagic)) == 0 && header.version == segmentVersion &&
+              header.sampleCount == (header.termCount + termsPerSample - 1) / termsPerSample;
+    if (ok) {
+        segment.termCount = header.termCount;
+        segment.postingsOffset = header.postingsOffset;
+        segment.tableOffset = header.tableOffset;
+        segment.samples.resize(header.sampleCount);
+        ok = fseek(segment.file, header.sampleOffset, SEEK_SET) == 0 &&
+             fread(segment.samples.data(), sizeof(uint32_t), segment.samples.size(), segment.file) == segment.samples.size();
+    }
+    if (!ok) {
+        fclose(segment.file);
+        segment.file = nullptr;
+    }
+    return ok;
+}
+
+void LibrarySearch::closeSegments() {
+    for (Segment& segment : segments) {
+        if (segment.file) fclose(segment.file);
+    }
+    segments.clear();
+}
+
+bool LibrarySearch::readPostings(Segment& segment, uint32_t offset, uint32_t length, vector<uint32_t>& ids) {
+    vector<uint8_t> bytes(length);
+    if (fseek(segment.file, segment.postingsOffset + offset, SEEK_SET) != 0 ||
+        (length > 0 && fread(bytes.data(), 1, length, segment.file) != length)) {
+        return false;
+    }
+
+    uint32_t id = 0;
+    uint32_t value = 0;
+    int shift = 0;
+    for (size_t i = 0; i < bytes.size(); i++) {
+        value |= (uint32_t)(bytes[i] & 0x7F) << shift;
+        shift += 7;
+        if (!(bytes[i] & 0x80)) {
+            id += value;
+            ids.push_back(id);
+            value = 0;
+            shift = 0;
+        }
+    }
+    return true;
+}
+
+bool LibrarySearch::findPostings(Segment& segment, uint32_t hash, vector<uint32_t>& ids) {
+    vector<uint32_t>::const_iterator sample = upper_bound(segment.samples.begin(), segment.samples.end(), hash);
+    if (sample == segment.samples.begin()) return true;
+
+    size_t first = (size_t)(sample - segment.samples.begin() - 1) * termsPerSample;
+    size_t count = min(termsPerSample, (size_t)segment.termCount - first);
+    TermEntry block[termsPerSample];
+    if (fseek(segment.file, segment.tableOffset + first * sizeof(TermEntry), SEEK_SET) != 0 ||
+        fread(block, sizeof(TermEntry), count, segment.file) != count) {
+        return false;
+    }
+
+    const TermEntry* entry = lower_bound(block, block + count, hash, [](const TermEntry& e, uint32_t h) {
+        return e.hash < h;
+    });
+    if (entry == block + count || entry->hash != hash) return true;
+    return readPostings(segment, entry->offset, entry->length, ids);
+}
+
+bool LibrarySearch::writeSegment(vector<uint64_t>& pairs) {
+    sort(pairs.begin(), pairs.end());
+    pairs.erase(unique(pairs.begin(), pairs.end()), pairs.end());
+
+    SegmentWriter writer;
+    if (!writer.open(segmentPath(nextSegment))) return fail("Cannot write " + segmentPath(nextSegment));
+
+    vector<uint32_t> ids;
+    for (size_t i = 0; i < pairs.size(); ) {
+        uint32_t hash = (uint32_t)(pairs[i] >> 32);
+        ids.clear();
+        for (; i < pairs.size() && (uint32_t)(pairs[i] >> 32) == hash; i++) ids.push_back((uint32_t)pairs[i]);
+        if (!writer.add(hash, ids)) return fail("Cannot write " + segmentPath(nextSegment));
+    }
+    if (!writer.finish()) return fail("Cannot write " + segmentPath(nextSegment));
+
+    Segment segment;
+    if (!openSegment(nextSegment, segment)) return fail("Cannot read back " + segmentPath(nextSegment));
+    segments.push_back(segment);
+    nextSegment++;
+    pairs.clear();
+    return true;
+}
+
+bool LibrarySearch::mergeSegments() {
+    vector<bool> live = liveIds();
+    uint32_t number = nextSegment;
+
+    vector<unique_ptr<TermCursor>> cursors;
+    for (const Segment& segment : segments) {
+        unique_ptr<TermCursor> cursor(new TermCursor());
+        if (!cursor->open(segmentPath(segment.number), segment.tableOffset, segment.termCount)) {
+            return fail("Cannot read " + segmentPath(segment.number));
+        }
+        cursors.push_back(move(cursor));
+    }
+
+    SegmentWriter writer;
+    if (!writer.open(segmentPath(number))) return fail("Cannot write " + segmentPath(number));
+
+    vector<uint32_t> ids;
+    vector<uint32_t> kept;
+    while (true) {
+        bool any = false;
+        uint32_t hash = 0;
+        for (const auto& cursor : cursors) {
+            if (cursor->valid && (!any || cursor->entry.hash < hash)) hash = cursor->entry.hash;
+            any = any || cursor->valid;
+        }
+        if (!any) break;
+
+        // Older segments hold lower ids, so appending in segment order stays sorted.
+        kept.clear();
+        for (size_t i = 0; i < cursors.size(); i++) {
+            if (!cursors[i]->valid || cursors[i]->entry.hash != hash) continue;
+            ids.clear();
+            if (!readPostings(segments[i], cursors[i]->entry.offset, cursors[i]->entry.length, ids)) {
+                return fail("Cannot read " + segmentPath(segments[i].number));
+            }
+            for (uint32_t id : ids) {
+                if (id < live.size() && live[id]) kept.push_back(id);
+            }
+            cursors[i]->advance();
+        }
+        if (!kept.empty() && !writer.add(hash, kept)) return fail("Cannot write " + segmentPath(number));
+    }
+    if (!writer.finish()) return fail("Cannot write " + segmentPath(number));
+
+    Segment merged;
+    if (!openSegment(number, merged)) return fail("Cannot read back " + segmentPath(number));
+    vector<Segment> old;
+    old.swap(segments);
+    segments.push_back(merged);
+    nextSegment = number + 1;
+
+    // Dead books have no postings left anywhere, so they can leave the catalog.
+    books.erase(remove_if(books.begin(), books.end(), [](const Book& book) { return !book.live; }), books.end());
+    bool saved = saveCatalog();
+
+    for (Segment& segment : old) {
+        fclose(segment.file);
+        remove(segmentPath(segment.number).c_str());
+    }
+    return saved;
+}
+
+bool LibrarySearch::indexBook(const string& path, Book& book, vector<uint64_t>& pairs) {
+    EpubBook epub(indexChapterCacheBytes, indexLineWidth);
+    if (!epub.open(path.c_str())) return false;
+
+    book.title = epub.title();
+    book.author = epub.author();
+
+    vector<uint32_t> hashes = wordHashes(book.title + " " + book.author);
+    for (size_t i = 0; i < epub.chapterCount(); i++) {
+        const string& text = epub.chapter(i)->text;
+        forEachWord(text.data(), text.size(), [&](uint32_t hash) { hashes.push_back(hash); });
+        if (hashes.size() > maxPendingPairs / 4) sortUnique(hashes);
+    }
+    sortUnique(hashes);
+
+    for (uint32_t hash : hashes) pairs.push_back((uint64_t)hash << 32 | book.id);
+    return true;
+}
+
+bool LibrarySearch::update(const vector<string>& bookPaths, const IndexProgress& progress) {
+    lastError.clear();
+    if (mkdir(directory.c_str(), 0777) != 0 && errno != EEXIST) return fail("Cannot create " + directory);
+
+    map<string, size_t> liveByPath;
+    for (size_t i = 0; i < books.size(); i++) {
+        if (books[i].live) liveByPath[books[i].path] = i;
+    }
+
+    // Unchanged books stay; changed and vanished ones are marked dead.
+    struct Pending {
+        string path;
+        uint64_t size;
+        uint64_t mtime;
+    };
+    vector<Pending> pending;
+    bool catalogChanged = false;
+    map<string, bool> present;
+    for (const string& path : bookPaths) {
+        if (path.find_first_of("\t\n") != string::npos) continue;
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0) continue;
+        Pending candidate = { path, (uint64_t)info.st_size, modificationTime(path) };
+        present[path] = true;
+
+        map<string, size_t>::const_iterator known = liveByPath.find(path);
+        if (known != liveByPath.end()) {
+            Book& book = books[known->second];
+            if (book.size == candidate.size && book.mtime == candidate.mtime) continue;
+            book.live = false;
+            catalogChanged = true;
+        }
+        pending.push_back(candidate);
+    }
+    for (Book& book : books) {
+        if (book.live && !present.count(book.path)) {
+            book.live = false;
+            catalogChanged = true;
+        }
+    }
+
+    vector<uint64_t> pairs;
+    vector<Book> added;
+    bool ok = true;
+    for (size_t i = 0; i < pending.size() && ok; i++) {
+        if (progress && !progress(i, pending.size(), pending[i].path)) break;
+
+        Book book;
+        book.id = nextBookId++;
+        book.size = pending[i].size;
+        book.mtime = pending[i].mtime;
+        book.live = true;
+        book.path = pending[i].path;
+        // A book that can't be opened is still recorded, so it isn't retried every time.
+        indexBook(book.path, book, pairs);
+        added.push_back(book);
+
+        if (pairs.size() >= maxPendingPairs) {
+            ok = writeSegment(pairs);
+            if (ok) {
+                books.insert(books.end(), added.begin(), added.end());
+                added.clear();
+                ok = saveCatalog();
+            }
+        }
+    }
+    if (ok && (!pairs.empty() || !added.empty() || catalogChanged)) {
+        if (!pairs.empty()) ok = writeSegment(pairs);
+        if (ok) {
+            books.insert(books.end(), added.begin(), added.end());
+            ok = saveCatalog();
+        }
+    }
+    if (ok && segments.size() > maxSegments) ok = mergeSegments();
+    return ok;
+}
+
+bool LibrarySearch::search(const string& query, vector<LibrarySearchResult>& results, size_t maxResults) {
+    results.clear();
+    vector<uint32_t> words = wordHashes(query);
+    if (words.empty()) return false;
+
+    vector<bool> live = liveIds();
+    vector<uint32_t> matches;
+    vector<uint32_t> ids;
+    vector<uint32_t> merged;
+    for (size_t w = 0; w < words.size(); w++) {
+        ids.clear();
+        for (Segment& segment : segments) {
+            if (!findPostings(segment, words[w], ids)) return fail("Cannot read " + segmentPath(segment.number));
+        }
+        if (w == 0) {
+            for (uint32_t id : ids) {
+                if (id < live.size() && live[id]) matches.push_back(id);
+            }
+        } else {
+            merged.clear();
+            set_intersection(matches.begin(), matches.end(), ids.begin(), ids.end(), back_inserter(merged));
+            matches.swap(merged);
+        }
+        if (matches.empty()) break;
+    }
+
+    for (uint32_t id : matches) {
+        vector<Book>::const_iterator book = lower_bound(books.begin(), books.end(), id, [](const Book& b, uint32_t i) {
+            return b.id < i;
+        });
+        if (book == books.end() || book->id != id) continue;
+
+        vector<uint32_t> metadata = wordHashes(book->title + " " + book->author);
+        LibrarySearchResult result;
+        result.path = book->path;
+        result.title = book->title;
+        result.author = book->author;
+        result.inMetadata = includes(metadata.begin(), metadata.end(), words.begin(), words.end());
+        results.push_back(result);
+    }
+
+    stable_sort(results.begin(), results.end(), [](const LibrarySearchResult& a, const LibrarySearchResult& b) {
+        return a.inMetadata > b.inMetadata;
+    });
+    if (results.size() > maxResults) results.resize(maxResults);
+    return true;
+}
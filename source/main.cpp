@@ -1,26 +1,36 @@
-#include <3ds.h>
 #include <dirent.h>
 #include <vector>
 #include <string>
 #include <stdio.h>
-#include <archive.h>
-#include <archive_entry.h>
 #include <cstring>
-#include <tinyxml2.h>
 #include <cctype>
 #include <algorithm>
-#include <sstream>
 #include <map>
 #include <sys/stat.h>
 #include <fstream>
 #include <stdexcept>
+#include <functional>
+
+#include "epub_book.h"
+#include "html_text.h"
+#include "book_metadata.h"
+#include "library_index.h"
+#include "library_search.h"
+#include "platform.h"
+#include "profile.h"
+#include "reading_position.h"
+#include "text_layout.h"
 
 using namespace std;
-using namespace tinyxml2;
 
 
-const int maxFileSize = 96 * 1048576; // Allocate 96 MB as maximum file size
+// Most memory an open book may use for its text and search index; larger
+// books get shortened chapters and no search instead of crashing
+const size_t maxBookMemory = 96 * 1048576;
+const size_t maxBookMemoryOld3DS = 24 * 1048576; // the Old 3DS has far less heap
 const size_t WORD_WRAP_WIDTH = 50; // Set word wrap width to 50 characters
+const size_t pageTextRows = 28; // Top screen console has 30 rows; the last two hold the footer
+const size_t pagesPerFrame = 16; // Pages laid out per idle frame while a chapter is being paginated
 
 // Define min/max for pageSize
 const size_t minPageSize = 200; // Minimum characters per page
@@ -28,6 +38,46 @@ const size_t maxPageSize = 2000; // Maximum characters per page
 const size_t pageSizeStep = 50; // How much to increment/decrement by
 const size_t largePageSizeStep = 100; // Larger step for L/R buttons
 
+// Decoded chapters kept in memory while reading; the Old 3DS heap is small
+const size_t defaultChapterCacheKB = 4096;
+const size_t minChapterCacheKB = 512;
+
+// Preprocessed books kept on the SD card; 0 MB turns the cache off
+const char* bookCacheDir = "sdmc:/settings/ereader/cache";
+const size_t defaultBookCacheMB = 64;
+
+// Threads decoding chapters in the background; 0 picks one per spare core
+const size_t maxLoaderThreads = 8;
+
+// In-book search results
+const size_t maxSearchHits = 500;
+const size_t searchSnippetLead = 12; // characters shown before the hit
+
+const char* ebookRoot = "sdmc:/ebooks";
+const char* settingsPath = "sdmc:/settings/ereader/settings.inf";
+const char* libraryIndexPath = "sdmc:/settings/ereader/library.idx";
+const char* readingPositionsPath = "sdmc:/settings/ereader/positions.inf";
+const char* bookMetadataPath = "sdmc:/settings/ereader/metadata.inf";
+
+// Held D-pad buttons in lists repeat after this many frames, then every few frames
+const u32 listRepeatDelay = 15;
+const u32 listRepeatInterval = 3;
+
+// Held L/R in a book turn pages after this many frames, then at the rate set in the settings
+const u32 pageRepeatDelay = 20;
+const u32 framesPerSecond = 60;
+const size_t defaultPageFlipRate = 10; // pages a second
+const size_t minPageFlipRate = 1;
+const size_t maxPageFlipRate = 30;
+
+#ifdef EREADER_PROFILE
+const char* profileLogPath = "sdmc:/settings/ereader/profile.log";
+#endif
+
+// Library-wide search
+const char* librarySearchDir = "sdmc:/settings/ereader/search";
+const size_t maxLibraryResults = 100;
+
 enum Colour {
     DEFAULT, WHITE, RED, GREEN, YELLOW, BLUE, MAGENTA, CYAN, INVALID
 };
@@ -35,12 +85,6 @@ enum Colour {
 // Global variable for the selected text color
 Colour currentTextColor = DEFAULT;
 
-string toLower(const string& input) {
-    string output = input;
-    transform(output.begin(), output.end(), output.begin(), [](unsigned char c){ return tolower(c); });
-    return output;
-}
-
 // Function to get the string name of a color
 string getColourName(Colour colour) {
     switch (colour) {
@@ -69,34 +113,35 @@ Colour getColourFromString(const string& colourName) {
     return INVALID;
 }
 
-string printColouredText(const string& input, Colour selectedColour) {
-    string colourCode;
+// ANSI escape that selects the colour; DEFAULT leaves the console untouched
+const char* colourCode(Colour selectedColour) {
     switch (selectedColour) {
-        case RED: colourCode = "\x1b[31m"; break;
-        case GREEN: colourCode = "\x1b[32m"; break;
-        case YELLOW: colourCode = "\x1b[33m"; break;
-        case BLUE: colourCode = "\x1b[34m"; break;
-        case MAGENTA: colourCode = "\x1b[35m"; break;
-        case CYAN: colourCode = "\x1b[36m"; break;
-        case WHITE: colourCode = "\x1b[37m"; break;
+        case RED: return "\x1b[31m";
+        case GREEN: return "\x1b[32m";
+        case YELLOW: return "\x1b[33m";
+        case BLUE: return "\x1b[34m";
+        case MAGENTA: return "\x1b[35m";
+        case CYAN: return "\x1b[36m";
+        case WHITE: return "\x1b[37m";
         case DEFAULT:
         case INVALID:
         default:
-            colourCode = "\x1b[0m"; break;
+            return "";
     }
-    // For default, we don't need to wrap it, just return the input
-    if (selectedColour == DEFAULT) return input;
-
-    return colourCode + input + "\x1b[0m";
 }
 
 struct AppSettings {
     size_t pageSize;
     Colour currentTextColor;
+    size_t chapterCacheKB;
+    size_t bookCacheMB;
+    size_t loaderThreads;
+    size_t pageFlipRate;
 };
 
 AppSettings currentSettings = {
-    .pageSize = 400, .currentTextColor = DEFAULT
+    .pageSize = 400, .currentTextColor = DEFAULT, .chapterCacheKB = defaultChapterCacheKB,
+    .bookCacheMB = defaultBookCacheMB, .loaderThreads = 0, .pageFlipRate = defaultPageFlipRate
 };
 
 bool DirExists(const char* path) {
@@ -109,8 +154,7 @@ bool DirExists(const char* path) {
 }
 
 bool settingsFileExists() {
-    const char* settingsPath = "sdmc:/settings/ereader/settings.inf";
-    FILE* file = fopen(settingsPath, "r");
+    FILE* file = fopen(storagePath(settingsPath).c_str(), "r");
 
     if (file) {
         fclose(file);
@@ -122,11 +166,9 @@ bool settingsFileExists() {
 }
 
 bool createSettingsDirRecursive() {
-    if (!DirExists("sdmc:/settings")) {
-        if (mkdir("sdmc:/settings", 0777) != 0 && errno != EEXIST) return false;
-    }
-    if (!DirExists("sdmc:/settings/ereader")) {
-        if (mkdir("sdmc:/settings/ereader", 0777) != 0 && errno != EEXIST) return false;
+    for (const char* dir : { "sdmc:/settings", "sdmc:/settings/ereader" }) {
+        string path = storagePath(dir);
+        if (!DirExists(path.c_str()) && mkdir(path.c_str(), 0777) != 0 && errno != EEXIST) return false;
     }
     return true;
 }
@@ -134,10 +176,14 @@ bool createSettingsDirRecursive() {
 void saveSettings(const AppSettings& settings) {
     if (!createSettingsDirRecursive()) return;
 
-    FILE* file = fopen("sdmc:/settings/ereader/settings.inf", "w");
+    FILE* file = fopen(storagePath(settingsPath).c_str(), "w");
     if (file) {
         fprintf(file, "pageSize=%zu\n", settings.pageSize);
         fprintf(file, "textColour=%s\n", getColourName(settings.currentTextColor).c_str());
+        fprintf(file, "chapterCacheKB=%zu\n", settings.chapterCacheKB);
+        fprintf(file, "bookCacheMB=%zu\n", settings.bookCacheMB);
+        fprintf(file, "loaderThreads=%zu\n", settings.loaderThreads);
+        fprintf(file, "pageFlipRate=%zu\n", settings.pageFlipRate);
         fclose(file);
     }
 }
@@ -148,7 +194,7 @@ void loadSettings(AppSettings& settings) {
         return;
     }
 
-    ifstream file("sdmc:/settings/ereader/settings.inf");
+    ifstream file(storagePath(settingsPath));
     string line;
     if (file.is_open()) {
         while (getline(file, line)){
@@ -170,6 +216,38 @@ void loadSettings(AppSettings& settings) {
                         settings.pageSize = 400;
                     }
                 }
+                else if (key == "chapterCacheKB") {
+                    try {
+                        settings.chapterCacheKB = max(minChapterCacheKB, (size_t)stoul(value));
+                    }
+                    catch (const exception& e) {
+                        settings.chapterCacheKB = defaultChapterCacheKB;
+                    }
+                }
+                else if (key == "bookCacheMB") {
+                    try {
+                        settings.bookCacheMB = stoul(value);
+                    }
+                    catch (const exception& e) {
+                        settings.bookCacheMB = defaultBookCacheMB;
+                    }
+                }
+                else if (key == "loaderThreads") {
+                    try {
+                        settings.loaderThreads = min(maxLoaderThreads, (size_t)stoul(value));
+                    }
+                    catch (const exception& e) {
+                        settings.loaderThreads = 0;
+                    }
+                }
+                else if (key == "pageFlipRate") {
+                    try {
+                        settings.pageFlipRate = max(minPageFlipRate, min(maxPageFlipRate, (size_t)stoul(value)));
+                    }
+                    catch (const exception& e) {
+                        settings.pageFlipRate = defaultPageFlipRate;
+                    }
+                }
                 else if (key == "currentTextColor") {
                     currentSettings.currentTextColor = getColourFromString(value);
                 }
@@ -179,354 +257,874 @@ void loadSettings(AppSettings& settings) {
         file.close();
     }
     else {
-        printf("error loading settings fire");
+        screenPrint("error loading settings fire");
     }
 }
 
-void replace_all(std::string& s, const std::string& from, const std::string& to) {
-    if (from.empty()) return;
-    size_t start_pos = 0;
-    while((start_pos = s.find(from, start_pos)) != std::string::npos) {
-        s.replace(start_pos, from.length(), to);
-        start_pos += to.length();
+#ifdef EREADER_PROFILE
+// Profiling builds show the stage report on the otherwise unused bottom
+// screen; SELECT hides it while reading.
+bool profileOverlayVisible = true;
+
+// Each line of the heading is cut to the screen's width.
+void drawProfileOverlay(const string& heading) {
+    if (!profileOverlayVisible) {
+        drawBottomScreen("");
+        return;
     }
+    size_t width = bottomScreenColumns() - 1;
+    string text;
+    for (size_t start = 0; start <= heading.size();) {
+        size_t end = heading.find('\n', start);
+        if (end == string::npos) end = heading.size();
+        text += heading.substr(start, min(end - start, width)) + "\n";
+        start = end + 1;
+    }
+    drawBottomScreen(text + "\n" + profileReport(width));
 }
 
-std::map<std::string, char> htmlEntities = {
-    {"&apos;", '\''}, {"&#39;", '\''},
-    {"&quot;", '\"'}, {"&#34;", '\"'},
-    {"&amp;", '&'},
-    {"&lt;", '<'},
-    {"&gt;", '>'},
-    {"&lsquo;", '\''}, {"&#x2018;", '\''},
-    {"&rsquo;", '\''}, {"&#x2019;", '\''},
-    {"&ldquo;", '\"'}, {"&#x201C;", '\"'},
-    {"&rdquo;", '\"'}, {"&#x201D;", '\"'},
-    {"&mdash;", '-'}, {"&#x2014;", '-'},
-    {"&ndash;", '-'}, {"&#x2013;", '-'},
-    {"&hellip;", '.'}, {"&#x2026;", '.'},
-    {"&nbsp;", ' '},  {"&#xa0;", ' '},
-};
+void logProfile(const string& heading) {
+    if (createSettingsDirRecursive()) profileAppendLog(storagePath(profileLogPath).c_str(), heading);
+}
+#else
+void drawProfileOverlay(const string&) {}
+void logProfile(const string&) {}
+#endif
+
+// Refreshes the library index and returns the books grouped by directory,
+// with a status line describing how long the scan took.
+map<string, vector<string>> scanLibrary(const char* ebookDir, bool fullRescan, string& status) {
+    LibraryIndex library;
+    if (!fullRescan) library.load(storagePath(libraryIndexPath).c_str());
+
+#ifdef EREADER_PROFILE
+    profileReset();
+#endif
+    u64 start = clockMilliseconds();
+    {
+        PROFILE_SCOPE(STAGE_LIBRARY_SCAN);
+        library.scan(ebookDir, fullRescan);
+    }
+    u64 elapsed = clockMilliseconds() - start;
+    drawProfileOverlay("Library scan");
+    logProfile(string("Library scan ") + ebookDir);
+
+    if (createSettingsDirRecursive()) library.save(storagePath(libraryIndexPath).c_str());
+
+    const LibraryScanStats& stats = library.stats();
+    char line[64];
+    snprintf(line, sizeof(line), "%zu folders, %zu read, %zu stat: %llu ms",
+             stats.directoriesVisited, stats.directoriesRead, stats.statCalls, (unsigned long long)elapsed);
+    status = line;
+    return library.booksByDirectory();
+}
 
-std::string decodeHtmlEntities(const std::string& input) {
-    std::string output = input;
+// Storage traffic of one book open, for the profile log
+string readStatsText(const FileReadStats& stats) {
+    char text[128];
+    snprintf(text, sizeof(text), "SD %llu KB in %lu reads, %lu seeks, %llu KB again, %.1f MB/s",
+             (unsigned long long)(stats.bytesRead / 1024), (unsigned long)stats.readCalls,
+             (unsigned long)stats.seekCalls, (unsigned long long)(stats.bytesReread / 1024),
+             min(stats.megabytesPerSecond(), 9999.9));
+    return text;
+}
 
-    for (const auto& pair : htmlEntities) {
-        replace_all(output, pair.first, string(1, pair.second));
-    }
+void drawPageFooter(const string& position) {
+    screenPrint("\x1b[29;1H\x1b[2K%s", position.c_str());
+    screenPrint("\x1b[30;1H\x1b[2KL/R: Page | X: Find | Y: Contents | B: Back");
+}
 
-    replace_all(output, "\xE2\x80\x99", "'");
-    replace_all(output, "\xE2\x80\x98", "'");
-    replace_all(output, "\xE2\x80\x9C", "\"");
-    replace_all(output, "\xE2\x80\x9D", "\"");
-    replace_all(output, "\xE2\x80\xA6", "...");
-    replace_all(output, "\xE2\x80\x93", "-");
-    replace_all(output, "\xE2\x80\x94", "-");
+// Prints one page straight out of the chapter text, a line at a time
+void drawPage(const Chapter& chapter, const PageIndex& pages, const string& position) {
+    clearScreen();
 
-    std::string cleanedOutput;
-    for (char c : output) {
-        if ((static_cast<unsigned char>(c) >= 32 && static_cast<unsigned char>(c) <= 126) ||
-            c == '\n' || c == '\r' || c == '\t') {
-            cleanedOutput += c;
-        } else if (static_cast<unsigned char>(c) > 126) { // Replace non-ASCII chars
-            cleanedOutput += ' ';
-        } else {
-            cleanedOutput += c; // Keep other control chars like newline
-        }
+    size_t firstLine = pages.firstLine();
+    size_t endLine = min(pages.endLine(), firstLine + pageTextRows);
+
+    screenPrint("%s", colourCode(currentTextColor));
+    for (size_t line = firstLine; line < endLine; line++) {
+        LineView view = lineAt(chapter.text, chapter.lineStarts, line);
+        screenPrint("%.*s\n", (int)view.length, view.data);
     }
-    return cleanedOutput;
+    if (currentTextColor != DEFAULT) screenPrint("\x1b[0m");
+
+    drawPageFooter(position);
 }
 
-void recursiveSearchEPub(const std::string& basePath, std::map<std::string, std::vector<std::string>>& epubFilesByDir) {
-    DIR* dir = opendir(basePath.c_str());
-    if (!dir) {
-        return;
+// The page a page image holds. The same lines of a chapter always look the
+// same, so nothing needs throwing out when the page size changes.
+struct PageImageKey {
+    size_t chapter;
+    size_t firstLine;
+    size_t endLine;
+
+    bool operator==(const PageImageKey& other) const {
+        return chapter == other.chapter && firstLine == other.firstLine && endLine == other.endLine;
     }
+};
 
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != nullptr) {
-        std::string name = entry->d_name;
-        if (name == "." || name == "..") {
-            continue;
-        }
+const PageImageKey noPageImage = { (size_t)-1, 0, 0 };
 
-        std::string fullPath = basePath + "/" + name;
-        struct stat s;
-        if (stat(fullPath.c_str(), &s) == 0) {
-            if (S_ISDIR(s.st_mode)) {
-                // It's a directory, so recurse into it
-                recursiveSearchEPub(fullPath, epubFilesByDir);
-            } else if (S_ISREG(s.st_mode)) {
-                // It's a regular file, check if it's an .epub
-                if (name.length() > 5 && name.substr(name.length() - 5) == ".epub") {
-                    epubFilesByDir[basePath].push_back(name);
-                }
-            }
-        }
-    }
-    closedir(dir);
+// Lists use a quick repeat; held L/R in a book turns pages at the rate picked in the settings.
+void useListKeyRepeat() {
+    setKeyRepeat(listRepeatDelay, listRepeatInterval);
 }
 
+void usePageKeyRepeat() {
+    setKeyRepeat(pageRepeatDelay, (u32)max<size_t>(1, framesPerSecond / currentSettings.pageFlipRate));
+}
 
-vector<string> paginateFile(const string& fullText, size_t pageSize) {
-    vector<string> pages;
-    size_t pos = 0;
-
-    while (pos < fullText.size()) {
-        size_t end = min(pageSize, fullText.size() - pos);
-        pages.push_back(fullText.substr(pos, end));
-        pos += end;
+void waitForBackButton() {
+    screenPrint("\nPress B to return.\n");
+    presentFrame();
+    while (platformRunning()) {
+        scanInput();
+        if (keysDown() & KEY_B) break;
+        waitForFrame();
     }
-    return pages;
 }
 
-void extractText(XMLNode* node, string& output) {
-    if (!node) return;
+// Asks for a phrase with the software keyboard. False if cancelled.
+bool askSearchQuery(string& query, const char* hint) {
+    return askText(hint, SearchIndex::maxQueryLength, query);
+}
 
-    if (XMLElement* elem = node->ToElement()) {
-        string tag = toLower(elem->Name());
-        if (tag == "script" || tag == "style") return;
+// One result row: the page number, or '?' while it can't be counted yet,
+// then the text around the hit on one line
+string searchResultLine(const SearchHit& hit, long page) {
+    char prefix[16];
+    int prefixLength = page < 0 ? snprintf(prefix, sizeof(prefix), "%5s  ", "?")
+                                : snprintf(prefix, sizeof(prefix), "%5ld  ", page);
+    size_t snippetLength = WORD_WRAP_WIDTH - 4 - prefixLength; // leaves room for the " > " marker
+    return prefix + hit.snippet.substr(0, snippetLength);
+}
 
-        if (tag == "p" || tag == "div" || tag == "h1" || tag == "h2" || tag == "h3") {
-            if (!output.empty() && output.back() != '\n') output += "\n";
-        }
-        if (tag == "br") output += "\n";
+// Lists the hits for a query and lets the reader pick one with A. Returns
+// false if B was pressed instead.
+bool pickSearchHit(const string& query, const vector<SearchHit>& hits, const function<long(const SearchHit&)>& pageOf,
+                   size_t& picked) {
+    const size_t visibleRows = 25;
+    vector<string> lines;
+    for (const SearchHit& hit : hits) {
+        long page = pageOf(hit);
+        lines.push_back(searchResultLine(hit, page < 0 ? page : page + 1));
     }
 
-    if (XMLText* text = node->ToText()) {
-        string textValue = text->Value();
-        size_t first = textValue.find_first_not_of(" \t\n\r");
-        if (string::npos != first) {
-            size_t last = textValue.find_last_not_of(" \t\n\r");
-            textValue = textValue.substr(first, (last - first + 1));
-            
-            if (!output.empty() && output.back() != ' ' && output.back() != '\n') {
-                output += " ";
+    size_t selected = 0;
+    size_t firstRow = 0;
+    bool needsRedraw = true;
+    while (platformRunning()) {
+        if (needsRedraw) {
+            if (selected < firstRow) firstRow = selected;
+            if (selected >= firstRow + visibleRows) firstRow = selected - visibleRows + 1;
+
+            clearScreen();
+            screenPrint("\"%.30s\": %zu hit%s%s\n\n", query.c_str(), hits.size(), hits.size() == 1 ? "" : "s",
+                        hits.size() >= maxSearchHits ? " (first ones)" : "");
+            if (hits.empty()) screenPrint("Nothing found.\n");
+            for (size_t row = firstRow; row < lines.size() && row < firstRow + visibleRows; row++) {
+                screenPrint("%s%s\n", row == selected ? " > " : "   ", lines[row].c_str());
             }
-            output += textValue;
+            screenPrint("\x1b[30;1HA: Go to | B: Back | Up/Down: Select");
+            presentFrame();
+            needsRedraw = false;
         }
-    }
-
-    for (XMLNode* child = node->FirstChild(); child; child = child->NextSibling()) {
-        extractText(child, output);
-    }
 
-    if (XMLElement* elem = node->ToElement()) {
-        string tag = toLower(elem->Name());
-        if (tag == "p" || tag == "div" || tag == "h1" || tag == "h2" || tag == "h3") {
-            if (!output.empty() && output.back() != '\n') output += "\n";
+        scanInput();
+        u32 kdown = keysDown();
+        if (kdown & KEY_B) return false;
+        if ((kdown & KEY_A) && !hits.empty()) {
+            picked = selected;
+            return true;
+        }
+        if ((kdown & (KEY_DOWN | KEY_CPAD_DOWN)) && selected + 1 < hits.size()) {
+            selected++;
+            needsRedraw = true;
         }
+        if ((kdown & (KEY_UP | KEY_CPAD_UP)) && selected > 0) {
+            selected--;
+            needsRedraw = true;
+        }
+        waitForFrame();
     }
+    return false;
 }
 
+// A scrolling window onto a list that can be far longer than the screen.
+// Only the entries in view are printed, and moving the cursor inside the
+// window reprints just the two rows involved, so a redraw costs the same in
+// a folder of ten books as in one of thousands.
+struct ListWindow {
+    size_t count;
+    size_t selected;
+    size_t first;  // first entry in view
+    int screenRow; // console row of the first entry in view
+    size_t rows;   // entries in view
+};
 
-void displayPage(const vector<string>& pages, int currentPage) {
-    consoleClear();
+void drawListRow(const ListWindow& list, size_t index, const string& label) {
+    screenPrint("\x1b[%d;1H\x1b[2K%s%.*s", list.screenRow + (int)(index - list.first),
+                index == list.selected ? " > " : "   ", (int)(WORD_WRAP_WIDTH - 4), label.c_str());
+}
 
-    if (currentPage >= 0 && currentPage < (int)pages.size()) {
-        printf("%s", printColouredText(pages[currentPage], currentTextColor).c_str());
-        printf("\x1b[29;1HPage %d of %d", currentPage + 1, (int)pages.size());
-        printf("\x1b[30;1HL/R: Prev/Next | B: Back");
+void drawListWindow(const ListWindow& list, const function<string(size_t)>& labelOf) {
+    for (size_t row = 0; row < list.rows; row++) {
+        size_t index = list.first + row;
+        if (index < list.count) drawListRow(list, index, labelOf(index));
+        else screenPrint("\x1b[%d;1H\x1b[2K", list.screenRow + (int)row);
     }
-    else {
-        printf("\x1b[31mInvalid Page Number!\x1b[0m");
-    }
-
-    gfxFlushBuffers();
-    gfxSwapBuffers();
 }
 
-string wordWrap(const string& input, size_t maxWidth) {
-    stringstream ss(input);
-    string line, wrappedText;
+// Up/Down move one entry (wrapping around), L/R a page, and Left/Right jump
+// to the previous or next initial letter. keys should come from
+// keysDownRepeat() so held buttons scroll. Redraws whatever changed and
+// returns true if the cursor moved.
+bool moveListCursor(ListWindow& list, u32 keys, const function<char(size_t)>& initialOf,
+                    const function<string(size_t)>& labelOf) {
+    if (list.count == 0) return false;
+
+    size_t previous = list.selected;
+    if (keys & (KEY_DOWN | KEY_CPAD_DOWN)) {
+        list.selected = (list.selected + 1) % list.count;
+    }
+    else if (keys & (KEY_UP | KEY_CPAD_UP)) {
+        list.selected = (list.selected + list.count - 1) % list.count;
+    }
+    else if (keys & KEY_R) {
+        list.selected = min(list.count - 1, list.selected + list.rows);
+    }
+    else if (keys & KEY_L) {
+        list.selected = list.selected > list.rows ? list.selected - list.rows : 0;
+    }
+    else if (keys & (KEY_DRIGHT | KEY_CPAD_RIGHT)) {
+        char initial = initialOf(list.selected);
+        size_t next = list.selected;
+        while (next < list.count && initialOf(next) == initial) next++;
+        if (next < list.count) list.selected = next;
+    }
+    else if (keys & (KEY_DLEFT | KEY_CPAD_LEFT)) {
+        // To the start of this letter, or of the one before if already there.
+        size_t index = list.selected;
+        if (index > 0 && initialOf(index - 1) != initialOf(index)) index--;
+        char initial = initialOf(index);
+        while (index > 0 && initialOf(index - 1) == initial) index--;
+        list.selected = index;
+    }
+    if (list.selected == previous) return false;
 
-    while (getline(ss, line, '\n')) {
-        string currentLine;
-        stringstream words(line);
-        string word;
-        while (words >> word) {
-            if (currentLine.length() + word.length() + 1 > maxWidth) {
-                wrappedText += currentLine + "\n";
-                currentLine = "";
-            }
-            if (!currentLine.empty()) currentLine += " ";
-            currentLine += word;
-        }
-        wrappedText += currentLine + "\n";
+    size_t first = list.first;
+    if (list.selected < list.first) list.first = list.selected;
+    if (list.selected >= list.first + list.rows) list.first = list.selected - list.rows + 1;
+    if (list.first != first) {
+        drawListWindow(list, labelOf);
+    } else {
+        drawListRow(list, previous, labelOf(previous));
+        drawListRow(list, list.selected, labelOf(list.selected));
     }
-    return wrappedText;
+    return true;
 }
 
-vector<string> getChapterList(const char* epubPath) {
-    vector<string> chapters;
-    struct archive* a = archive_read_new();
-    archive_read_support_format_zip(a);
-
-    if (archive_read_open_filename(a, epubPath, 10240) != ARCHIVE_OK) {
-        archive_read_free(a);
-        return chapters;
-    }
+char initialOf(const string& name) {
+    return name.empty() ? 0 : (char)toupper((unsigned char)name[0]);
+}
 
-    struct archive_entry* entry;
-    while (archive_read_next_header(a, &entry) == ARCHIVE_OK) {
-        const char* name = archive_entry_pathname(entry);
-        if (strstr(name, ".xhtml") || strstr(name, ".html")) {
-            chapters.push_back(name);
+const size_t contentsRows = 26;
+
+// Shows the table of contents with the given entry selected and lets the
+// reader pick one with A. Returns false if B was pressed instead.
+bool pickContentsEntry(const vector<TocEntry>& entries, size_t current, size_t& picked) {
+    ListWindow list = { entries.size(), current, 0, 3, contentsRows };
+    if (list.selected >= list.count) list.selected = 0;
+    if (list.selected >= list.rows / 2) list.first = list.selected - list.rows / 2;
+    if (list.count > list.rows) list.first = min(list.first, list.count - list.rows);
+    else list.first = 0;
+
+    auto labelOf = [&](size_t i) { return string(entries[i].depth * 2, ' ') + entries[i].title; };
+    auto initial = [&](size_t i) { return initialOf(entries[i].title); };
+
+    clearScreen();
+    screenPrint("Contents: (%zu)\n", entries.size());
+    if (entries.empty()) screenPrint("\nThis book has no table of contents.\n");
+    else drawListWindow(list, labelOf);
+    screenPrint("\x1b[29;1HUp/Down: Move | L/R: Page | Left/Right: Letter\n");
+    screenPrint("A: Go to | B: Back");
+    presentFrame();
+
+    while (platformRunning()) {
+        scanInput();
+        u32 kdown = keysDown();
+        if (kdown & KEY_B) return false;
+        if ((kdown & KEY_A) && !entries.empty()) {
+            picked = list.selected;
+            return true;
+        }
+        if (moveListCursor(list, keysDownRepeat(), initial, labelOf)) {
+            presentFrame();
         }
-        archive_read_data_skip(a);
+        waitForFrame();
     }
-    archive_read_free(a);
-
-    // Sort the chapters alphabetically to ensure numerical order
-    std::sort(chapters.begin(), chapters.end());
-    
-    return chapters;
+    return false;
 }
 
-
-// This function replaces the chapter menu and reads the entire book into one document
+// Opens the book where it was last left and shows that page as soon as its
+// chapter is decoded; the rest of the book is decoded on worker threads
+// while reading.
 void readAndDisplayBook(const char* epubPath) {
-    vector<string> chapterList = getChapterList(epubPath);
-
-    if (chapterList.empty()) {
-        consoleClear();
-        printf("No chapters (.xhtml or .html files) found in this EPUB.\n");
-        printf("\nPress B to return.\n");
-        gfxFlushBuffers();
-        gfxSwapBuffers();
-        while (aptMainLoop()) {
-            hidScanInput();
-            if (hidKeysDown() & KEY_B) break;
-            gspWaitForVBlank();
-        }
-        return;
+    u64 openStart = clockMilliseconds();
+#ifdef EREADER_PROFILE
+    profileReset();
+#endif
+
+    size_t memoryBudget = isNew3DS() ? maxBookMemory : maxBookMemoryOld3DS;
+
+    // The chapter cache comes out of the same budget
+    EpubBook book(min(currentSettings.chapterCacheKB * 1024, memoryBudget / 4), WORD_WRAP_WIDTH);
+    book.setMemoryBudget(memoryBudget);
+    if (currentSettings.bookCacheMB > 0 && createSettingsDirRecursive()) {
+        book.setDiskCache(storagePath(bookCacheDir), (uint64_t)currentSettings.bookCacheMB * 1048576);
     }
-
-    string fullBookText; // This will hold the content of the entire book
-
-    struct archive* a = archive_read_new();
-    archive_read_support_format_zip(a);
-
-    if (archive_read_open_filename(a, epubPath, 10240) != ARCHIVE_OK) {
-        printf("Failed to open EPUB: %s\n", archive_error_string(a));
-        archive_read_free(a);
+    bool opened = false;
+    {
+        PROFILE_SCOPE(STAGE_OPEN);
+        opened = book.open(epubPath);
+    }
+    if (!opened) {
+        clearScreen();
+        screenPrint("Failed to open EPUB: %s\n", book.error().c_str());
+        waitForBackButton();
         return;
     }
+    size_t loaderThreads = currentSettings.loaderThreads;
+    if (loaderThreads == 0) loaderThreads = max<size_t>(1, WorkerThread::coreCount() - 1);
+
+    // Resuming only needs the saved chapter, so the workers start there.
+    ReadingPositions positions;
+    positions.load(storagePath(readingPositionsPath).c_str());
+    ReadingPosition resume = { 0, 0 };
+    bool resuming = positions.find(epubPath, resume) && resume.spineIndex < book.chapterCount();
+    book.startLoading(resuming ? resume.spineIndex : 0, loaderThreads);
+
+    size_t chapterIndex = 0;
+    shared_ptr<const Chapter> chapter;
+    PageIndex pages;
+
+    // Pages per chapter at the current page size, -1 until counted
+    vector<long> chapterPages(book.chapterCount(), -1);
+    u64 firstPageTime = 0;
+    u64 fullyLoadedTime = 0;
+    u64 chapterSwitchTicks = 0; // fetching the last chapter turned to, from the LZ4 store if it was there
+
+    // Page numbers run through the whole book once every chapter before this
+    // one has been decoded; the total grows as the worker gets further.
+    auto positionText = [&]() -> string {
+        size_t before = 0;
+        size_t total = 0;
+        bool beforeKnown = true;
+        bool totalKnown = true;
+        for (size_t i = 0; i < book.chapterCount(); i++) {
+            if (i == chapterIndex) {
+                total += pages.pageCount();
+                continue;
+            }
+            if (!book.isMeasured(i)) {
+                if (i < chapterIndex) beforeKnown = false;
+                totalKnown = false;
+                continue;
+            }
+            if (chapterPages[i] < 0) {
+                chapterPages[i] = (long)countPages(book.lineLengths(i), currentSettings.pageSize, pageTextRows);
+            }
+            total += chapterPages[i];
+            if (i < chapterIndex) before += chapterPages[i];
+        }
 
-    // Loop through each chapter file in the sorted list
-    for (const auto& chapterPath : chapterList) {
-        // We have to re-open the archive for each file search as libarchive works as a stream.
-        // This is inefficient but necessary for this library's API.
-        archive_read_free(a); 
-        a = archive_read_new();
-        archive_read_support_format_zip(a);
-        archive_read_open_filename(a, epubPath, 10240);
-
-        struct archive_entry* entry;
-        while (archive_read_next_header(a, &entry) == ARCHIVE_OK) {
-            if (strcmp(archive_entry_pathname(entry), chapterPath.c_str()) == 0) {
-                char buffer[4096];
-                string fileContent;
-                ssize_t size;
-
-                while ((size = archive_read_data(a, buffer, sizeof(buffer))) > 0) {
-                    fileContent.append(buffer, size);
-                }
+        char text[64];
+        if (pages.complete() && beforeKnown) {
+            snprintf(text, sizeof(text), "Chapter %zu/%zu  Page %zu of %zu%s", chapterIndex + 1, book.chapterCount(),
+                     before + pages.pageNumber() + 1, total, totalKnown ? "" : "+");
+        } else {
+            snprintf(text, sizeof(text), "Chapter %zu/%zu  Page ...", chapterIndex + 1, book.chapterCount());
+        }
+        return text;
+    };
+
+    // For the profile overlay and log: loading progress, then how long the
+    // first page and the whole book took.
+    auto statusText = [&]() -> string {
+        char text[64]; // both times at their widest
+        if (fullyLoadedTime == 0) {
+            snprintf(text, sizeof(text), "Loading %zu/%zu", book.loadedCount(), book.chapterCount());
+        } else {
+            snprintf(text, sizeof(text), "1st page %llums, all %llums",
+                     (unsigned long long)firstPageTime, (unsigned long long)fullyLoadedTime);
+        }
+        return text;
+    };
+
+    // The overlay adds the LZ4 store's ratio and how long the last chapter
+    // turned to took to fetch.
+    auto profileHeading = [&]() -> string {
+        string heading = statusText();
+        const TextStore& store = book.compressedText();
+        if (store.usedBytes() > 0) {
+            char text[48];
+            snprintf(text, sizeof(text), "\nLZ4 %.1fx, chapter switch %.1fms",
+                     (double)store.originalBytes() / store.usedBytes(), ticksAsMilliseconds(chapterSwitchTicks));
+            heading += text;
+        }
+        return heading;
+    };
+
+    // Moves to the nearest chapter in the given direction that has any text, so
+    // image-only pages such as covers don't show up as blank screens.
+    auto loadChapter = [&](size_t index, int direction) -> bool {
+        while (index < book.chapterCount()) {
+            u64 fetchStart = clockTicks();
+            shared_ptr<const Chapter> candidate = book.chapter(index);
+            chapterSwitchTicks = clockTicks() - fetchStart;
+            if (!candidate->lineStarts.empty()) {
+                chapterIndex = index;
+                chapter = candidate;
+                if (direction < 0) pages.resetAtEnd(chapter->text, chapter->lineStarts, currentSettings.pageSize, pageTextRows);
+                else pages.reset(chapter->text, chapter->lineStarts, currentSettings.pageSize, pageTextRows, 0);
+                return true;
+            }
+            if (direction < 0 && index == 0) break;
+            index += direction;
+        }
+        return false;
+    };
+
+    // The current page and the ones either side of it are kept drawn in page
+    // images. Idle frames draw the neighbours, so turning to one only copies
+    // its pixels and brings the footer up to date.
+    vector<PageImageKey> imageKeys(pageImageCount, noPageImage);
+    size_t lastReplacedImage = 0;
+    bool neighboursDrawn = false; // both neighbours have images, or can't have one yet
+    int lastTurn = 1;
+
+    auto pageKey = [&](size_t index, const PageIndex& at) -> PageImageKey {
+        PageImageKey key = { index, at.firstLine(), at.endLine() };
+        return key;
+    };
+
+    auto currentPageKey = [&]() -> PageImageKey {
+        return pageKey(chapterIndex, pages);
+    };
+
+    auto imageOf = [&](const PageImageKey& key) -> size_t {
+        return find(imageKeys.begin(), imageKeys.end(), key) - imageKeys.begin();
+    };
+
+    auto drawPageImage = [&](size_t slot, size_t index, const Chapter& text, const PageIndex& at) {
+        beginPageImage(slot);
+        drawPage(text, at, positionText());
+        endPageImage();
+        imageKeys[slot] = pageKey(index, at);
+    };
+
+    // Runs action on the page one step in direction. Within the chapter that
+    // is a step of pages and back. Past its end it is the first or last page
+    // of the next chapter with text, laid out in a page index of its own, and
+    // only if that chapter and every image-only one skipped on the way are
+    // already decoded: drawing ahead never waits on the loader, and looking
+    // doesn't touch the cache's eviction order.
+    PageIndex neighbourPages;
+    typedef function<void(size_t index, const Chapter& text, const PageIndex& at)> PageAction;
+    auto atNeighbour = [&](int direction, const PageAction& action) -> bool {
+        if (direction > 0 ? pages.nextPage() : pages.previousPage()) {
+            action(chapterIndex, *chapter, pages);
+            if (direction > 0) pages.previousPage();
+            else pages.nextPage();
+            return true;
+        }
 
-                fileContent = decodeHtmlEntities(fileContent);
+        size_t index = chapterIndex + direction;
+        shared_ptr<const Chapter> next;
+        for (; index < book.chapterCount(); index += direction) {
+            next = book.decodedChapter(index);
+            if (!next) return false;
+            if (!next->lineStarts.empty()) break;
+        }
+        if (index >= book.chapterCount()) return false;
 
-                XMLDocument doc;
-                string extractedText;
-                if (doc.Parse(fileContent.c_str()) == XML_SUCCESS) {
-                    if (XMLElement* body = doc.FirstChildElement("html")->FirstChildElement("body")) {
-                        extractText(body, extractedText);
-                        fullBookText += extractedText + "\n\n"; // Append text with separators
-                    }
-                }
-                break; 
+        if (direction < 0) neighbourPages.resetAtEnd(next->text, next->lineStarts, currentSettings.pageSize, pageTextRows);
+        else neighbourPages.reset(next->text, next->lineStarts, currentSettings.pageSize, pageTextRows, 0);
+        action(index, *next, neighbourPages);
+        return true;
+    };
+
+    // Draws one missing neighbour, the one in the direction last turned
+    // first, into an image holding neither the current page nor the other
+    // neighbour. Returns false once there was nothing left to draw.
+    auto drawNeighbour = [&]() -> bool {
+        PageImageKey keep[3] = { currentPageKey(), noPageImage, noPageImage };
+        atNeighbour(1, [&](size_t index, const Chapter&, const PageIndex& at) { keep[1] = pageKey(index, at); });
+        atNeighbour(-1, [&](size_t index, const Chapter&, const PageIndex& at) { keep[2] = pageKey(index, at); });
+
+        for (int direction : { lastTurn, -lastTurn }) {
+            const PageImageKey& key = keep[direction > 0 ? 1 : 2];
+            if (key == noPageImage || imageOf(key) < pageImageCount) continue;
+            // An empty slot is free even when keep holds noPageImage for a
+            // missing neighbour.
+            size_t slot = 0;
+            while (!(imageKeys[slot] == noPageImage) && find(keep, keep + 3, imageKeys[slot]) != keep + 3) slot++;
+            atNeighbour(direction, [&](size_t index, const Chapter& text, const PageIndex& at) {
+                drawPageImage(slot, index, text, at);
+            });
+            return true;
+        }
+        return false;
+    };
+
+    // Shows the current page from its image, drawing it there first if it
+    // wasn't drawn ahead. The footer is redrawn on top, since the book may
+    // have loaded further since the image was made.
+    auto showPage = [&]() {
+        size_t slot = imageOf(currentPageKey());
+        if (slot == pageImageCount) {
+            slot = imageOf(noPageImage);
+            if (slot == pageImageCount) slot = lastReplacedImage = (lastReplacedImage + 1) % pageImageCount;
+            drawPageImage(slot, chapterIndex, *chapter, pages);
+        }
+        showPageImage(slot);
+        drawPageFooter(positionText());
+        presentFrame();
+        neighboursDrawn = false;
+    };
+
+    // Page of a search hit within the whole book, counted the way the footer
+    // does. -1 while a chapter before it hasn't been measured: the index can
+    // come from the disk cache ahead of the chapters. Only line lengths are
+    // read, so no chapter is decoded for this.
+    auto pageOfHit = [&](const SearchHit& hit) -> long {
+        if (!book.isMeasured(hit.spineIndex)) return -1;
+
+        size_t before = 0;
+        for (size_t i = 0; i < hit.spineIndex; i++) {
+            if (!book.isMeasured(i)) return -1;
+            if (chapterPages[i] < 0) {
+                chapterPages[i] = (long)countPages(book.lineLengths(i), currentSettings.pageSize, pageTextRows);
             }
-            archive_read_data_skip(a);
+            before += chapterPages[i];
         }
+        size_t pageStart = 0;
+        return (long)(before + pageOfLine(book.lineLengths(hit.spineIndex), currentSettings.pageSize, pageTextRows,
+                                          hit.line, pageStart));
+    };
+
+    // Opens a chapter on the page that holds the given text offset. Only that
+    // chapter is decoded, and only the page itself is laid out.
+    auto goToOffset = [&](size_t index, size_t offset) -> bool {
+        shared_ptr<const Chapter> candidate = book.chapter(index);
+        if (candidate->lineStarts.empty()) return false;
+        chapterIndex = index;
+        chapter = candidate;
+        size_t line = lineOfOffset(chapter->lineStarts, offset);
+        size_t pageStart = 0;
+        pageOfLine(book.lineLengths(index), currentSettings.pageSize, pageTextRows, line, pageStart);
+        pages.reset(chapter->text, chapter->lineStarts, currentSettings.pageSize, pageTextRows, pageStart);
+        book.prefetchAround(chapterIndex);
+        return true;
+    };
+
+    auto goToHit = [&](const SearchHit& hit) {
+        goToOffset(hit.spineIndex, hit.offset);
+    };
+
+    // The last entry at or before the top of the page, so the list opens
+    // where the reader is.
+    auto currentContentsEntry = [&]() -> size_t {
+        size_t here = chapter->lineStarts[pages.firstLine()];
+        size_t current = 0;
+        for (size_t i = 0; i < book.contents().size(); i++) {
+            const TocEntry& entry = book.contents()[i];
+            size_t offset = 0; // chapters not decoded yet count from their start
+            book.contentsOffset(i, offset);
+            if (entry.spineIndex < chapterIndex || (entry.spineIndex == chapterIndex && offset <= here)) current = i;
+        }
+        return current;
+    };
+
+    // A chapter not decoded yet is fetched on its own, ahead of the
+    // background pass; its anchors come with it. Entries pointing at an
+    // image-only page open the next chapter with text instead.
+    auto showContents = [&]() {
+        useListKeyRepeat();
+        size_t picked = 0;
+        if (pickContentsEntry(book.contents(), currentContentsEntry(), picked)) {
+            const TocEntry& entry = book.contents()[picked];
+            size_t offset = 0;
+            if (!book.contentsOffset(picked, offset)) {
+                book.chapter(entry.spineIndex);
+                if (!book.contentsOffset(picked, offset)) offset = 0;
+            }
+            if (!goToOffset(entry.spineIndex, offset) && loadChapter(entry.spineIndex, 1)) {
+                book.prefetchAround(chapterIndex);
+            }
+        }
+        usePageKeyRepeat();
+        showPage();
+    };
+
+    auto runSearch = [&]() {
+        string query;
+        vector<SearchHit> hits;
+        if (book.searchSkipped()) {
+            clearScreen();
+            screenPrint("This book is too large to search.\n");
+            waitForBackButton();
+        }
+        else if (!book.searchReady()) {
+            clearScreen();
+            screenPrint("Search is available once the whole book\nhas been indexed (%zu/%zu chapters).\n",
+                        book.indexedCount(), book.chapterCount());
+            waitForBackButton();
+        }
+        else if (askSearchQuery(query, "Find in book")) {
+            if (!book.search(query, hits, maxSearchHits, searchSnippetLead, WORD_WRAP_WIDTH)) {
+                clearScreen();
+                screenPrint("Search for at least %zu letters or digits.\n", SearchIndex::minQueryLength);
+                waitForBackButton();
+            }
+            else {
+                size_t picked = 0;
+                if (pickSearchHit(query, hits, pageOfHit, picked)) goToHit(hits[picked]);
+            }
+        }
+        showPage();
+    };
+
+    // Re-flows the chapter around the line at the top of the screen, so a new
+    // page size keeps the same passage in view. Only this page is laid out
+    // now; the others follow a few per frame in the loop below.
+    auto changePageSize = [&](size_t newPageSize) {
+        currentSettings.pageSize = newPageSize;
+        pages.reset(chapter->text, chapter->lineStarts, currentSettings.pageSize, pageTextRows, pages.firstLine());
+        chapterPages.assign(book.chapterCount(), -1);
+        showPage();
+    };
+
+    if (!(resuming && goToOffset(resume.spineIndex, resume.offset)) && !loadChapter(0, 1)) {
+        clearScreen();
+        screenPrint("No readable text found in this EPUB.\n");
+        waitForBackButton();
+        return;
     }
-    archive_read_free(a);
 
-    // --- Now, handle the combined text just like you did for a single chapter ---
-
-    string wrappedFullText = wordWrap(fullBookText, WORD_WRAP_WIDTH);
-    vector<string> pages = paginateFile(wrappedFullText, currentSettings.pageSize);
-    int currentPage = 0;
-    
-    displayPage(pages, currentPage);
-    while (aptMainLoop()) {
-        hidScanInput();
-        u32 kdown = hidKeysDown();
+    showPage();
+    firstPageTime = max<u64>(clockMilliseconds() - openStart, 1);
+    drawProfileOverlay(profileHeading());
+    if (!resuming) book.prefetchAround(chapterIndex);
+    usePageKeyRepeat();
+    while (platformRunning()) {
+        scanInput();
+        u32 kdown = keysDown();
+        u32 turn = keysDownRepeat() & (KEY_L | KEY_R);
 
         if (kdown & KEY_B) {
             saveSettings(currentSettings);
+            ReadingPosition position = { chapterIndex, chapter->lineStarts[pages.firstLine()] };
+            positions.set(epubPath, position);
+            if (createSettingsDirRecursive()) positions.save(storagePath(readingPositionsPath).c_str());
+            // Loader threads hand in their read counts when they stop.
+            book.stopLoading();
+            logProfile(string(epubPath) + ": " + statusText() + ", " + readStatsText(book.readStats()));
+            useListKeyRepeat();
             break;
         }
-        if ((kdown & KEY_L) && currentPage > 0) {
-            currentPage--;
-            displayPage(pages, currentPage);
+#ifdef EREADER_PROFILE
+        if (kdown & KEY_SELECT) {
+            profileOverlayVisible = !profileOverlayVisible;
+            drawProfileOverlay(profileHeading());
+        }
+#endif
+        if (kdown & KEY_X) {
+            runSearch();
+        }
+        if (kdown & KEY_Y) {
+            showContents();
         }
-        if ((kdown & KEY_R) && currentPage < (int)pages.size() - 1) {
-            currentPage++;
-            displayPage(pages, currentPage);
+        if (turn & KEY_L) {
+            lastTurn = -1;
+            if (pages.previousPage()) {
+                showPage();
+            }
+            else if (chapterIndex > 0 && loadChapter(chapterIndex - 1, -1)) {
+                showPage();
+                book.prefetchAround(chapterIndex);
+            }
+        }
+        if (turn & KEY_R) {
+            lastTurn = 1;
+            if (pages.nextPage()) {
+                showPage();
+            }
+            else if (loadChapter(chapterIndex + 1, 1)) {
+                showPage();
+                book.prefetchAround(chapterIndex);
+            }
         }
         
         if (kdown & (KEY_UP | KEY_CPAD_UP)) {
             if (currentSettings.pageSize < maxPageSize) {
-                currentSettings.pageSize = min(maxPageSize, currentSettings.pageSize + pageSizeStep);
-                pages = paginateFile(wrappedFullText, currentSettings.pageSize);
-                if (currentPage >= (int)pages.size()) currentPage = (int)pages.size() - 1;
-                if (currentPage < 0) currentPage = 0;
-                displayPage(pages, currentPage);
+                changePageSize(min(maxPageSize, currentSettings.pageSize + pageSizeStep));
             }
         }
         if (kdown & (KEY_DOWN | KEY_CPAD_DOWN)) {
             if (currentSettings.pageSize > minPageSize) {
-                currentSettings.pageSize = max(minPageSize, currentSettings.pageSize - pageSizeStep);
-                pages = paginateFile(wrappedFullText, currentSettings.pageSize);
-                if (currentPage >= (int)pages.size()) currentPage = (int)pages.size() - 1;
-                if (currentPage < 0) currentPage = 0;
-                displayPage(pages, currentPage);
+                changePageSize(max(minPageSize, currentSettings.pageSize - pageSizeStep));
             }
         }
-        
-        gspWaitForVBlank();
+
+        // Spare time in the frame finishes paginating the chapter and takes in
+        // chapters from the worker; only the footer changes.
+        bool footerChanged = false;
+        if (!pages.complete() && pages.extend(pagesPerFrame)) footerChanged = true;
+        if (book.poll() > 0) {
+            footerChanged = true;
+            neighboursDrawn = false; // the next chapter may have arrived
+        }
+        if (fullyLoadedTime == 0 && book.loadedCount() == book.chapterCount()) {
+            fullyLoadedTime = max<u64>(clockMilliseconds() - openStart, 1);
+            footerChanged = true;
+        }
+        if (footerChanged) {
+            drawPageFooter(positionText());
+            drawProfileOverlay(profileHeading());
+            presentFrame();
+        }
+        // A frame that turned has done its drawing; the others get the
+        // next page ready, one image at a time.
+        if (!turn && !neighboursDrawn) neighboursDrawn = !drawNeighbour();
+
+        waitForFrame();
+    }
+}
+
+// Lists the books matching a library search and opens the one picked with A.
+// Returns when B is pressed.
+void showLibraryResults(const string& query, const vector<LibrarySearchResult>& results, u64 elapsed) {
+    const size_t visibleRows = 25;
+    size_t selected = 0;
+    size_t firstRow = 0;
+    bool needsRedraw = true;
+    while (platformRunning()) {
+        if (needsRedraw) {
+            if (selected < firstRow) firstRow = selected;
+            if (selected >= firstRow + visibleRows) firstRow = selected - visibleRows + 1;
+
+            clearScreen();
+            screenPrint("\"%.30s\": %zu book%s%s, %llu ms\n\n", query.c_str(), results.size(),
+                        results.size() == 1 ? "" : "s", results.size() >= maxLibraryResults ? " (first ones)" : "",
+                        (unsigned long long)elapsed);
+            if (results.empty()) screenPrint("Nothing found.\n");
+            for (size_t row = firstRow; row < results.size() && row < firstRow + visibleRows; row++) {
+                const LibrarySearchResult& result = results[row];
+                string name = result.title;
+                if (name.empty()) name = result.path.substr(result.path.find_last_of('/') + 1);
+                if (!result.author.empty()) name += " - " + result.author;
+                screenPrint("%s%.*s\n", row == selected ? " > " : "   ", (int)(WORD_WRAP_WIDTH - 4), name.c_str());
+            }
+            screenPrint("\x1b[30;1HA: Open | B: Back | Up/Down: Select");
+            presentFrame();
+            needsRedraw = false;
+        }
+
+        scanInput();
+        u32 kdown = keysDown();
+        if (kdown & KEY_B) return;
+        if ((kdown & KEY_A) && !results.empty()) {
+            readAndDisplayBook(results[selected].path.c_str());
+            needsRedraw = true;
+        }
+        if ((kdown & (KEY_DOWN | KEY_CPAD_DOWN)) && selected + 1 < results.size()) {
+            selected++;
+            needsRedraw = true;
+        }
+        if ((kdown & (KEY_UP | KEY_CPAD_UP)) && selected > 0) {
+            selected--;
+            needsRedraw = true;
+        }
+        waitForFrame();
+    }
+}
+
+// Brings the library search index up to date with the books on the card,
+// then asks for words to look for. Indexing can be stopped with B; books
+// indexed so far are kept and the rest are picked up next time.
+void searchLibrary(const map<string, vector<string>>& ePubsByDirectory) {
+    vector<string> paths;
+    for (const auto& entry : ePubsByDirectory) {
+        for (const string& name : entry.second) paths.push_back(entry.first + "/" + name);
+    }
+
+    LibrarySearch index(storagePath(librarySearchDir));
+    index.load();
+
+    clearScreen();
+    screenPrint("Checking library search index...\n");
+    presentFrame();
+
+    createSettingsDirRecursive();
+    bool updated = index.update(paths, [](size_t done, size_t total, const string& path) {
+        clearScreen();
+        screenPrint("Indexing books for search: %zu/%zu\n\n%.48s\n", done + 1, total,
+                    path.substr(path.find_last_of('/') + 1).c_str());
+        screenPrint("\x1b[30;1HB: Stop and search what's indexed");
+        presentFrame();
+        scanInput();
+        return !(keysHeld() & KEY_B);
+    });
+    if (!updated) {
+        clearScreen();
+        screenPrint("Couldn't update the search index:\n%s\n", index.error().c_str());
+        waitForBackButton();
+        return;
     }
+
+    string query;
+    if (!askSearchQuery(query, "Find in library")) return;
+
+    vector<LibrarySearchResult> results;
+    u64 start = clockMilliseconds();
+    index.search(query, results, maxLibraryResults);
+    showLibraryResults(query, results, clockMilliseconds() - start);
 }
 
 void displaySettingsMenu() {
     int selectedSetting = 0;
-    const int numSettings = 2;
+    const int numSettings = 3;
     bool needsRedraw = true; 
 
-    while (aptMainLoop()) {
+    while (platformRunning()) {
         if (needsRedraw) {
-            consoleClear();
-            printf("--- Settings ---\n\n");
+            clearScreen();
+            screenPrint("--- Settings ---\n\n");
 
-            printf("%s Page Size: %zu\n",
-                   (selectedSetting == 0 ? ">" : " "),
-                   currentSettings.pageSize);
+            screenPrint("%s Page Size: %zu\n",
+                        (selectedSetting == 0 ? ">" : " "),
+                        currentSettings.pageSize);
 
-            printf("%s Text Color: %s\n",
-                   (selectedSetting == 1 ? ">" : " "),
-                   getColourName(currentSettings.currentTextColor).c_str());
+            screenPrint("%s Text Color: %s\n",
+                        (selectedSetting == 1 ? ">" : " "),
+                        getColourName(currentSettings.currentTextColor).c_str());
 
-            printf("\n\nUse D-Pad UP/DOWN to select.\n");
-            printf("Use D-Pad LEFT/RIGHT to change value.\n");
-            printf("L/R buttons for large page size adjustment.\n");
-            printf("B to save and go back.\n");
+            screenPrint("%s Held L/R: %zu pages/s\n",
+                        (selectedSetting == 2 ? ">" : " "),
+                        currentSettings.pageFlipRate);
 
-            gfxFlushBuffers();
-            gfxSwapBuffers();
+            screenPrint("\n\nUse D-Pad UP/DOWN to select.\n");
+            screenPrint("Use D-Pad LEFT/RIGHT to change value.\n");
+            screenPrint("L/R buttons for large page size adjustment.\n");
+            screenPrint("B to save and go back.\n");
+
+            presentFrame();
             needsRedraw = false;
         }
 
-        hidScanInput();
-        u32 kDown = hidKeysDown();
+        scanInput();
+        u32 kDown = keysDown();
 
         if (kDown & KEY_B) {
             saveSettings(currentSettings);
@@ -568,200 +1166,266 @@ void displaySettingsMenu() {
                 currentSettings.currentTextColor = (Colour)((currentSettings.currentTextColor - 1 + (CYAN + 1)) % (CYAN + 1));
                 needsRedraw = true;
             }
+        } else if (selectedSetting == 2) { // Page turns a second while L/R is held
+            if ((kDown & (KEY_DLEFT | KEY_CPAD_LEFT)) && currentSettings.pageFlipRate > minPageFlipRate) {
+                currentSettings.pageFlipRate--;
+                needsRedraw = true;
+            }
+            if ((kDown & (KEY_DRIGHT | KEY_CPAD_RIGHT)) && currentSettings.pageFlipRate < maxPageFlipRate) {
+                currentSettings.pageFlipRate++;
+                needsRedraw = true;
+            }
         }
 
-        gspWaitForVBlank();
+        waitForFrame();
     }
 }
 
-void drawDirectoryMenu(const std::vector<std::string>& dirs, int selectedIndex) {
-    consoleClear();
-    printf("Select a Directory:\n\n");
+bool lessIgnoringCase(const string& a, const string& b) {
+    return lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(), [](char x, char y) {
+        return toupper((unsigned char)x) < toupper((unsigned char)y);
+    });
+}
 
-    for (size_t i = 0; i < dirs.size(); i++) {
-        std::string displayName = dirs[i];
-        if (dirs[i] == "sdmc:/ebooks") {
-            displayName = "Root 'ebooks' Folder";
-        } else {
-            size_t lastSlash = dirs[i].find_last_of('/');
-            if (lastSlash != std::string::npos) {
-                displayName = dirs[i].substr(lastSlash + 1);
-            }
-        }
-        
-        if ((int)i == selectedIndex) {
-            printf(" > %s\n", displayName.c_str());
-        } else {
-            printf("   %s\n", displayName.c_str());
-        }
+string directoryDisplayName(const std::string& path) {
+    if (path == storagePath(ebookRoot)) return "Root 'ebooks' Folder";
+    size_t lastSlash = path.find_last_of('/');
+    return lastSlash == std::string::npos ? path : path.substr(lastSlash + 1);
+}
+
+const size_t directoryRows = 22;
+
+// Folders in the order they are listed: by shown name, ignoring case
+std::vector<std::string> sortedDirectories(const std::map<std::string, std::vector<std::string>>& ePubsByDirectory) {
+    std::vector<std::string> directories;
+    for (const auto& pair : ePubsByDirectory) {
+        directories.push_back(pair.first);
     }
+    sort(directories.begin(), directories.end(), [](const std::string& a, const std::string& b) {
+        return lessIgnoringCase(directoryDisplayName(a), directoryDisplayName(b));
+    });
+    return directories;
+}
 
-    printf("\nUse D-Pad to navigate.\n");
-    printf("A: Select | START: Exit | SELECT: Settings\n");
+void drawDirectoryMenu(const ListWindow& list, const std::vector<std::string>& dirs, const std::string& status) {
+    clearScreen();
+    screenPrint("Select a Directory: (%zu)\n", dirs.size());
+    drawListWindow(list, [&](size_t i) { return directoryDisplayName(dirs[i]); });
+
+    screenPrint("\x1b[26;1HUp/Down: Move | L/R: Page | Left/Right: Letter\n");
+    screenPrint("A: Select | START: Exit | SELECT: Settings\n");
+    screenPrint("X: Search library | Y: Rescan library\n");
+    screenPrint("\x1b[30;1H%s", status.c_str());
 }
 
-void drawBookList(const std::string& dirName, const std::vector<std::string>& books, int selectedIndex) {
-    consoleClear();
-    
-    std::string displayName = dirName;
-    if (dirName == "sdmc:/ebooks") {
-        displayName = "Root 'ebooks' Folder";
-    } else {
-        size_t lastSlash = dirName.find_last_of('/');
-        if (lastSlash != std::string::npos) {
-            displayName = dirName.substr(lastSlash + 1);
-        }
-    }
-    printf("Directory: %s\n\n", displayName.c_str());
+const size_t bookRows = 24;
 
-    if (books.empty()) {
-        printf("No books found in this directory.\n");
+// Title and author where the metadata is known, otherwise the file name
+string bookLabel(const BookMetadata* known, const std::string& name) {
+    if (!known || known->title.empty()) return name;
+    return known->author.empty() ? known->title : known->title + " - " + known->author;
+}
+
+struct ListedBook {
+    std::string name;
+    std::string order; // the label it had when the folder was opened
+    std::string label; // what its row shows
+};
+
+// By the label on opening the folder, then by file name for books with the same one.
+bool listedBefore(const ListedBook& a, const ListedBook& b) {
+    if (lessIgnoringCase(a.order, b.order)) return true;
+    if (lessIgnoringCase(b.order, a.order)) return false;
+    return lessIgnoringCase(a.name, b.name);
+}
+
+void drawBookList(const ListWindow& list, const std::string& dirPath, size_t bookCount,
+                  const function<string(size_t)>& labelOf) {
+    clearScreen();
+    screenPrint("Directory: %.30s (%zu)\n", directoryDisplayName(dirPath).c_str(), bookCount);
+
+    if (bookCount == 0) {
+        screenPrint("\nNo books found in this directory.\n");
     } else {
-        for (size_t i = 0; i < books.size(); i++) {
-            if ((int)i == selectedIndex) {
-                printf(" > %s\n", books[i].c_str());
-            } else {
-                printf("   %s\n", books[i].c_str());
-            }
-        }
+        drawListWindow(list, labelOf);
     }
 
-    printf("\nUse D-Pad to navigate books.\n");
-    printf("A: Select Book | B: Back to Directories\n");
+    screenPrint("\x1b[28;1HUp/Down: Move | L/R: Page | Left/Right: Letter\n");
+    screenPrint("A: Select Book | B: Back to Directories\n");
 }
 
-void displayBookMenu(const std::string& dirPath, const std::vector<std::string>& books) {
-    int selectedBook = 0;
+// Books are listed, and jumped through by letter, case-insensitively by
+// title and author as saved in the metadata cache, the file name otherwise.
+// Nothing is stat'ed or read to list them, and the order stays as it is
+// while the folder is open. Rows in view are then checked one book per
+// frame: a stat, and for a book changed or not read before, its OPF. A label
+// that comes out different is filled in where the row is.
+void displayBookMenu(const std::string& dirPath, const std::vector<std::string>& bookNames, BookMetadataCache& metadata) {
+    std::vector<ListedBook> books;
+    for (const std::string& name : bookNames) {
+        std::string label = bookLabel(metadata.saved(dirPath + "/" + name), name);
+        ListedBook book = { name, label, label };
+        books.push_back(book);
+    }
+    sort(books.begin(), books.end(), listedBefore);
+
+    ListWindow list = { books.size(), 0, 0, 3, bookRows };
+    auto labelOf = [&](size_t i) { return books[i].label; };
+    auto initial = [&](size_t i) { return initialOf(books[i].order); };
     bool needsRedraw = true;
 
-    while (aptMainLoop()) {
+    while (platformRunning()) {
         if (needsRedraw) {
-            drawBookList(dirPath, books, selectedBook);
-            gfxFlushBuffers();
-            gfxSwapBuffers();
+            drawBookList(list, dirPath, books.size(), labelOf);
+            presentFrame();
             needsRedraw = false;
         }
 
-        hidScanInput();
-        u32 kDown = hidKeysDown();
+        scanInput();
+        u32 kDown = keysDown();
 
         if (kDown & KEY_B) {
             break; 
         }
 
-        if (kDown & (KEY_DOWN | KEY_CPAD_DOWN)) {
-            if (!books.empty()) {
-                selectedBook = (selectedBook + 1) % books.size();
-                needsRedraw = true;
-            }
-        }
-
-        if (kDown & (KEY_UP | KEY_CPAD_UP)) {
-            if (!books.empty()) {
-                selectedBook = (selectedBook - 1 + books.size()) % books.size();
-                needsRedraw = true;
-            }
+        if (moveListCursor(list, keysDownRepeat(), initial, labelOf)) {
+            presentFrame();
         }
 
         if (kDown & KEY_A) {
             if (!books.empty()) {
-                std::string path = dirPath + "/" + books[selectedBook];
+                std::string path = dirPath + "/" + books[list.selected].name;
                 readAndDisplayBook(path.c_str()); // <-- Changed to call the new function
                 needsRedraw = true; 
             }
         }
+
+        for (size_t i = list.first; i < list.count && i < list.first + list.rows; i++) {
+            std::string path = dirPath + "/" + books[i].name;
+            if (metadata.checked(path)) continue;
+            const BookMetadata* known = metadata.find(path);
+            std::string label = bookLabel(known ? known : &metadata.read(path), books[i].name);
+            if (label != books[i].label) {
+                books[i].label = label;
+                drawListRow(list, i, label);
+                presentFrame();
+            }
+            break;
+        }
         
-        gspWaitForVBlank();
+        waitForFrame();
     }
+
+    if (metadata.changed() && createSettingsDirRecursive()) metadata.save(storagePath(bookMetadataPath).c_str());
 }
 
 
 int main(int argc, char** argv) {
-    gfxInitDefault();
-    consoleInit(GFX_TOP, NULL);
+#ifdef EREADER_PROFILE
+    const bool bottomScreen = true;
+#else
+    const bool bottomScreen = false;
+#endif
+    if (!platformInit(argc, argv, bottomScreen)) return 1;
 
     loadSettings(currentSettings);
 
-    const char* ebookDir = "sdmc:/ebooks";
+    const std::string ebookPath = storagePath(ebookRoot);
+    const char* ebookDir = ebookPath.c_str();
 
     if (!DirExists(ebookDir)) {
-        consoleClear();
-        printf("Directory '%s' not found.\n", ebookDir);
-        printf("Please create an 'ebooks' folder on the root of your SD card.\n");
-        printf("\nPress START to exit.\n");
-        while (aptMainLoop()) {
-            hidScanInput();
-            if (hidKeysDown() & KEY_START) break;
-            gspWaitForVBlank();
-        }
-        gfxExit();
+        clearScreen();
+        screenPrint("Directory '%s' not found.\n", ebookDir);
+        screenPrint("Please create an 'ebooks' folder on the root of your SD card.\n");
+        screenPrint("\nPress START to exit.\n");
+        while (platformRunning()) {
+            scanInput();
+            if (keysDown() & KEY_START) break;
+            waitForFrame();
+        }
+        platformExit();
         return 0;
     }
 
-    std::map<std::string, std::vector<std::string>> ePubsByDirectory;
-    recursiveSearchEPub(ebookDir, ePubsByDirectory);
+    std::string scanStatus;
+    std::map<std::string, std::vector<std::string>> ePubsByDirectory = scanLibrary(ebookDir, false, scanStatus);
     
     if (ePubsByDirectory.empty()) {
-        consoleClear();
-        printf("No .epub files found in '%s' or its subdirectories.\n", ebookDir);
-        printf("\nPress START to exit.\n");
-        while (aptMainLoop()) {
-            hidScanInput();
-            if (hidKeysDown() & KEY_START) break;
-            gspWaitForVBlank();
-        }
-        gfxExit();
+        clearScreen();
+        screenPrint("No .epub files found in '%s' or its subdirectories.\n", ebookDir);
+        screenPrint("\nPress START to exit.\n");
+        while (platformRunning()) {
+            scanInput();
+            if (keysDown() & KEY_START) break;
+            waitForFrame();
+        }
+        platformExit();
         return 0;
     }
     
-    std::vector<std::string> directories;
-    for (const auto& pair : ePubsByDirectory) {
-        directories.push_back(pair.first);
-    }
-    std::sort(directories.begin(), directories.end());
+    std::vector<std::string> directories = sortedDirectories(ePubsByDirectory);
 
-    int selectedDir = 0;
-    
-    drawDirectoryMenu(directories, selectedDir);
-    gfxFlushBuffers();
-    gfxSwapBuffers();
+    BookMetadataCache bookMetadata;
+    bookMetadata.load(storagePath(bookMetadataPath).c_str());
+    useListKeyRepeat();
+
+    ListWindow dirList = { directories.size(), 0, 0, 3, directoryRows };
+    auto dirLabel = [&](size_t i) { return directoryDisplayName(directories[i]); };
+    auto dirInitial = [&](size_t i) { return initialOf(directoryDisplayName(directories[i])); };
 
-    while (aptMainLoop()) {
-        hidScanInput();
-        u32 kDown = hidKeysDown();
+    drawDirectoryMenu(dirList, directories, scanStatus);
+    presentFrame();
+
+    while (platformRunning()) {
+        scanInput();
+        u32 kDown = keysDown();
 
         bool needsRedraw = false;
 
         if (kDown & KEY_START) break;
 
-        if (kDown & (KEY_DOWN | KEY_CPAD_DOWN)) {
-            selectedDir = (selectedDir + 1) % directories.size();
-            needsRedraw = true;
-        }
-        if (kDown & (KEY_UP | KEY_CPAD_UP)) {
-            selectedDir = (selectedDir - 1 + directories.size()) % directories.size();
-            needsRedraw = true;
+        if (moveListCursor(dirList, keysDownRepeat(), dirInitial, dirLabel)) {
+            presentFrame();
         }
         if (kDown & KEY_A) {
-            const std::string& selectedDirPath = directories[selectedDir];
+            const std::string& selectedDirPath = directories[dirList.selected];
             const std::vector<std::string>& booksInDir = ePubsByDirectory.at(selectedDirPath);
-            displayBookMenu(selectedDirPath, booksInDir);
+            displayBookMenu(selectedDirPath, booksInDir, bookMetadata);
             needsRedraw = true;
         }
         if (kDown & KEY_SELECT) {
             displaySettingsMenu();
             needsRedraw = true;
         }
+        if (kDown & KEY_X) {
+            searchLibrary(ePubsByDirectory);
+            needsRedraw = true;
+        }
+        if (kDown & KEY_Y) {
+            // Some SD cards don't update folder times, so offer a full rescan by hand
+            clearScreen();
+            screenPrint("Rescanning library...\n");
+            presentFrame();
+
+            std::map<std::string, std::vector<std::string>> rescanned = scanLibrary(ebookDir, true, scanStatus);
+            if (!rescanned.empty()) {
+                ePubsByDirectory.swap(rescanned);
+                directories = sortedDirectories(ePubsByDirectory);
+                dirList.count = directories.size();
+                dirList.selected = 0;
+                dirList.first = 0;
+            }
+            needsRedraw = true;
+        }
 
         if (needsRedraw) {
-            drawDirectoryMenu(directories, selectedDir);
-            gfxFlushBuffers();
-            gfxSwapBuffers();
+            drawDirectoryMenu(dirList, directories, scanStatus);
+            presentFrame();
         }
         
-        gspWaitForVBlank();
+        waitForFrame();
     }
 
-    gfxExit();
+    platformExit();
     return 0;
 }
\ No newline at end of file
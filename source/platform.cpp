@@ -0,0 +1,596 @@
+#include "platform.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+#ifndef __3DS__
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <thread>
+#endif
+
+#include "glyph_atlas.h"
+#include "text_screen.h"
+
+using namespace std;
+
+namespace {
+
+// Both screens keep the 8x8 cell grid of the libctru console they replace.
+const int topScreenWidth = 400;
+const int bottomScreenWidth = 320;
+const int screenHeight = 240;
+const int cellSize = 8;
+const size_t framebufferCount = 2;
+
+GlyphAtlas atlas;
+TextScreen topScreen(topScreenWidth / cellSize, screenHeight / cellSize, framebufferCount);
+TextScreen bottomScreen(bottomScreenWidth / cellSize, screenHeight / cellSize, framebufferCount);
+bool hasBottomScreen = false;
+bool screenChanged = true; // since the last presentFrame()
+size_t backBuffer = 0;     // the framebuffer drawn into next
+
+// Printing goes to pageImages[drawingImage] while one is being drawn. The
+// pixels are laid out like the top framebuffer and allocated on first use.
+vector<TextScreen> pageImages(pageImageCount, TextScreen(topScreenWidth / cellSize, screenHeight / cellSize, 1));
+vector<uint16_t> pageImagePixels[pageImageCount];
+size_t drawingImage = pageImageCount;
+
+void writeToScreen(const char* text, size_t length);
+Surface topScreenSurface(uint16_t* pixels);
+uint16_t* topBackBuffer();
+
+// Where printed text goes: a page image being drawn, or the top screen.
+void writeText(const char* text, size_t length) {
+    if (drawingImage < pageImageCount) {
+        pageImages[drawingImage].write(text, length);
+        return;
+    }
+    topScreen.write(text, length);
+    screenChanged = true;
+}
+
+}
+
+void screenPrint(const char* format, ...) {
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (length < 0) return;
+    if ((size_t)length < sizeof(buffer)) {
+        writeToScreen(buffer, length);
+        return;
+    }
+
+    vector<char> text(length + 1);
+    va_start(args, format);
+    vsnprintf(text.data(), text.size(), format, args);
+    va_end(args);
+    writeToScreen(text.data(), length);
+}
+
+void clearScreen() {
+    writeToScreen("\x1b[2J", 4);
+}
+
+void beginPageImage(size_t slot) {
+    if (slot >= pageImageCount) return;
+    if (pageImagePixels[slot].empty()) pageImagePixels[slot].assign((size_t)topScreenWidth * screenHeight, 0);
+    drawingImage = slot;
+}
+
+void endPageImage() {
+    if (drawingImage >= pageImageCount) return;
+    pageImages[drawingImage].present(atlas, topScreenSurface(pageImagePixels[drawingImage].data()), 0);
+    drawingImage = pageImageCount;
+}
+
+void showPageImage(size_t slot) {
+    if (slot >= pageImageCount || pageImagePixels[slot].empty()) return;
+    const vector<uint16_t>& pixels = pageImagePixels[slot];
+    copy(pixels.begin(), pixels.end(), topBackBuffer());
+    topScreen.adopt(pageImages[slot], 0, backBuffer);
+    screenChanged = true;
+}
+
+void drawBottomScreen(const string& text) {
+    if (!hasBottomScreen) return;
+    bottomScreen.clear();
+    bottomScreen.write(text.data(), text.size());
+    screenChanged = true;
+}
+
+size_t bottomScreenColumns() {
+    return hasBottomScreen ? (size_t)bottomScreen.columns() : 0;
+}
+
+#ifdef __3DS__
+
+namespace {
+
+// gfxGetFramebuffer() reports the buffer's own shape, a column of the
+// screen's height for every pixel across.
+Surface framebufferSurface(gfxScreen_t screen) {
+    u16 columnLength = 0;
+    u16 columns = 0;
+    u8* pixels = gfxGetFramebuffer(screen, GFX_LEFT, &columnLength, &columns);
+    return columnMajorSurface((uint16_t*)pixels, columns, columnLength);
+}
+
+// Page images share the top framebuffer's layout, so showing one is a
+// straight copy.
+Surface topScreenSurface(uint16_t* pixels) {
+    return columnMajorSurface(pixels, topScreenWidth, screenHeight);
+}
+
+uint16_t* topBackBuffer() {
+    return (uint16_t*)gfxGetFramebuffer(GFX_TOP, GFX_LEFT, nullptr, nullptr);
+}
+
+void writeToScreen(const char* text, size_t length) {
+    writeText(text, length);
+}
+
+}
+
+bool platformInit(int, char**, bool bottomScreen) {
+    gfxInitDefault();
+    gfxSetScreenFormat(GFX_TOP, GSP_RGB565_OES);
+    gfxSetDoubleBuffering(GFX_TOP, true);
+    if (bottomScreen) {
+        gfxSetScreenFormat(GFX_BOTTOM, GSP_RGB565_OES);
+        gfxSetDoubleBuffering(GFX_BOTTOM, true);
+        hasBottomScreen = true;
+    }
+    atlas.build(builtinFont(), true);
+    return true;
+}
+
+void platformExit() {
+    gfxExit();
+}
+
+bool platformRunning() {
+    return aptMainLoop();
+}
+
+void scanInput() {
+    hidScanInput();
+}
+
+u32 keysDown() {
+    return hidKeysDown();
+}
+
+u32 keysHeld() {
+    return hidKeysHeld();
+}
+
+u32 keysDownRepeat() {
+    return hidKeysDownRepeat();
+}
+
+void setKeyRepeat(u32 delay, u32 interval) {
+    hidSetRepeatParameters(delay, interval);
+}
+
+// Both screens are drawn and swapped together, since gfxSwapBuffers()
+// flips every double-buffered screen.
+void presentFrame() {
+    topScreen.present(atlas, framebufferSurface(GFX_TOP), backBuffer);
+    if (hasBottomScreen) bottomScreen.present(atlas, framebufferSurface(GFX_BOTTOM), backBuffer);
+    gfxFlushBuffers();
+    gfxSwapBuffers();
+    backBuffer = (backBuffer + 1) % framebufferCount;
+    screenChanged = false;
+}
+
+// Anything printed without a presentFrame() still shows up, as it did on
+// the console.
+void waitForFrame() {
+    if (screenChanged) presentFrame();
+    gspWaitForVBlank();
+}
+
+bool askText(const char* hint, size_t maxLength, string& text) {
+    vector<char> input(maxLength + 1, '\0');
+    SwkbdState keyboard;
+    swkbdInit(&keyboard, SWKBD_TYPE_NORMAL, 2, (int)maxLength);
+    swkbdSetHintText(&keyboard, hint);
+    if (swkbdInputText(&keyboard, input.data(), input.size()) != SWKBD_BUTTON_CONFIRM) return false;
+    text = input.data();
+    return !text.empty();
+}
+
+bool isNew3DS() {
+    bool isNew = false;
+    return R_SUCCEEDED(APT_CheckNew3DS(&isNew)) && isNew;
+}
+
+uint64_t clockMilliseconds() {
+    return osGetTime();
+}
+
+uint64_t clockTicks() {
+    return svcGetSystemTick();
+}
+
+double ticksAsMilliseconds(uint64_t ticks) {
+    return ticks / (SYSCLOCK_ARM11 / 1000.0);
+}
+
+string storagePath(const char* path) {
+    return path;
+}
+
+#else
+
+namespace {
+
+const char* sdPrefix = "sdmc:";
+
+struct KeyName {
+    const char* name;
+    u32 keys;
+};
+
+// Named the way the UI refers to them; UP and friends are the D-pad only.
+const KeyName keyNames[] = {
+    { "A", KEY_A }, { "B", KEY_B }, { "X", KEY_X }, { "Y", KEY_Y }, { "L", KEY_L }, { "R", KEY_R },
+    { "ZL", KEY_ZL }, { "ZR", KEY_ZR }, { "START", KEY_START }, { "SELECT", KEY_SELECT },
+    { "UP", KEY_DUP }, { "DOWN", KEY_DDOWN }, { "LEFT", KEY_DLEFT }, { "RIGHT", KEY_DRIGHT }
+};
+
+// One frame of the script: the keys held during it, and how long to
+// really wait before it starts.
+struct ScriptFrame {
+    u32 held;
+    u32 sleepMilliseconds;
+};
+
+vector<ScriptFrame> script;
+size_t nextFrame = 0;
+deque<string> typedText;
+
+u32 held = 0;
+u32 down = 0;
+u32 repeat = 0;
+u32 repeatDelay = 15;
+u32 repeatInterval = 3;
+u32 repeatCountdown = 0;
+
+string sdRoot = "sdmc";
+FILE* screen = nullptr;
+
+// The libctru console cleared and redrew the whole screen with fixed-width
+// cells for every page; this does the same, for comparison.
+bool consolePath = false;
+vector<uint16_t> topPixels[framebufferCount];
+vector<uint16_t> bottomPixels[framebufferCount];
+const char* snapshotPath = nullptr;
+
+// The keypress waiting for its frame, if any
+bool pressPending = false;
+string pendingKeys;
+chrono::steady_clock::time_point pressTime;
+
+struct KeyLatency {
+    vector<double> milliseconds;
+    size_t unanswered; // presses that changed nothing on screen
+};
+map<string, KeyLatency> latencies;
+
+string keysText(u32 keys) {
+    string text;
+    for (const KeyName& key : keyNames) {
+        if (!(keys & key.keys)) continue;
+        if (!text.empty()) text += '+';
+        text += key.name;
+    }
+    return text;
+}
+
+bool parseKeys(const string& text, u32& keys) {
+    keys = 0;
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t end = text.find('+', start);
+        if (end == string::npos) end = text.size();
+        string name = text.substr(start, end - start);
+        u32 key = 0;
+        for (const KeyName& known : keyNames) {
+            if (name == known.name) key = known.keys;
+        }
+        if (key == 0) return false;
+        keys |= key;
+        start = end + 1;
+    }
+    return keys != 0;
+}
+
+bool parseCount(const char* text, unsigned long& count) {
+    char* end = nullptr;
+    count = strtoul(text, &end, 10);
+    return end != text && *end == '\0';
+}
+
+bool loadScript(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Can't open key script %s\n", path);
+        return false;
+    }
+
+    char line[512];
+    size_t lineNumber = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file)) {
+        lineNumber++;
+        line[strcspn(line, "#\r\n")] = '\0';
+
+        char command[16] = "";
+        char argument[256] = "";
+        char extra[32] = "";
+        int fields = sscanf(line, "%15s %255s %31s", command, argument, extra);
+        if (fields <= 0) continue;
+
+        const char* rest = line + strspn(line, " \t");
+        rest += strlen(command);
+        rest += strspn(rest, " \t");
+
+        unsigned long count = 1;
+        u32 keys = 0;
+        string name = command;
+        if (name == "press" && fields >= 2 && parseKeys(argument, keys) && (fields < 3 || parseCount(extra, count))) {
+            for (unsigned long i = 0; i < count; i++) {
+                script.push_back({ keys, 0 });
+                script.push_back({ 0, 0 });
+            }
+        }
+        else if (name == "hold" && fields == 3 && parseKeys(argument, keys) && parseCount(extra, count)) {
+            for (unsigned long i = 0; i < count; i++) script.push_back({ keys, 0 });
+            script.push_back({ 0, 0 });
+        }
+        else if (name == "wait" && fields == 2 && parseCount(argument, count)) {
+            for (unsigned long i = 0; i < count; i++) script.push_back({ 0, 0 });
+        }
+        else if (name == "sleep" && fields == 2 && parseCount(argument, count)) {
+            script.push_back({ 0, (u32)count });
+        }
+        else if (name == "type" && fields >= 2) {
+            typedText.push_back(rest);
+        }
+        else {
+            fprintf(stderr, "%s:%zu: can't read \"%s\"\n", path, lineNumber, line);
+            ok = false;
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+double percentile(const vector<double>& sorted, double fraction) {
+    size_t rank = (size_t)(fraction * sorted.size() + 0.999999);
+    return sorted[min(sorted.size(), max<size_t>(rank, 1)) - 1];
+}
+
+void printLatencyReport() {
+    printf("%-12s %7s %8s %8s %8s %8s %9s\n", "key", "presses", "p50 ms", "p90 ms", "p99 ms", "max ms", "no frame");
+    for (auto& entry : latencies) {
+        vector<double>& times = entry.second.milliseconds;
+        sort(times.begin(), times.end());
+        size_t presses = times.size() + entry.second.unanswered;
+        if (times.empty()) {
+            printf("%-12s %7zu %8s %8s %8s %8s %9zu\n", entry.first.c_str(), presses, "-", "-", "-", "-",
+                   entry.second.unanswered);
+            continue;
+        }
+        printf("%-12s %7zu %8.2f %8.2f %8.2f %8.2f %9zu\n", entry.first.c_str(), presses, percentile(times, 0.5),
+               percentile(times, 0.9), percentile(times, 0.99), times.back(), entry.second.unanswered);
+    }
+}
+
+// The top screen as it was last shown, as a binary PPM.
+bool saveSnapshot(const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (!file) return false;
+    fprintf(file, "P6\n%d %d\n255\n", topScreenWidth, screenHeight);
+    const vector<uint16_t>& pixels = topPixels[(backBuffer + framebufferCount - 1) % framebufferCount];
+    for (uint16_t pixel : pixels) {
+        unsigned char rgb[3] = { (unsigned char)((pixel >> 11) << 3), (unsigned char)(((pixel >> 5) & 0x3F) << 2),
+                                 (unsigned char)((pixel & 0x1F) << 3) };
+        fwrite(rgb, 1, sizeof(rgb), file);
+    }
+    return fclose(file) == 0;
+}
+
+Surface topScreenSurface(uint16_t* pixels) {
+    return rowMajorSurface(pixels, topScreenWidth, screenHeight);
+}
+
+uint16_t* topBackBuffer() {
+    return topPixels[backBuffer].data();
+}
+
+void writeToScreen(const char* text, size_t length) {
+    if (screen) fwrite(text, 1, length, screen);
+    writeText(text, length);
+}
+
+void usage(const char* program) {
+    fprintf(stderr, "usage: %s --script FILE [--sd DIR] [--screen FILE] [--snapshot FILE.ppm] [--console-path]\n",
+            program);
+}
+
+}
+
+bool platformInit(int argc, char** argv, bool bottomScreen) {
+    const char* scriptPath = nullptr;
+    const char* screenPath = nullptr;
+    for (int i = 1; i < argc; i++) {
+        string option = argv[i];
+        if (option == "--console-path") {
+            consolePath = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return false;
+        }
+        if (option == "--script") scriptPath = argv[++i];
+        else if (option == "--sd") sdRoot = argv[++i];
+        else if (option == "--screen") screenPath = argv[++i];
+        else if (option == "--snapshot") snapshotPath = argv[++i];
+        else {
+            usage(argv[0]);
+            return false;
+        }
+    }
+    if (!scriptPath) {
+        usage(argv[0]);
+        return false;
+    }
+    if (!loadScript(scriptPath)) return false;
+
+    if (screenPath) {
+        screen = fopen(screenPath, "w");
+        if (!screen) {
+            fprintf(stderr, "Can't write %s\n", screenPath);
+            return false;
+        }
+    }
+
+    atlas.build(builtinFont(), !consolePath);
+    hasBottomScreen = bottomScreen;
+    for (size_t i = 0; i < framebufferCount; i++) {
+        topPixels[i].assign((size_t)topScreenWidth * screenHeight, 0);
+        if (hasBottomScreen) bottomPixels[i].assign((size_t)bottomScreenWidth * screenHeight, 0);
+    }
+    return true;
+}
+
+void platformExit() {
+    if (pressPending) latencies[pendingKeys].unanswered++;
+    pressPending = false;
+    if (screen) fclose(screen);
+    screen = nullptr;
+    if (snapshotPath && !saveSnapshot(snapshotPath)) fprintf(stderr, "Can't write %s\n", snapshotPath);
+    printLatencyReport();
+}
+
+bool platformRunning() {
+    return nextFrame < script.size();
+}
+
+// A keypress is timed from the frame it is seen in to the next finished
+// frame. A press that gets no frame before the next one counts as unanswered.
+void scanInput() {
+    ScriptFrame frame = { 0, 0 };
+    if (nextFrame < script.size()) frame = script[nextFrame++];
+    if (frame.sleepMilliseconds > 0) this_thread::sleep_for(chrono::milliseconds(frame.sleepMilliseconds));
+
+    u32 previous = held;
+    held = frame.held;
+    down = held & ~previous;
+
+    if (down) {
+        repeat = down;
+        repeatCountdown = repeatDelay;
+    }
+    else if (held && repeatCountdown > 0 && --repeatCountdown == 0) {
+        repeat = held;
+        repeatCountdown = repeatInterval;
+    }
+    else {
+        repeat = 0;
+    }
+
+    if (repeat) {
+        if (pressPending) latencies[pendingKeys].unanswered++;
+        pressPending = true;
+        pendingKeys = keysText(repeat);
+        pressTime = chrono::steady_clock::now();
+    }
+}
+
+u32 keysDown() {
+    return down;
+}
+
+u32 keysHeld() {
+    return held;
+}
+
+u32 keysDownRepeat() {
+    return repeat;
+}
+
+void setKeyRepeat(u32 delay, u32 interval) {
+    repeatDelay = max<u32>(delay, 1);
+    repeatInterval = max<u32>(interval, 1);
+}
+
+// Drawn into memory the same way as on the console, so the latency report
+// includes rendering.
+void presentFrame() {
+    if (screen) fflush(screen);
+    if (consolePath) {
+        topScreen.invalidate(backBuffer);
+        bottomScreen.invalidate(backBuffer);
+    }
+    topScreen.present(atlas, topScreenSurface(topBackBuffer()), backBuffer);
+    if (hasBottomScreen) {
+        bottomScreen.present(atlas, rowMajorSurface(bottomPixels[backBuffer].data(), bottomScreenWidth, screenHeight),
+                             backBuffer);
+    }
+    backBuffer = (backBuffer + 1) % framebufferCount;
+    screenChanged = false;
+
+    if (!pressPending) return;
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - pressTime;
+    latencies[pendingKeys].milliseconds.push_back(elapsed.count());
+    pressPending = false;
+}
+
+// Headless frames run back to back; "sleep" in the script is the only pause.
+void waitForFrame() {
+    if (screenChanged) presentFrame();
+}
+
+bool askText(const char*, size_t maxLength, string& text) {
+    if (typedText.empty()) return false;
+    text = typedText.front().substr(0, maxLength);
+    typedText.pop_front();
+    return !text.empty();
+}
+
+bool isNew3DS() {
+    return true;
+}
+
+uint64_t clockMilliseconds() {
+    return (uint64_t)chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t clockTicks() {
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double ticksAsMilliseconds(uint64_t ticks) {
+    return ticks / 1000000.0;
+}
+
+string storagePath(const char* path) {
+    size_t prefixLength = strlen(sdPrefix);
+    if (strncmp(path, sdPrefix, prefixLength) != 0) return path;
+    return sdRoot + (path + prefixLength);
+}
+
+#endif
@@ -0,0 +1,175 @@
+#include "profile.h"
+
+#ifdef EREADER_PROFILE
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+#ifdef __3DS__
+#include <3ds.h>
+#else
+#include <chrono>
+#endif
+
+using namespace std;
+
+namespace {
+
+const char* stageNames[STAGE_COUNT] = {
+    "open", "SD read", "inflate", "XML", "HTML", "entities", "wrap", "disk cache", "search index", "LZ4",
+    "library scan", "render"
+};
+
+atomic<uint64_t> stageTicks[STAGE_COUNT];
+atomic<uint64_t> stageCalls[STAGE_COUNT];
+atomic<uint64_t> counters[COUNTER_COUNT];
+atomic<size_t> heapInUse(0);
+atomic<size_t> heapPeak(0);
+
+// Innermost open scope on this thread, which a new scope reports to when it ends.
+thread_local ProfileScope* currentScope = nullptr;
+
+uint64_t ticksNow() {
+#ifdef __3DS__
+    return svcGetSystemTick();
+#else
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+double ticksToMilliseconds(uint64_t ticks) {
+#ifdef __3DS__
+    return ticks / (SYSCLOCK_ARM11 / 1000.0);
+#else
+    return ticks / 1000000.0;
+#endif
+}
+
+void trackAllocation(void* p) {
+    size_t inUse = heapInUse += malloc_usable_size(p);
+    size_t peak = heapPeak.load();
+    while (inUse > peak && !heapPeak.compare_exchange_weak(peak, inUse)) {}
+    counters[COUNTER_ALLOCATIONS]++;
+}
+
+}
+
+ProfileScope::ProfileScope(ProfileStage stage) : stage(stage), childTicks(0), parent(currentScope) {
+    currentScope = this;
+    start = ticksNow();
+}
+
+ProfileScope::~ProfileScope() {
+    uint64_t elapsed = ticksNow() - start;
+    stageTicks[stage] += elapsed - childTicks;
+    stageCalls[stage]++;
+    if (parent) parent->childTicks += elapsed;
+    currentScope = parent;
+}
+
+void profileCount(ProfileCounter counter, uint64_t amount) {
+    counters[counter] += amount;
+}
+
+void profileReset() {
+    for (size_t i = 0; i < STAGE_COUNT; i++) {
+        stageTicks[i] = 0;
+        stageCalls[i] = 0;
+    }
+    for (size_t i = 0; i < COUNTER_COUNT; i++) counters[i] = 0;
+    heapPeak = heapInUse.load();
+}
+
+string profileReport(size_t width) {
+    string report;
+    char line[128];
+    size_t lineSize = min(sizeof(line), width + 1);
+    for (size_t i = 0; i < STAGE_COUNT; i++) {
+        if (stageCalls[i] == 0) continue;
+        snprintf(line, lineSize, "%-13s%9.1f ms %7llu", stageNames[i], ticksToMilliseconds(stageTicks[i]),
+                 (unsigned long long)stageCalls[i]);
+        report += line;
+        report += '\n';
+    }
+    snprintf(line, lineSize, "read %llu KB in %llu, inflated %llu KB", (unsigned long long)(counters[COUNTER_BYTES_READ] / 1024),
+             (unsigned long long)counters[COUNTER_READ_CALLS], (unsigned long long)(counters[COUNTER_BYTES_INFLATED] / 1024));
+    report += line;
+    report += '\n';
+    snprintf(line, lineSize, "%llu allocs, heap %zu KB, peak %zu KB", (unsigned long long)counters[COUNTER_ALLOCATIONS],
+             heapInUse.load() / 1024, heapPeak.load() / 1024);
+    report += line;
+    report += '\n';
+    return report;
+}
+
+bool profileAppendLog(const char* path, const string& heading) {
+    FILE* file = fopen(path, "a");
+    if (!file) return false;
+
+    fprintf(file, "== %s\n%s\n", heading.c_str(), profileReport(80).c_str());
+    bool ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+}
+
+ProfileTotals profileTotals() {
+    ProfileTotals totals;
+    for (size_t i = 0; i < STAGE_COUNT; i++) {
+        totals.stageMilliseconds[i] = ticksToMilliseconds(stageTicks[i]);
+        totals.stageCalls[i] = stageCalls[i];
+    }
+    for (size_t i = 0; i < COUNTER_COUNT; i++) totals.counters[i] = counters[i];
+    totals.heapPeak = heapPeak;
+    return totals;
+}
+
+const char* profileStageName(ProfileStage stage) {
+    return stage < STAGE_COUNT ? stageNames[stage] : "";
+}
+
+// Only C++ allocations are seen here; zlib's inflate state comes from malloc.
+void* operator new(size_t size) {
+    void* p = malloc(size > 0 ? size : 1);
+    if (!p) throw bad_alloc();
+    trackAllocation(p);
+    return p;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+// libstdc++'s nothrow forms call the ones above, but a sanitizer runtime
+// brings its own, whose blocks would then be freed here.
+void* operator new(size_t size, const nothrow_t&) noexcept {
+    void* p = malloc(size > 0 ? size : 1);
+    if (p) trackAllocation(p);
+    return p;
+}
+
+void* operator new[](size_t size, const nothrow_t& tag) noexcept {
+    return operator new(size, tag);
+}
+
+void operator delete(void* p) noexcept {
+    if (!p) return;
+    heapInUse -= malloc_usable_size(p);
+    free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    operator delete(p);
+}
+
+void operator delete(void* p, const nothrow_t&) noexcept {
+    operator delete(p);
+}
+
+void operator delete[](void* p, const nothrow_t&) noexcept {
+    operator delete(p);
+}
+
+#endif
@@ -0,0 +1,66 @@
+#include "reading_position.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fstream>
+
+using namespace std;
+
+bool ReadingPositions::load(const char* path) {
+    entries.clear();
+
+    ifstream file(path);
+    if (!file.is_open()) return false;
+
+    string line;
+    while (getline(file, line) && entries.size() < maxBooks) {
+        size_t firstTab = line.find('\t');
+        size_t secondTab = firstTab == string::npos ? string::npos : line.find('\t', firstTab + 1);
+        if (secondTab == string::npos || secondTab + 1 >= line.size()) continue;
+
+        Entry entry;
+        entry.position.spineIndex = strtoul(line.c_str(), nullptr, 10);
+        entry.position.offset = strtoul(line.c_str() + firstTab + 1, nullptr, 10);
+        entry.bookPath = line.substr(secondTab + 1);
+        entries.push_back(entry);
+    }
+    return true;
+}
+
+bool ReadingPositions::save(const char* path) const {
+    FILE* file = fopen(path, "w");
+    if (!file) return false;
+
+    for (const Entry& entry : entries) {
+        fprintf(file, "%zu\t%zu\t%s\n", entry.position.spineIndex, entry.position.offset, entry.bookPath.c_str());
+    }
+
+    bool ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+}
+
+bool ReadingPositions::find(const string& bookPath, ReadingPosition& position) const {
+    for (const Entry& entry : entries) {
+        if (entry.bookPath == bookPath) {
+            position = entry.position;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ReadingPositions::set(const string& bookPath, const ReadingPosition& position) {
+    // A newline would split the entry in two
+    if (bookPath.find('\n') != string::npos) return;
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (entries[i].bookPath == bookPath) {
+            entries.erase(entries.begin() + i);
+            break;
+        }
+    }
+
+    Entry entry = { bookPath, position };
+    entries.insert(entries.begin(), entry);
+    if (entries.size() > maxBooks) entries.resize(maxBooks);
+}
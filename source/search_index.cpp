@@ -0,0 +1,223 @@
+#include "search_index.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+using namespace std;
+
+namespace {
+
+const uint32_t indexFormatVersion = 1;
+const uint32_t symbolCount = 37;
+const uint32_t trigramCount = symbolCount * symbolCount * symbolCount;
+const uint32_t maxBlock = 0xFFFF;
+
+// 0 for anything that isn't a letter or digit, so punctuation and spacing
+// variations all look alike to the index; exact matching happens later.
+uint32_t foldSymbol(char c) {
+    if (c >= 'a' && c <= 'z') return (uint32_t)(c - 'a' + 1);
+    if (c >= 'A' && c <= 'Z') return (uint32_t)(c - 'A' + 1);
+    if (c >= '0' && c <= '9') return (uint32_t)(c - '0' + 27);
+    return 0;
+}
+
+uint32_t trigramOf(uint32_t a, uint32_t b, uint32_t c) {
+    return (a * symbolCount + b) * symbolCount + c;
+}
+
+void putVarint(vector<uint8_t>& out, uint32_t value) {
+    while (value >= 0x80) {
+        out.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((uint8_t)value);
+}
+
+size_t varintLength(uint32_t value) {
+    size_t length = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        length++;
+    }
+    return length;
+}
+
+uint32_t getVarint(const uint8_t*& p) {
+    uint32_t value = 0;
+    for (int shift = 0; ; shift += 7) {
+        uint8_t byte = *p++;
+        value |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+}
+
+// Blocks where a match could start, given the blocks a trigram appears in:
+// the block itself or the one before it in the same chapter.
+void startBlocks(const uint8_t* p, const uint8_t* end, vector<uint32_t>& out) {
+    out.clear();
+    uint32_t id = 0;
+    while (p < end) {
+        id += getVarint(p);
+        if ((id & maxBlock) != 0 && (out.empty() || out.back() < id - 1)) out.push_back(id - 1);
+        if (out.empty() || out.back() < id) out.push_back(id);
+    }
+}
+
+}
+
+SearchIndex::SearchIndex() {}
+
+void SearchIndex::clear() {
+    offsets.clear();
+    postings.clear();
+}
+
+void SearchIndex::encodeChapter(const string& text, vector<uint8_t>& encoded) {
+    vector<uint32_t> keys;
+    keys.reserve(text.size());
+
+    uint32_t a = 0;
+    uint32_t b = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+        uint32_t c = foldSymbol(text[i]);
+        if (i >= 2) {
+            uint32_t trigram = trigramOf(a, b, c);
+            uint32_t block = (uint32_t)min((i - 2) / blockSize, (size_t)maxBlock);
+            if (trigram != 0) keys.push_back(trigram << 16 | block);
+        }
+        a = b;
+        b = c;
+    }
+    sort(keys.begin(), keys.end());
+    keys.erase(unique(keys.begin(), keys.end()), keys.end());
+
+    encoded.clear();
+    uint32_t previous = 0;
+    for (size_t i = 0; i < keys.size(); i++) {
+        putVarint(encoded, keys[i] - previous);
+        previous = keys[i];
+    }
+}
+
+void SearchIndex::build(const vector<vector<uint8_t>>& chapters) {
+    // First pass sizes every posting list, second pass fills them in.
+    vector<uint32_t> last(trigramCount, 0);
+    vector<uint32_t> sizes(trigramCount, 0);
+    for (size_t chapter = 0; chapter < chapters.size(); chapter++) {
+        const uint8_t* p = chapters[chapter].data();
+        const uint8_t* end = p + chapters[chapter].size();
+        uint32_t key = 0;
+        while (p < end) {
+            key += getVarint(p);
+            uint32_t trigram = key >> 16;
+            uint32_t id = (uint32_t)chapter << 16 | (key & maxBlock);
+            sizes[trigram] += (uint32_t)varintLength(id - last[trigram]);
+            last[trigram] = id;
+        }
+    }
+
+    offsets.assign(trigramCount + 1, 0);
+    for (uint32_t t = 0; t < trigramCount; t++) offsets[t + 1] = offsets[t] + sizes[t];
+    postings.resize(offsets[trigramCount]);
+
+    vector<uint32_t>& cursor = sizes;
+    copy(offsets.begin(), offsets.end() - 1, cursor.begin());
+    fill(last.begin(), last.end(), 0);
+    vector<uint8_t> scratch;
+    for (size_t chapter = 0; chapter < chapters.size(); chapter++) {
+        const uint8_t* p = chapters[chapter].data();
+        const uint8_t* end = p + chapters[chapter].size();
+        uint32_t key = 0;
+        while (p < end) {
+            key += getVarint(p);
+            uint32_t trigram = key >> 16;
+            uint32_t id = (uint32_t)chapter << 16 | (key & maxBlock);
+            scratch.clear();
+            putVarint(scratch, id - last[trigram]);
+            memcpy(&postings[cursor[trigram]], scratch.data(), scratch.size());
+            cursor[trigram] += (uint32_t)scratch.size();
+            last[trigram] = id;
+        }
+    }
+}
+
+void SearchIndex::save(vector<uint8_t>& out) const {
+    uint32_t header[3] = { indexFormatVersion, (uint32_t)offsets.size(), (uint32_t)postings.size() };
+    size_t start = out.size();
+    out.resize(start + sizeof(header) + offsets.size() * sizeof(uint32_t) + postings.size());
+
+    uint8_t* p = &out[start];
+    memcpy(p, header, sizeof(header));
+    p += sizeof(header);
+    if (!offsets.empty()) memcpy(p, offsets.data(), offsets.size() * sizeof(uint32_t));
+    p += offsets.size() * sizeof(uint32_t);
+    if (!postings.empty()) memcpy(p, postings.data(), postings.size());
+}
+
+bool SearchIndex::load(const vector<uint8_t>& data) {
+    clear();
+
+    uint32_t header[3];
+    if (data.size() < sizeof(header)) return false;
+    memcpy(header, data.data(), sizeof(header));
+    if (header[0] != indexFormatVersion || header[1] != trigramCount + 1) return false;
+    if (data.size() != sizeof(header) + (size_t)header[1] * sizeof(uint32_t) + header[2]) return false;
+
+    offsets.resize(header[1]);
+    memcpy(offsets.data(), &data[sizeof(header)], offsets.size() * sizeof(uint32_t));
+    postings.assign(data.begin() + sizeof(header) + offsets.size() * sizeof(uint32_t), data.end());
+
+    // Lists must be in order and end exactly at the end of the postings.
+    bool valid = offsets[0] == 0 && offsets.back() == postings.size();
+    for (size_t t = 0; valid && t < trigramCount; t++) valid = offsets[t] <= offsets[t + 1];
+    if (!valid) clear();
+    return valid;
+}
+
+bool SearchIndex::candidates(const string& query, vector<uint32_t>& blocks) const {
+    blocks.clear();
+    if (!ready() || query.size() < minQueryLength || query.size() > maxQueryLength) return false;
+
+    vector<uint32_t> trigrams;
+    for (size_t i = 2; i < query.size(); i++) {
+        uint32_t trigram = trigramOf(foldSymbol(query[i - 2]), foldSymbol(query[i - 1]), foldSymbol(query[i]));
+        if (trigram != 0) trigrams.push_back(trigram);
+    }
+    sort(trigrams.begin(), trigrams.end());
+    trigrams.erase(unique(trigrams.begin(), trigrams.end()), trigrams.end());
+    if (trigrams.empty()) return false;
+
+    // Rarest lists first keeps the running intersection small.
+    sort(trigrams.begin(), trigrams.end(), [this](uint32_t a, uint32_t b) {
+        return offsets[a + 1] - offsets[a] < offsets[b + 1] - offsets[b];
+    });
+
+    vector<uint32_t> next;
+    vector<uint32_t> merged;
+    for (size_t i = 0; i < trigrams.size(); i++) {
+        const uint8_t* begin = postings.data() + offsets[trigrams[i]];
+        const uint8_t* end = postings.data() + offsets[trigrams[i] + 1];
+        if (i == 0) {
+            startBlocks(begin, end, blocks);
+        } else {
+            startBlocks(begin, end, next);
+            merged.clear();
+            set_intersection(blocks.begin(), blocks.end(), next.begin(), next.end(), back_inserter(merged));
+            blocks.swap(merged);
+        }
+        if (blocks.empty()) break;
+    }
+    return true;
+}
+
+void SearchIndex::findMatches(const string& text, const string& query, size_t from, size_t to,
+                              vector<size_t>& offsets) {
+    if (query.empty() || text.size() < query.size()) return;
+    size_t last = min(to, text.size() - query.size() + 1);
+    for (size_t start = from; start < last; start++) {
+        size_t i = 0;
+        while (i < query.size() && tolower((unsigned char)text[start + i]) == tolower((unsigned char)query[i])) i++;
+        if (i == query.size()) offsets.push_back(start);
+    }
+}
@@ -0,0 +1,129 @@
+#include "task_pool.h"
+
+#include <mutex>
+
+using namespace std;
+
+TaskPool::TaskPool() : postedTasks(0), stopping(false), nextWorker(0) {}
+
+TaskPool::~TaskPool() {
+    stop();
+}
+
+size_t TaskPool::start(size_t threadCount) {
+    stop();
+    stopping = false;
+
+    for (size_t i = 0; i < threadCount; i++) {
+        unique_ptr<Worker> worker(new Worker());
+        worker->pool = this;
+        worker->index = workers.size();
+        workers.push_back(move(worker));
+    }
+
+    // Threads only start once the worker list is final, since they steal from it.
+    size_t started = 0;
+    for (size_t i = 0; i < workers.size(); i++) {
+        if (workers[i]->thread.start(workerEntry, workers[i].get(), i)) started++;
+    }
+    if (started < workers.size()) {
+        stop();
+        return 0;
+    }
+    return started;
+}
+
+void TaskPool::stop() {
+    {
+        lock_guard<Mutex> guard(idleLock);
+        stopping = true;
+        workPosted.broadcast();
+    }
+    for (size_t i = 0; i < workers.size(); i++) workers[i]->thread.join();
+    workers.clear();
+
+    lock_guard<Mutex> guard(urgentLock);
+    urgent.clear();
+    nextWorker = 0;
+}
+
+void TaskPool::submit(const Task& task) {
+    if (workers.empty()) return;
+    Worker& worker = *workers[nextWorker];
+    nextWorker = (nextWorker + 1) % workers.size();
+
+    {
+        lock_guard<Mutex> guard(worker.lock);
+        worker.tasks.push_back(task);
+    }
+    post();
+}
+
+void TaskPool::submitUrgent(const Task& task) {
+    {
+        lock_guard<Mutex> guard(urgentLock);
+        urgent.push_back(task);
+    }
+    post();
+}
+
+// Wakes an idle worker; whichever one it is can steal the task.
+void TaskPool::post() {
+    lock_guard<Mutex> guard(idleLock);
+    postedTasks++;
+    workPosted.signal();
+}
+
+void TaskPool::workerEntry(void* worker) {
+    Worker* self = static_cast<Worker*>(worker);
+    self->pool->run(*self);
+}
+
+void TaskPool::run(Worker& worker) {
+    while (!stopping) {
+        size_t seen;
+        {
+            lock_guard<Mutex> guard(idleLock);
+            seen = postedTasks;
+        }
+        Task task;
+        if (take(worker, task)) {
+            task(worker.index);
+            continue;
+        }
+
+        // Nothing queued anywhere: sleep until something is submitted after
+        // the queues were looked at, or the pool stops.
+        lock_guard<Mutex> guard(idleLock);
+        while (postedTasks == seen && !stopping) workPosted.wait(idleLock);
+    }
+}
+
+bool TaskPool::take(Worker& worker, Task& task) {
+    {
+        lock_guard<Mutex> guard(urgentLock);
+        if (!urgent.empty()) {
+            task = urgent.front();
+            urgent.pop_front();
+            return true;
+        }
+    }
+    {
+        lock_guard<Mutex> guard(worker.lock);
+        if (!worker.tasks.empty()) {
+            task = worker.tasks.front();
+            worker.tasks.pop_front();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < workers.size(); i++) {
+        Worker& victim = *workers[(worker.index + i) % workers.size()];
+        lock_guard<Mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,247 @@
+#include "text_layout.h"
+
+#include <algorithm>
+
+#include "byte_scan.h"
+
+using namespace std;
+
+// Words are stepped over a run at a time: inside one only the column
+// matters, so the next space or newline is found with a block scan and the
+// point where the line fills up is worked out from the run's length.
+void breakLines(const string& text, size_t width, vector<uint32_t>& lineStarts) {
+    lineStarts.clear();
+    const size_t maxLength = width > 1 ? width - 1 : 1;
+    const size_t noSpace = (size_t)-1;
+    const char* data = text.data();
+    const size_t size = text.size();
+
+    size_t lineStart = 0;
+    size_t lastSpace = noSpace;
+    size_t i = 0;
+    while (i < size) {
+        size_t next = findSpace(data + i, data + size) - data;
+        // Break wherever the run crosses the end of the line, as many times as it does.
+        while (i < next && max(i, lineStart + maxLength) < next) {
+            size_t overflow = max(i, lineStart + maxLength);
+            lineStarts.push_back(lineStart);
+            lineStart = (lastSpace != noSpace) ? lastSpace + 1 : overflow;
+            lastSpace = noSpace;
+            i = overflow + 1;
+        }
+        i = next;
+        if (i == size) break;
+
+        char c = data[i];
+        if (c == '\n') {
+            lineStarts.push_back(lineStart);
+            lineStart = i + 1;
+            lastSpace = noSpace;
+        }
+        else if (c == ' ') {
+            // A wrapped line never starts with the space it was broken at.
+            if (i == lineStart) lineStart = i + 1;
+            else lastSpace = i;
+        }
+        else if (i - lineStart >= maxLength) {
+            // Other whitespace such as a tab is laid out like any character.
+            lineStarts.push_back(lineStart);
+            lineStart = (lastSpace != noSpace) ? lastSpace + 1 : i;
+            lastSpace = noSpace;
+        }
+        i++;
+    }
+    if (lineStart < size) lineStarts.push_back(lineStart);
+}
+
+LineView lineAt(const string& text, const vector<uint32_t>& lineStarts, size_t line) {
+    size_t start = lineStarts[line];
+    size_t end = (line + 1 < lineStarts.size()) ? lineStarts[line + 1] : text.size();
+    while (end > start && (text[end - 1] == ' ' || text[end - 1] == '\n')) end--;
+
+    LineView view = { text.data() + start, end - start };
+    return view;
+}
+
+size_t lineOfOffset(const vector<uint32_t>& lineStarts, size_t offset) {
+    vector<uint32_t>::const_iterator it = upper_bound(lineStarts.begin(), lineStarts.end(), (uint32_t)offset);
+    return it == lineStarts.begin() ? 0 : (size_t)(it - lineStarts.begin()) - 1;
+}
+
+void measureLines(const string& text, const vector<uint32_t>& lineStarts, vector<uint8_t>& lengths) {
+    lengths.resize(lineStarts.size());
+    for (size_t line = 0; line < lineStarts.size(); line++) {
+        size_t length = lineAt(text, lineStarts, line).length;
+        lengths[line] = (uint8_t)min(length, (size_t)255);
+    }
+}
+
+namespace {
+
+// Walks the pages PageIndex lays out from line 0, using the same rules as
+// addPageAfter() and fillForward() over the lengths alone. Stops after the
+// page holding stopLine and returns the number of pages walked.
+size_t walkPages(const vector<uint8_t>& lengths, size_t maxChars, size_t maxLines, size_t stopLine, size_t* pageStart) {
+    size_t pages = 0;
+    size_t line = 0;
+    while (line < lengths.size()) {
+        // Like reset(), the first page starts at line 0 even if it is blank.
+        if (pages > 0) {
+            while (line < lengths.size() && lengths[line] == 0) line++;
+            if (line == lengths.size()) break;
+        }
+
+        size_t start = line;
+        pages++;
+        size_t chars = 0;
+        for (size_t count = 0; line < lengths.size() && count < maxLines; count++) {
+            if (count > 0 && chars + lengths[line] > maxChars) break;
+            chars += lengths[line];
+            line++;
+        }
+        if (stopLine < line) {
+            if (pageStart) *pageStart = start;
+            break;
+        }
+    }
+    return pages;
+}
+
+}
+
+size_t countPages(const vector<uint8_t>& lengths, size_t maxChars, size_t maxLines) {
+    return walkPages(lengths, maxChars, maxLines, (size_t)-1, nullptr);
+}
+
+size_t pageOfLine(const vector<uint8_t>& lengths, size_t maxChars, size_t maxLines, size_t line, size_t& pageStart) {
+    pageStart = 0;
+    size_t pages = walkPages(lengths, maxChars, maxLines, line, &pageStart);
+    return pages > 0 ? pages - 1 : 0;
+}
+
+PageIndex::PageIndex()
+    : text(nullptr), lineStarts(nullptr), maxChars(0), maxLines(0),
+      current(0), forwardEnd(0), reachedStart(true), reachedEnd(true) {}
+
+void PageIndex::reset(const string& chapterText, const vector<uint32_t>& chapterLines,
+                      size_t pageChars, size_t pageLines, size_t anchorLine) {
+    text = &chapterText;
+    lineStarts = &chapterLines;
+    maxChars = pageChars;
+    maxLines = pageLines;
+    starts.clear();
+    current = 0;
+
+    size_t lineCount = chapterLines.size();
+    if (anchorLine >= lineCount) anchorLine = lineCount > 0 ? lineCount - 1 : 0;
+
+    starts.push_back(anchorLine);
+    forwardEnd = fillForward(anchorLine);
+    reachedStart = (anchorLine == 0);
+    reachedEnd = (forwardEnd >= lineCount);
+}
+
+void PageIndex::resetAtEnd(const string& chapterText, const vector<uint32_t>& chapterLines,
+                           size_t pageChars, size_t pageLines) {
+    text = &chapterText;
+    lineStarts = &chapterLines;
+    maxChars = pageChars;
+    maxLines = pageLines;
+    starts.clear();
+    current = 0;
+
+    // Lay out one page backwards from a placeholder page at the very end.
+    forwardEnd = chapterLines.size();
+    reachedEnd = true;
+    reachedStart = false;
+    starts.push_back(forwardEnd);
+    addPageBefore();
+    starts.pop_back();
+    current = 0;
+    if (starts.empty()) {
+        starts.push_back(0);
+        reachedStart = true;
+    }
+}
+
+size_t PageIndex::lineLength(size_t line) const {
+    return lineAt(*text, *lineStarts, line).length;
+}
+
+size_t PageIndex::fillForward(size_t line) const {
+    size_t chars = 0;
+    for (size_t count = 0; line < lineStarts->size() && count < maxLines; count++) {
+        size_t length = lineLength(line);
+        if (count > 0 && chars + length > maxChars) break;
+        chars += length;
+        line++;
+    }
+    return line;
+}
+
+size_t PageIndex::fillBackward(size_t line) const {
+    size_t chars = 0;
+    for (size_t count = 0; line > 0 && count < maxLines; count++) {
+        size_t length = lineLength(line - 1);
+        if (count > 0 && chars + length > maxChars) break;
+        chars += length;
+        line--;
+    }
+    return line;
+}
+
+// Blank lines are never carried over to the top of a page.
+bool PageIndex::addPageAfter() {
+    if (reachedEnd) return false;
+
+    size_t line = forwardEnd;
+    while (line < lineStarts->size() && lineLength(line) == 0) line++;
+    if (line == lineStarts->size()) {
+        forwardEnd = line;
+        reachedEnd = true;
+        return false;
+    }
+    starts.push_back(line);
+    forwardEnd = fillForward(line);
+    return true;
+}
+
+bool PageIndex::addPageBefore() {
+    if (reachedStart) return false;
+
+    size_t end = starts.front();
+    size_t line = fillBackward(end);
+    while (line > 0 && line < end && lineLength(line) == 0) line++;
+    if (line == 0) reachedStart = true;
+    if (line == end) {
+        // Only blank lines were left above the first page.
+        reachedStart = true;
+        return false;
+    }
+    starts.push_front(line);
+    current++;
+    return true;
+}
+
+bool PageIndex::extend(size_t maxPages) {
+    for (size_t i = 0; i < maxPages && !complete(); i++) {
+        if (i % 2 == 0) {
+            if (!addPageAfter()) addPageBefore();
+        } else {
+            if (!addPageBefore()) addPageAfter();
+        }
+    }
+    return complete();
+}
+
+bool PageIndex::nextPage() {
+    if (current + 1 >= starts.size() && !addPageAfter()) return false;
+    current++;
+    return true;
+}
+
+bool PageIndex::previousPage() {
+    if (current == 0 && !addPageBefore()) return false;
+    current--;
+    return true;
+}
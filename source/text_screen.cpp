@@ -0,0 +1,223 @@
+#include "text_screen.h"
+
+#include <algorithm>
+
+#include "profile.h"
+
+using namespace std;
+
+namespace {
+
+const int tabWidth = 4;
+
+const uint16_t background = 0;
+
+int clampIndex(int oneBased, int count) {
+    return max(1, min(oneBased, count)) - 1;
+}
+
+}
+
+uint16_t TextScreen::palette(uint8_t colour) {
+    static const uint16_t colours[] = {
+        rgb565(0, 0, 0), rgb565(224, 72, 72), rgb565(72, 200, 72), rgb565(224, 200, 72),
+        rgb565(96, 128, 248), rgb565(208, 88, 208), rgb565(72, 200, 208), rgb565(255, 255, 255),
+        rgb565(200, 200, 200)
+    };
+    size_t index = colour;
+    if (index > defaultColour) index = defaultColour;
+    return colours[index];
+}
+
+TextScreen::TextScreen(int columns, int rows, size_t buffers)
+    : width(columns), height(rows), shown(buffers), cursorColumn(0), cursorRow(0),
+      colour(defaultColour), state(PLAIN), parameterCount(0), pendingCodepoint(0), pendingBytes(0) {
+    cells.assign((size_t)width * height, blank());
+    for (Shown& buffer : shown) buffer.valid = false;
+    fill(parameters, parameters + maxParameters, 0);
+}
+
+TextScreen::Cell TextScreen::blank() const {
+    Cell cell = { ' ', defaultColour };
+    return cell;
+}
+
+void TextScreen::clear() {
+    clearCells(0, cells.size());
+    cursorColumn = 0;
+    cursorRow = 0;
+}
+
+void TextScreen::clearCells(size_t from, size_t to) {
+    fill(cells.begin() + min(from, cells.size()), cells.begin() + min(to, cells.size()), blank());
+}
+
+void TextScreen::write(const char* text, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)text[i];
+
+        if (state == ESCAPE) {
+            state = c == '[' ? CONTROL : PLAIN;
+            parameterCount = 0;
+            fill(parameters, parameters + maxParameters, 0);
+            continue;
+        }
+        if (state == CONTROL) {
+            if (c >= '0' && c <= '9') {
+                int& parameter = parameters[parameterCount];
+                parameter = min(parameter * 10 + (c - '0'), 9999);
+            }
+            else if (c == ';') {
+                if (parameterCount + 1 < maxParameters) parameterCount++;
+            }
+            else if (c >= 0x40 && c <= 0x7E) {
+                parameterCount++;
+                control((char)c);
+                state = PLAIN;
+            }
+            continue;
+        }
+
+        if (pendingBytes > 0) {
+            if ((c & 0xC0) == 0x80) {
+                pendingCodepoint = (pendingCodepoint << 6) | (c & 0x3F);
+                if (--pendingBytes == 0) put(pendingCodepoint);
+                continue;
+            }
+            pendingBytes = 0;
+            put('?');
+        }
+
+        if (c == 0x1B) state = ESCAPE;
+        else if (c == '\n') newLine();
+        else if (c == '\r') cursorColumn = 0;
+        else if (c == '\t') {
+            do put(' '); while (cursorColumn % tabWidth != 0 && cursorColumn < width);
+        }
+        else if (c < 0x20 || c == 0x7F) continue;
+        else if (c < 0x80) put(c);
+        else if ((c & 0xE0) == 0xC0) {
+            pendingCodepoint = c & 0x1F;
+            pendingBytes = 1;
+        }
+        else if ((c & 0xF0) == 0xE0) {
+            pendingCodepoint = c & 0x0F;
+            pendingBytes = 2;
+        }
+        else if ((c & 0xF8) == 0xF0) {
+            pendingCodepoint = c & 0x07;
+            pendingBytes = 3;
+        }
+        else put('?');
+    }
+}
+
+// The cursor waits past the last column until something else is printed,
+// so a line that exactly fills the row doesn't leave an empty one.
+void TextScreen::put(uint32_t codepoint) {
+    if (cursorColumn >= width) newLine();
+    Cell& cell = cells[(size_t)cursorRow * width + cursorColumn];
+    cell.codepoint = codepoint;
+    cell.colour = colour;
+    cursorColumn++;
+}
+
+void TextScreen::newLine() {
+    cursorColumn = 0;
+    if (cursorRow + 1 < height) {
+        cursorRow++;
+        return;
+    }
+    move(cells.begin() + width, cells.end(), cells.begin());
+    clearCells(cells.size() - width, cells.size());
+}
+
+void TextScreen::control(char command) {
+    size_t cursor = (size_t)cursorRow * width + min(cursorColumn, width - 1);
+    size_t lineStart = (size_t)cursorRow * width;
+    int count = max(1, parameters[0]);
+    switch (command) {
+    case 'H':
+    case 'f':
+        cursorRow = clampIndex(parameters[0], height);
+        cursorColumn = clampIndex(parameters[1], width);
+        break;
+    case 'A': cursorRow = max(0, cursorRow - count); break;
+    case 'B': cursorRow = min(height - 1, cursorRow + count); break;
+    case 'C': cursorColumn = min(width - 1, cursorColumn + count); break;
+    case 'D': cursorColumn = max(0, cursorColumn - count); break;
+    case 'J':
+        if (parameters[0] == 2) clear();
+        else if (parameters[0] == 1) clearCells(0, cursor + 1);
+        else clearCells(cursor, cells.size());
+        break;
+    case 'K':
+        if (parameters[0] == 2) clearCells(lineStart, lineStart + width);
+        else if (parameters[0] == 1) clearCells(lineStart, cursor + 1);
+        else clearCells(cursor, lineStart + width);
+        break;
+    case 'm':
+        for (int i = 0; i < parameterCount; i++) {
+            int code = parameters[i];
+            if (code == 0 || code == 39) colour = defaultColour;
+            else if (code >= 30 && code <= 37) colour = (uint8_t)(code - 30);
+        }
+        break;
+    }
+}
+
+void TextScreen::invalidate(size_t buffer) {
+    if (buffer < shown.size()) shown[buffer].valid = false;
+}
+
+void TextScreen::adopt(const TextScreen& other, size_t otherBuffer, size_t buffer) {
+    if (other.width != width || other.height != height || buffer >= shown.size()) return;
+
+    cells = other.cells;
+    cursorColumn = other.cursorColumn;
+    cursorRow = other.cursorRow;
+    colour = other.colour;
+    state = other.state;
+    copy(other.parameters, other.parameters + maxParameters, parameters);
+    parameterCount = other.parameterCount;
+    pendingCodepoint = other.pendingCodepoint;
+    pendingBytes = other.pendingBytes;
+
+    if (otherBuffer < other.shown.size()) shown[buffer] = other.shown[otherBuffer];
+    else shown[buffer].valid = false;
+}
+
+void TextScreen::present(const GlyphAtlas& atlas, const Surface& surface, size_t buffer) {
+    PROFILE_SCOPE(STAGE_RENDER);
+    if (buffer >= shown.size()) return;
+
+    Shown& target = shown[buffer];
+    if (!target.valid) {
+        fillRect(surface, 0, 0, surface.width, surface.height, background);
+        target.cells.assign(cells.size(), blank());
+        target.valid = true;
+    }
+
+    const int lineHeight = atlas.lineHeight();
+    for (int row = 0; row < height; row++) {
+        const Cell* now = &cells[(size_t)row * width];
+        Cell* was = &target.cells[(size_t)row * width];
+
+        int first = 0;
+        while (first < width && now[first] == was[first]) first++;
+        if (first == width) continue;
+
+        // Everything before the first change is unchanged, so it sits where it did.
+        int x = 0;
+        for (int column = 0; column < first; column++) x += atlas.advance(now[column].codepoint);
+        int top = row * lineHeight;
+        fillRect(surface, x, top, surface.width - x, lineHeight, background);
+
+        int end = width;
+        while (end > first && now[end - 1].codepoint == ' ') end--;
+        for (int column = first; column < end && x < surface.width; column++) {
+            x += atlas.draw(surface, x, top, now[column].codepoint, palette(now[column].colour));
+        }
+        copy(now, now + width, was);
+    }
+}
@@ -0,0 +1,81 @@
+#include "text_store.h"
+
+#include <lz4.h>
+#include <algorithm>
+
+#include "profile.h"
+
+using namespace std;
+
+bool CompressedText::compress(const string& text, CompressedText& out) {
+    PROFILE_SCOPE(STAGE_LZ4);
+    out.data.clear();
+    out.blockEnds.clear();
+    out.originalSize = (uint32_t)text.size();
+
+    vector<char> scratch(LZ4_compressBound((int)blockSize));
+    for (size_t start = 0; start < text.size(); start += blockSize) {
+        int length = (int)min((size_t)blockSize, text.size() - start);
+        int packed = LZ4_compress_default(text.data() + start, scratch.data(), length, (int)scratch.size());
+        if (packed <= 0) {
+            out.data.clear();
+            out.blockEnds.clear();
+            out.originalSize = 0;
+            return false;
+        }
+        out.data.insert(out.data.end(), scratch.begin(), scratch.begin() + packed);
+        out.blockEnds.push_back((uint32_t)out.data.size());
+    }
+    out.data.shrink_to_fit();
+    out.blockEnds.shrink_to_fit();
+    return true;
+}
+
+bool CompressedText::decompress(string& text) const {
+    PROFILE_SCOPE(STAGE_LZ4);
+    text.resize(originalSize);
+
+    size_t blockStart = 0;
+    for (size_t i = 0; i < blockEnds.size(); i++) {
+        size_t offset = i * blockSize;
+        int length = (int)min((size_t)blockSize, (size_t)originalSize - offset);
+        int unpacked = LZ4_decompress_safe(data.data() + blockStart, &text[offset], (int)(blockEnds[i] - blockStart), length);
+        if (unpacked != length) {
+            text.clear();
+            return false;
+        }
+        blockStart = blockEnds[i];
+    }
+    return true;
+}
+
+TextStore::TextStore() : budget(0), bytesUsed(0), bytesOriginal(0), closed(false) {}
+
+bool TextStore::put(size_t spineIndex, CompressedText& text) {
+    size_t size = text.memoryUsage();
+    if (full() || contains(spineIndex)) return false;
+    if (bytesUsed + size > budget) {
+        closed = true;
+        return false;
+    }
+
+    bytesUsed += size;
+    bytesOriginal += text.originalSize;
+    CompressedText& stored = chapters[spineIndex];
+    stored.data.swap(text.data);
+    stored.blockEnds.swap(text.blockEnds);
+    stored.originalSize = text.originalSize;
+    return true;
+}
+
+bool TextStore::get(size_t spineIndex, string& text) const {
+    map<size_t, CompressedText>::const_iterator it = chapters.find(spineIndex);
+    return it != chapters.end() && it->second.decompress(text);
+}
+
+void TextStore::clear() {
+    chapters.clear();
+    bytesUsed = 0;
+    bytesOriginal = 0;
+    closed = false;
+}
@@ -0,0 +1,154 @@
+#include "worker_thread.h"
+
+#include "platform.h"
+
+#ifndef __3DS__
+#include <chrono>
+#endif
+
+using namespace std;
+
+namespace {
+
+#ifdef __3DS__
+const size_t workerStackSize = 64 * 1024;
+const u32 systemCoreTimeLimit = 30; // percent of core 1 granted to the app
+#endif
+
+}
+
+#ifdef __3DS__
+
+WorkerThread::WorkerThread() : thread(nullptr) {}
+
+bool WorkerThread::start(Entry entry, void* arg, size_t slot) {
+    join();
+
+    s32 priority = 0x30;
+    svcGetThreadPriority(&priority, CUR_THREAD_HANDLE);
+    priority = priority < 0x3F ? priority + 1 : priority;
+
+    if (slot == 0) {
+        // Core 1 is shared with the system; without a time limit threads there never run.
+        if (R_SUCCEEDED(APT_SetAppCpuTimeLimit(systemCoreTimeLimit))) {
+            thread = threadCreate(entry, arg, workerStackSize, priority, 1, false);
+        }
+    }
+    else if (slot == 1 && isNew3DS()) {
+        thread = threadCreate(entry, arg, workerStackSize, priority, 2, false);
+    }
+    if (!thread) thread = threadCreate(entry, arg, workerStackSize, priority, -2, false);
+    return thread != nullptr;
+}
+
+void WorkerThread::join() {
+    if (!thread) return;
+    threadJoin(thread, U64_MAX);
+    threadFree(thread);
+    thread = nullptr;
+}
+
+bool WorkerThread::running() const {
+    return thread != nullptr;
+}
+
+size_t WorkerThread::coreCount() {
+    return isNew3DS() ? 3 : 2;
+}
+
+Mutex::Mutex() {
+    LightLock_Init(&handle);
+}
+
+void Mutex::lock() {
+    LightLock_Lock(&handle);
+}
+
+void Mutex::unlock() {
+    LightLock_Unlock(&handle);
+}
+
+Condition::Condition() {
+    CondVar_Init(&handle);
+}
+
+void Condition::wait(Mutex& mutex) {
+    CondVar_Wait(&handle, &mutex.handle);
+}
+
+bool Condition::wait(Mutex& mutex, unsigned timeoutMilliseconds) {
+    return CondVar_WaitTimeout(&handle, &mutex.handle, (s64)timeoutMilliseconds * 1000000) == 0;
+}
+
+void Condition::signal() {
+    CondVar_Signal(&handle);
+}
+
+void Condition::broadcast() {
+    CondVar_Broadcast(&handle);
+}
+
+void sleepMilliseconds(unsigned milliseconds) {
+    svcSleepThread((s64)milliseconds * 1000000);
+}
+
+#else
+
+WorkerThread::WorkerThread() {}
+
+bool WorkerThread::start(Entry entry, void* arg, size_t) {
+    join();
+    thread = std::thread(entry, arg);
+    return true;
+}
+
+void WorkerThread::join() {
+    if (thread.joinable()) thread.join();
+}
+
+bool WorkerThread::running() const {
+    return thread.joinable();
+}
+
+size_t WorkerThread::coreCount() {
+    size_t cores = std::thread::hardware_concurrency();
+    return cores > 0 ? cores : 1;
+}
+
+Mutex::Mutex() {}
+
+void Mutex::lock() {
+    handle.lock();
+}
+
+void Mutex::unlock() {
+    handle.unlock();
+}
+
+Condition::Condition() {}
+
+void Condition::wait(Mutex& mutex) {
+    handle.wait(mutex);
+}
+
+bool Condition::wait(Mutex& mutex, unsigned timeoutMilliseconds) {
+    return handle.wait_for(mutex, chrono::milliseconds(timeoutMilliseconds)) == cv_status::no_timeout;
+}
+
+void Condition::signal() {
+    handle.notify_one();
+}
+
+void Condition::broadcast() {
+    handle.notify_all();
+}
+
+void sleepMilliseconds(unsigned milliseconds) {
+    this_thread::sleep_for(chrono::milliseconds(milliseconds));
+}
+
+#endif
+
+WorkerThread::~WorkerThread() {
+    join();
+}
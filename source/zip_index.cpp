@@ -0,0 +1,278 @@
+#include "zip_index.h"
+
+#include <zlib.h>
+#include <algorithm>
+#include <cstring>
+
+#include "profile.h"
+
+using namespace std;
+
+namespace {
+
+const uint32_t endOfCentralDirSignature = 0x06054b50;
+const uint32_t centralDirSignature = 0x02014b50;
+const uint32_t localHeaderSignature = 0x04034b50;
+
+const size_t endOfCentralDirSize = 22;
+const size_t maxCommentSize = 0xFFFF;
+const size_t centralDirHeaderSize = 46;
+const size_t localHeaderSize = 30;
+
+const size_t inflateChunkSize = 16 * 1024;
+
+uint16_t readU16(const unsigned char* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+uint32_t readU32(const unsigned char* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// inflate with the time and bytes charged to its profiling stage; reads are
+// charged inside BufferedFile
+int inflateChunk(z_stream& zs) {
+    PROFILE_SCOPE(STAGE_INFLATE);
+    uLong before = zs.total_out;
+    int status = inflate(&zs, Z_NO_FLUSH);
+    PROFILE_COUNT(COUNTER_BYTES_INFLATED, zs.total_out - before);
+    return status;
+}
+
+}
+
+ZipIndex::ZipIndex() : position(0) {}
+
+ZipIndex::~ZipIndex() {
+    close();
+}
+
+bool ZipIndex::fail(const string& message) {
+    lastError = message;
+    return false;
+}
+
+bool ZipIndex::open(const char* path) {
+    close();
+    if (!file.open(path)) return fail(string("Cannot open ") + path);
+
+    if (!readCentralDirectory()) {
+        file.close();
+        entryList.clear();
+        entriesByName.clear();
+        return false;
+    }
+    return true;
+}
+
+void ZipIndex::close() {
+    file.close();
+    vector<unsigned char>().swap(outputBuffer);
+    entryList.clear();
+    entriesByName.clear();
+}
+
+bool ZipIndex::readCentralDirectory() {
+    uint64_t fileSize = file.size();
+    if (fileSize < endOfCentralDirSize) return fail("File too small to be a ZIP archive");
+
+    // The end-of-central-directory record sits in the last 22 bytes plus an
+    // optional comment. The central directory usually sits right before it,
+    // so it is normally still in the buffer after this read.
+    size_t tailSize = (size_t)min<uint64_t>(fileSize, endOfCentralDirSize + maxCommentSize);
+    vector<unsigned char> tail(tailSize);
+    if (!file.read(fileSize - tailSize, tail.data(), tailSize)) return fail("Failed to read end of archive");
+
+    const unsigned char* eocd = nullptr;
+    for (size_t i = tailSize - endOfCentralDirSize + 1; i-- > 0;) {
+        if (readU32(&tail[i]) == endOfCentralDirSignature) {
+            eocd = &tail[i];
+            break;
+        }
+    }
+    if (!eocd) return fail("No ZIP central directory found");
+
+    uint16_t entryCount = readU16(eocd + 10);
+    uint32_t dirSize = readU32(eocd + 12);
+    uint32_t dirOffset = readU32(eocd + 16);
+    if (entryCount == 0xFFFF || dirSize == 0xFFFFFFFF || dirOffset == 0xFFFFFFFF) {
+        return fail("ZIP64 archives are not supported");
+    }
+    if ((uint64_t)dirOffset + dirSize > fileSize) return fail("Corrupt central directory");
+
+    vector<unsigned char> dir(dirSize);
+    if (dirSize > 0 && !file.read(dirOffset, dir.data(), dirSize)) return fail("Failed to read central directory");
+
+    entryList.reserve(entryCount);
+    size_t pos = 0;
+    for (uint16_t i = 0; i < entryCount; i++) {
+        if (pos + centralDirHeaderSize > dir.size()) return fail("Truncated central directory");
+        const unsigned char* h = &dir[pos];
+        if (readU32(h) != centralDirSignature) return fail("Bad central directory entry");
+
+        uint16_t nameLen = readU16(h + 28);
+        uint16_t extraLen = readU16(h + 30);
+        uint16_t commentLen = readU16(h + 32);
+        if (pos + centralDirHeaderSize + nameLen > dir.size()) return fail("Truncated central directory");
+
+        ZipEntry entry;
+        entry.method = readU16(h + 10);
+        entry.crc32 = readU32(h + 16);
+        entry.compressedSize = readU32(h + 20);
+        entry.uncompressedSize = readU32(h + 24);
+        entry.localHeaderOffset = readU32(h + 42);
+        entry.name.assign((const char*)h + centralDirHeaderSize, nameLen);
+
+        entriesByName[entry.name] = entryList.size();
+        entryList.push_back(entry);
+
+        pos += centralDirHeaderSize + nameLen + extraLen + commentLen;
+    }
+    return true;
+}
+
+const ZipEntry* ZipIndex::find(const string& name) const {
+    map<string, size_t>::const_iterator it = entriesByName.find(name);
+    if (it == entriesByName.end()) return nullptr;
+    return &entryList[it->second];
+}
+
+bool ZipIndex::readEntry(const string& name, string& out) {
+    const ZipEntry* entry = find(name);
+    if (!entry) return fail("Entry not found: " + name);
+    return readEntry(*entry, out);
+}
+
+// The local header repeats the name and may carry a different extra field,
+// so its lengths have to be read before the data offset is known.
+bool ZipIndex::seekToData(const ZipEntry& entry) {
+    if (!file.isOpen()) return fail("Archive is not open");
+
+    unsigned char header[localHeaderSize];
+    if (!file.read(entry.localHeaderOffset, header, localHeaderSize) || readU32(header) != localHeaderSignature) {
+        return fail("Bad local header for " + entry.name);
+    }
+    position = (uint64_t)entry.localHeaderOffset + localHeaderSize + readU16(header + 26) + readU16(header + 28);
+    if (position + entry.compressedSize > file.size()) return fail("Truncated data for " + entry.name);
+    return true;
+}
+
+// The next piece of the entry's compressed data, read in place from the
+// file buffer and consumed.
+const unsigned char* ZipIndex::nextInput(uint32_t remaining, size_t& available) {
+    const unsigned char* data = file.peek(position, remaining, available);
+    position += available;
+    return data;
+}
+
+bool ZipIndex::readEntry(const ZipEntry& entry, string& out) {
+    out.clear();
+    if (!seekToData(entry)) return false;
+
+    out.resize(entry.uncompressedSize);
+    if (entry.uncompressedSize == 0) return true;
+
+    if (entry.method == 0) {
+        if (!file.read(position, &out[0], entry.uncompressedSize)) {
+            out.clear();
+            return fail("Short read for " + entry.name);
+        }
+    }
+    else if (entry.method == 8) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) return fail("inflateInit failed");
+
+        uint32_t remaining = entry.compressedSize;
+        zs.next_out = (Bytef*)&out[0];
+        zs.avail_out = entry.uncompressedSize;
+
+        int status = Z_OK;
+        while (status == Z_OK) {
+            if (zs.avail_in == 0 && remaining > 0) {
+                size_t available = 0;
+                const unsigned char* input = nextInput(remaining, available);
+                if (!input) break;
+                remaining -= available;
+                zs.next_in = (Bytef*)input;
+                zs.avail_in = available;
+            }
+            status = inflateChunk(zs);
+            if (status == Z_BUF_ERROR && zs.avail_in == 0 && remaining == 0) break;
+        }
+        inflateEnd(&zs);
+
+        if (status != Z_STREAM_END || zs.total_out != entry.uncompressedSize) {
+            out.clear();
+            return fail("Inflate failed for " + entry.name);
+        }
+    }
+    else {
+        out.clear();
+        return fail("Unsupported compression method for " + entry.name);
+    }
+
+    if (crc32(0L, (const Bytef*)out.data(), out.size()) != entry.crc32) {
+        out.clear();
+        return fail("CRC mismatch in " + entry.name);
+    }
+    return true;
+}
+
+bool ZipIndex::streamEntry(const ZipEntry& entry, const ZipChunkHandler& handler) {
+    if (!seekToData(entry)) return false;
+    if (entry.method != 0 && entry.method != 8) return fail("Unsupported compression method for " + entry.name);
+
+    outputBuffer.resize(inflateChunkSize);
+    uLong crc = crc32(0L, Z_NULL, 0);
+    uint32_t remaining = entry.compressedSize;
+
+    if (entry.method == 0) {
+        while (remaining > 0) {
+            size_t available = 0;
+            const unsigned char* data = nextInput(min(remaining, (uint32_t)inflateChunkSize), available);
+            if (!data) return fail("Short read for " + entry.name);
+            remaining -= available;
+            crc = crc32(crc, data, available);
+            if (!handler((const char*)data, available)) return true;
+        }
+    }
+    else {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) return fail("inflateInit failed");
+
+        int status = Z_OK;
+        while (status == Z_OK) {
+            if (zs.avail_in == 0 && remaining > 0) {
+                size_t available = 0;
+                const unsigned char* input = nextInput(remaining, available);
+                if (!input) break;
+                remaining -= available;
+                zs.next_in = (Bytef*)input;
+                zs.avail_in = available;
+            }
+            zs.next_out = outputBuffer.data();
+            zs.avail_out = outputBuffer.size();
+            status = inflateChunk(zs);
+
+            size_t produced = outputBuffer.size() - zs.avail_out;
+            if (produced > 0) {
+                crc = crc32(crc, outputBuffer.data(), produced);
+                if (!handler((const char*)outputBuffer.data(), produced)) {
+                    inflateEnd(&zs);
+                    return true;
+                }
+            }
+            if (status == Z_BUF_ERROR && zs.avail_in == 0 && remaining == 0) break;
+        }
+        inflateEnd(&zs);
+
+        if (status != Z_STREAM_END || zs.total_out != entry.uncompressedSize) {
+            return fail("Inflate failed for " + entry.name);
+        }
+    }
+
+    if (crc != entry.crc32) return fail("CRC mismatch in " + entry.name);
+    return true;
+}